@@ -0,0 +1,73 @@
+#pragma once
+
+/*
+ * C API of batch-learn models, for embedding training and scoring into other programs.
+ *
+ * Examples are passed as caller-owned arrays without copying: features of all examples
+ * go one after another, features of example i are features[offsets[i]] .. features[offsets[i+1]-1],
+ * so offsets has n_examples + 1 elements. Feature layout is the same as batch_learn::feature,
+ * index holds field in high bits and in-field index in low n_index_bits bits. Functions with _split suffix take
+ * indices and values of features as separate arrays with the same offsets instead.
+ *
+ * Functions returning int give 0 on success and -1 on error, functions returning pointers give NULL
+ * on error; message of last error of calling thread is returned by bl_last_error.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct bl_feature {
+    uint32_t index;
+    float value;
+} bl_feature;
+
+typedef struct bl_model bl_model;
+typedef struct bl_context bl_context;
+
+/* New ffm model with random weights */
+bl_model * bl_ffm_create(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, int seed, float eta, float lambda);
+
+/* New nn model with random weights */
+bl_model * bl_nn_create(uint32_t n_indices, uint32_t n_index_bits, int seed, float eta, float lambda);
+
+/* Model saved by bl_save or --save-model, mapped read-only and shared with other processes, for scoring only */
+bl_model * bl_load(const char * file_name);
+
+void bl_free(bl_model * model);
+
+/* Print progress messages of model creation, loading and saving to standard output, they are silenced by default */
+void bl_set_verbose(int enabled);
+
+/* Number of threads used by scoring and training, all available by default */
+void bl_set_threads(int n_threads);
+
+/* Store outputs of examples to predictions: probabilities of positive label for models trained with logistic loss
+ * (all created ones), raw scores for loaded models trained with squared or hinge loss */
+int bl_score(bl_model * model, const bl_feature * features, const uint64_t * offsets, uint64_t n_examples, float * predictions);
+
+int bl_score_split(bl_model * model, const uint32_t * indices, const float * values, const uint64_t * offsets, uint64_t n_examples, float * predictions);
+
+/* Scratch memory of bl_score_one for given model, each thread (or coroutine) scoring concurrently needs its own */
+bl_context * bl_context_create(const bl_model * model);
+
+void bl_context_free(bl_context * context);
+
+/* Output of single example as in bl_score (probability of positive label for logistic loss), scored on calling thread without allocation or thread-local state,
+ * so model may be shared between any threads using their own contexts (but not trained meanwhile) */
+float bl_score_one(const bl_model * model, bl_context * context, const bl_feature * features, uint32_t n_features);
+
+/* Train on examples in parallel (hogwild), labels are positive if greater than zero. Mean loss (of loss model is trained with) is stored to loss if it's not NULL */
+int bl_train(bl_model * model, const bl_feature * features, const uint64_t * offsets, const float * labels, uint64_t n_examples, double * loss);
+
+int bl_train_split(bl_model * model, const uint32_t * indices, const float * values, const uint64_t * offsets, const float * labels, uint64_t n_examples, double * loss);
+
+int bl_save(bl_model * model, const char * file_name);
+
+const char * bl_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
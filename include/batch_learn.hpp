@@ -1,18 +1,125 @@
 #pragma once
 
 #include <vector>
+#include <string>
 #include <stdexcept>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <utility>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
 
 namespace batch_learn {
 
-const uint32_t file_format_version = 1;
+const uint32_t file_format_version = 2;
+
+const uint32_t default_checksum_block_size = 65536; // Number of bytes in checksummed data block
 
 struct feature {
     uint32_t index; // Feature index consists of two parts: field (in high bits) and in-field index (in low bits), number of bits to store index specified in file header
     float value;
 };
 
+// Encodings of feature values in packed data files, chosen per field.
+// Packed example is stored as its feature indices followed by their encoded values.
+enum value_encoding : uint8_t {
+    value_float = 0, // Full float
+    value_one = 1, // Implicit 1.0, nothing stored
+    value_u8 = 2, // Unsigned byte multiplied by field scale
+    value_fp16 = 3 // Half precision float
+};
+
+inline uint32_t value_encoding_size(uint8_t encoding) {
+    static const uint32_t sizes[] = { sizeof(float), 0, sizeof(uint8_t), sizeof(uint16_t) };
+    return sizes[encoding & 3];
+}
+
+inline uint16_t float_to_half(float v) {
+#ifdef __F16C__
+    return _cvtss_sh(v, _MM_FROUND_TO_NEAREST_INT);
+#else
+    uint32_t x;
+    memcpy(&x, &v, sizeof(x));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = int32_t((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+
+    if (((x >> 23) & 0xff) == 0xff) // Inf or NaN
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+    if (exp >= 31) // Overflow
+        return sign | 0x7c00;
+
+    if (exp <= 0) { // Subnormal or zero
+        if (exp < -10)
+            return sign;
+
+        mant |= 0x800000;
+
+        uint32_t shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+
+        return sign | (half + (rem > mid || (rem == mid && (half & 1))));
+    }
+
+    uint32_t half = (exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+
+    return sign | (half + (rem > 0x1000 || (rem == 0x1000 && (half & 1)))); // Carry into exponent is correct rounding
+#endif
+}
+
+inline float half_to_float(uint16_t h) {
+#ifdef __F16C__
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+
+    if (exp == 0x1f) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else if (exp != 0) {
+        x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        x = sign;
+    } else { // Subnormal, normalize
+        exp = 127 - 15 + 1;
+
+        while ((mant & 0x400) == 0) {
+            mant <<= 1;
+            exp --;
+        }
+
+        x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+
+    float v;
+    memcpy(&v, &x, sizeof(v));
+    return v;
+#endif
+}
+
 struct file_index {
     uint64_t n_examples; // Number of examples;
     uint32_t n_fields; // Number of feature fields (max + 1)
@@ -23,10 +130,172 @@ struct file_index {
     std::vector<float> labels; // Target values of examples (size N)
     std::vector<uint64_t> offsets; // Offsets of example data (size N +1) in number of features
     std::vector<uint64_t> groups; // Group identifiers for MAP calculation
+
+    uint32_t checksum_block_size = 0; // Number of bytes in checksummed data block, 0 if data isn't checksummed (version 1 files)
+    std::vector<uint32_t> checksums; // CRC32C of data blocks
+
+    std::vector<uint8_t> field_encodings; // Value encoding of each field, empty if data isn't packed
+    std::vector<float> field_scales; // Value scales of u8-encoded fields
+    std::vector<uint64_t> data_offsets; // Offsets of packed example data (size N + 1) in bytes
+
+    bool packed() const {
+        return !field_encodings.empty();
+    }
+
+    // Offset of example data in data file in bytes
+    uint64_t data_offset(uint64_t example) const {
+        return packed() ? data_offsets[example] : offsets[example] * sizeof(feature);
+    }
+
+    uint64_t data_size() const {
+        return data_offset(n_examples);
+    }
 };
 
+// Value packing functions
+
+// Encode example features to out, which should have space for 8 bytes per feature, returns encoded size
+inline size_t encode_features(const feature * features, uint64_t n_features, uint32_t n_index_bits, const std::vector<uint8_t> & field_encodings, const std::vector<float> & field_scales, char * out) {
+    char * values = out + n_features * sizeof(uint32_t);
+
+    for (uint64_t i = 0; i < n_features; ++ i) {
+        uint32_t field = features[i].index >> n_index_bits;
+        float value = features[i].value;
+
+        if (field >= field_encodings.size())
+            throw std::runtime_error("Can't encode feature of unknown field " + std::to_string(field));
+
+        memcpy(out + i * sizeof(uint32_t), &features[i].index, sizeof(uint32_t));
+
+        switch (field_encodings[field]) {
+        case value_float:
+            memcpy(values, &value, sizeof(float));
+            values += sizeof(float);
+            break;
+        case value_one:
+            break;
+        case value_u8:
+            *values++ = char(uint8_t(std::min(std::max(value / field_scales[field] + 0.5f, 0.0f), 255.0f)));
+            break;
+        case value_fp16: {
+            uint16_t h = float_to_half(value);
+            memcpy(values, &h, sizeof(uint16_t));
+            values += sizeof(uint16_t);
+            break;
+        }
+        }
+    }
+
+    return values - out;
+}
+
+// Decode packed examples [from, to) of index, data points to packed data of first example
+inline void decode_features(const file_index & index, uint64_t from, uint64_t to, const char * data, feature * features) {
+    uint64_t data_start = index.data_offsets[from];
+
+    for (uint64_t ei = from; ei < to; ++ ei) {
+        uint64_t n_features = index.offsets[ei+1] - index.offsets[ei];
+
+        const char * indices = data + (index.data_offsets[ei] - data_start);
+        const char * values = indices + n_features * sizeof(uint32_t);
+        const char * end = data + (index.data_offsets[ei+1] - data_start);
+
+        for (uint64_t i = 0; i < n_features; ++ i, ++ features) {
+            memcpy(&features->index, indices + i * sizeof(uint32_t), sizeof(uint32_t));
+
+            uint32_t field = features->index >> index.n_index_bits;
+
+            if (field >= index.n_fields || values + value_encoding_size(index.field_encodings[field]) > end)
+                throw std::runtime_error("Invalid packed data of example " + std::to_string(ei));
+
+            switch (index.field_encodings[field]) {
+            case value_float:
+                memcpy(&features->value, values, sizeof(float));
+                values += sizeof(float);
+                break;
+            case value_one:
+                features->value = 1.0f;
+                break;
+            case value_u8:
+                features->value = uint8_t(*values++) * index.field_scales[field];
+                break;
+            case value_fp16: {
+                uint16_t h;
+                memcpy(&h, values, sizeof(uint16_t));
+                features->value = half_to_float(h);
+                values += sizeof(uint16_t);
+                break;
+            }
+            }
+        }
+    }
+}
+
+// Checksum functions
+
+inline uint32_t crc32c(uint32_t crc, const void * data, size_t size) {
+    const unsigned char * p = (const unsigned char *) data;
+
+    crc = ~crc;
+
+#ifdef __SSE4_2__
+    uint64_t crc64 = crc;
+
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+
+    crc = crc64;
+
+    for (; size > 0; -- size, ++ p)
+        crc = _mm_crc32_u8(crc, *p);
+#else
+    for (; size > 0; -- size, ++ p) {
+        crc ^= *p;
+
+        for (int k = 0; k < 8; ++ k)
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    }
+#endif
+
+    return ~crc;
+}
+
+// Extend data byte range to checksum block boundaries, so it may be verified
+inline std::pair<uint64_t, uint64_t> checksum_range(const file_index & index, uint64_t from, uint64_t to) {
+    if (index.checksum_block_size == 0 || from == to)
+        return std::make_pair(from, to);
+
+    uint64_t block_size = index.checksum_block_size;
+
+    return std::make_pair(from / block_size * block_size, std::min((to + block_size - 1) / block_size * block_size, index.data_size()));
+}
+
+// Verify data of byte range returned by checksum_range
+inline void verify_checksums(const file_index & index, uint64_t from, uint64_t to, const char * data) {
+    using namespace std;
+
+    if (index.checksum_block_size == 0)
+        return;
+
+    for (uint64_t block = from / index.checksum_block_size; from < to; ++ block) {
+        uint64_t block_end = std::min<uint64_t>(from + index.checksum_block_size, to);
+
+        if (block >= index.checksums.size() || crc32c(0, data, block_end - from) != index.checksums[block])
+            throw runtime_error("Checksum mismatch in data block " + to_string(block) + ", data file is corrupted");
+
+        data += block_end - from;
+        from = block_end;
+    }
+}
+
 // Index IO functions
 
+inline void write_index_header(FILE * file, const file_index & index);
+inline void write_index_trailer(FILE * file, const file_index & index);
+
 inline void write_index(const std::string & file_name, const file_index & index) {
     using namespace std;
 
@@ -39,17 +308,47 @@ inline void write_index(const std::string & file_name, const file_index & index)
     if (index.groups.size() != index.n_examples)
         throw runtime_error("Invalid index groups size");
 
+    if (index.packed() && (index.data_offsets.size() != index.n_examples + 1 || index.field_encodings.size() != index.n_fields || index.field_scales.size() != index.n_fields))
+        throw runtime_error("Invalid index packing sections size");
+
     if ((1ul << index.n_index_bits) < index.n_indices)
         throw runtime_error("Not enough index bits allocated to store max index");
 
-    if ((1ul << (32 - index.n_index_bits)) < index.n_fields)
-        throw runtime_error("Not enough field bits allocated to store max field");
-
     FILE * file = fopen(file_name.c_str(), "wb");
 
     if(file == nullptr)
         throw runtime_error(string("Can't open index file ") + file_name);
 
+    write_index_header(file, index);
+
+    // Index itself
+
+    if (fwrite(index.labels.data(), sizeof(float), index.labels.size(), file) != index.labels.size())
+        throw runtime_error("Error writing labels");
+
+    if (fwrite(index.offsets.data(), sizeof(uint64_t), index.offsets.size(), file) != index.offsets.size())
+        throw runtime_error("Error writing offsets");
+
+    if (fwrite(index.groups.data(), sizeof(uint64_t), index.groups.size(), file) != index.groups.size())
+        throw runtime_error("Error writing groups");
+
+    if (fwrite(index.data_offsets.data(), sizeof(uint64_t), index.data_offsets.size(), file) != index.data_offsets.size())
+        throw runtime_error("Error writing data offsets");
+
+    write_index_trailer(file, index);
+
+    fclose(file);
+};
+
+inline void write_index_header(FILE * file, const file_index & index) {
+    using namespace std;
+
+    if ((1ul << index.n_index_bits) < index.n_indices)
+        throw runtime_error("Not enough index bits allocated to store max index");
+
+    if ((1ul << (32 - index.n_index_bits)) < index.n_fields)
+        throw runtime_error("Not enough field bits allocated to store max field");
+
     if (fwrite(&file_format_version, sizeof(uint32_t), 1, file) != 1)
         throw runtime_error("Error writing format version");
 
@@ -67,36 +366,46 @@ inline void write_index(const std::string & file_name, const file_index & index)
     if (fwrite(&index.n_index_bits, sizeof(uint32_t), 1, file) != 1)
         throw runtime_error("Error writing index bit count");
 
-    // Index itself
+    uint64_t n_checksums = index.checksums.size();
 
-    if (fwrite(index.labels.data(), sizeof(float), index.labels.size(), file) != index.labels.size())
-        throw runtime_error("Error writing labels");
+    if (fwrite(&index.checksum_block_size, sizeof(uint32_t), 1, file) != 1)
+        throw runtime_error("Error writing checksum block size");
 
-    if (fwrite(index.offsets.data(), sizeof(uint64_t), index.offsets.size(), file) != index.offsets.size())
-        throw runtime_error("Error writing offsets");
+    if (fwrite(&n_checksums, sizeof(uint64_t), 1, file) != 1)
+        throw runtime_error("Error writing checksum count");
 
-    if (fwrite(index.groups.data(), sizeof(uint64_t), index.groups.size(), file) != index.groups.size())
-        throw runtime_error("Error writing groups");
+    uint32_t n_encoded_fields = index.field_encodings.size();
 
-    fclose(file);
+    if (fwrite(&n_encoded_fields, sizeof(uint32_t), 1, file) != 1)
+        throw runtime_error("Error writing encoded field count");
 };
 
-inline file_index read_index(const std::string & file_name) {
+// Sections following example data offsets: checksums and field value encodings
+inline void write_index_trailer(FILE * file, const file_index & index) {
     using namespace std;
 
-    file_index index;
-    FILE * file = fopen(file_name.c_str(), "rb");
+    if (fwrite(index.checksums.data(), sizeof(uint32_t), index.checksums.size(), file) != index.checksums.size())
+        throw runtime_error("Error writing checksums");
 
-    if(file == nullptr)
-        throw runtime_error(string("Can't open index file ") + file_name);
+    if (fwrite(index.field_encodings.data(), sizeof(uint8_t), index.field_encodings.size(), file) != index.field_encodings.size())
+        throw runtime_error("Error writing field encodings");
+
+    if (fwrite(index.field_scales.data(), sizeof(float), index.field_scales.size(), file) != index.field_scales.size())
+        throw runtime_error("Error writing field scales");
+};
+
+// Read index header, returning sizes of checksum and field encoding sections, sections follow it in order
+// labels, offsets, groups, data offsets (if packed), checksums, field encodings and scales
+inline void read_index_header(FILE * file, file_index & index, uint64_t & n_checksums, uint32_t & n_encoded_fields) {
+    using namespace std;
 
     uint32_t version;
 
     if (fread(&version, sizeof(uint32_t), 1, file) != 1)
         throw runtime_error("Error reading version");
 
-    if (version != file_format_version)
-        throw runtime_error("File format version mismatch");
+    if (version < 1 || version > file_format_version)
+        throw runtime_error("Unsupported file format version " + to_string(version));
 
     // Header
 
@@ -112,6 +421,38 @@ inline file_index read_index(const std::string & file_name) {
     if (fread(&index.n_index_bits, sizeof(uint32_t), 1, file) != 1)
         throw runtime_error("Error reading index bit count");
 
+    n_checksums = 0;
+    n_encoded_fields = 0;
+
+    if (version >= 2) {
+        if (fread(&index.checksum_block_size, sizeof(uint32_t), 1, file) != 1)
+            throw runtime_error("Error reading checksum block size");
+
+        if (fread(&n_checksums, sizeof(uint64_t), 1, file) != 1)
+            throw runtime_error("Error reading checksum count");
+
+        if (fread(&n_encoded_fields, sizeof(uint32_t), 1, file) != 1)
+            throw runtime_error("Error reading encoded field count");
+
+        if (n_encoded_fields != 0 && n_encoded_fields != index.n_fields)
+            throw runtime_error("Encoded field count doesn't match field count");
+    }
+};
+
+inline file_index read_index(const std::string & file_name) {
+    using namespace std;
+
+    file_index index;
+    FILE * file = fopen(file_name.c_str(), "rb");
+
+    if(file == nullptr)
+        throw runtime_error(string("Can't open index file ") + file_name);
+
+    uint64_t n_checksums;
+    uint32_t n_encoded_fields;
+
+    read_index_header(file, index, n_checksums, n_encoded_fields);
+
     // Reserve space for y and offsets
     index.labels.resize(index.n_examples, 0);
     index.offsets.resize(index.n_examples + 1, 0);
@@ -126,6 +467,33 @@ inline file_index read_index(const std::string & file_name) {
     if (fread(index.groups.data(), sizeof(uint64_t), index.groups.size(), file) != index.groups.size())
         throw runtime_error("Error reading groups");
 
+    if (n_encoded_fields > 0) {
+        index.data_offsets.resize(index.n_examples + 1, 0);
+
+        if (fread(index.data_offsets.data(), sizeof(uint64_t), index.data_offsets.size(), file) != index.data_offsets.size())
+            throw runtime_error("Error reading data offsets");
+    }
+
+    index.checksums.resize(n_checksums);
+    index.field_encodings.resize(n_encoded_fields);
+    index.field_scales.resize(n_encoded_fields);
+
+    if (fread(index.checksums.data(), sizeof(uint32_t), index.checksums.size(), file) != index.checksums.size())
+        throw runtime_error("Error reading checksums");
+
+    if (fread(index.field_encodings.data(), sizeof(uint8_t), index.field_encodings.size(), file) != index.field_encodings.size())
+        throw runtime_error("Error reading field encodings");
+
+    if (fread(index.field_scales.data(), sizeof(float), index.field_scales.size(), file) != index.field_scales.size())
+        throw runtime_error("Error reading field scales");
+
+    for (auto encoding : index.field_encodings)
+        if (encoding > value_fp16)
+            throw runtime_error("Unknown value encoding " + to_string(encoding));
+
+    if (index.checksum_block_size > 0 && n_checksums != (index.data_size() + index.checksum_block_size - 1) / index.checksum_block_size)
+        throw runtime_error("Checksum count doesn't match data size");
+
     fclose(file);
 
     return index;
@@ -150,11 +518,15 @@ inline void read_batch(const std::string & file_name, uint64_t from, uint64_t to
     if (file == nullptr)
         throw runtime_error(string("Can't open data file ") + file_name);
 
-    if (fseek((FILE *)file, from * sizeof(feature), SEEK_SET) != 0)
-        throw new runtime_error("Can't set file pos");
+    if (fseek(file, from * sizeof(feature), SEEK_SET) != 0) {
+        fclose(file);
+        throw runtime_error("Can't set file pos");
+    }
 
-    if (fread(features.data(), sizeof(feature), features.size(), (FILE *)file) != features.size())
-        throw new runtime_error("Can't read data");
+    if (fread(features.data(), sizeof(feature), features.size(), file) != features.size()) {
+        fclose(file);
+        throw runtime_error("Can't read data, data file is truncated");
+    }
 
     fclose(file);
 }
@@ -165,33 +537,445 @@ inline std::vector<feature> read_batch(const std::string & file_name, uint64_t f
     return features;
 }
 
-// Data file writer
+// Buffered file writer, fills large aligned buffers and writes them to disk in background thread,
+// optionally bypassing page cache with O_DIRECT
+
+constexpr size_t direct_io_align = 4096;
+
+class buffered_file_writer {
+    int fd;
+    bool direct;
+    size_t buffer_size;
+
+    char * buffers[2];
+    char * buffer; // Buffer being filled
+    size_t filled;
+    uint64_t written; // Total number of bytes accepted
+
+    // Flusher thread state
+    std::thread flusher;
+    std::mutex mutex;
+    std::condition_variable cv;
+    const char * pending;
+    size_t pending_size;
+    bool stopping;
+    std::string error;
+public:
+    buffered_file_writer(const std::string & file_name, bool direct = false, size_t buffer_size = 8 * 1024 * 1024):
+        direct(direct), buffer_size(buffer_size), filled(0), written(0), pending(nullptr), pending_size(0), stopping(false) {
+
+        using namespace std;
+
+        if (buffer_size == 0 || buffer_size % direct_io_align != 0)
+            throw runtime_error("Writer buffer size should be multiple of " + to_string(direct_io_align));
+
+        fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+
+        if (fd < 0 && direct && errno == EINVAL) { // File system doesn't support direct IO
+            fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            this->direct = false;
+        }
+
+        if (fd < 0)
+            throw runtime_error(string("Can't open file ") + file_name);
+
+        for (int i = 0; i < 2; ++ i)
+            if (posix_memalign((void **) &buffers[i], direct_io_align, buffer_size) != 0)
+                throw bad_alloc();
+
+        buffer = buffers[0];
+        flusher = thread([this] { flush_loop(); });
+    }
+
+    buffered_file_writer(const buffered_file_writer &) = delete;
+    buffered_file_writer & operator = (const buffered_file_writer &) = delete;
+
+    ~buffered_file_writer() {
+        if (fd >= 0) {
+            try {
+                close();
+            } catch (...) {
+                // Can't throw from destructor, close should be called explicitly to get errors
+            }
+        }
+
+        free(buffers[0]);
+        free(buffers[1]);
+    }
+
+    void write(const void * data, size_t size) {
+        const char * p = (const char *) data;
+
+        written += size;
+
+        while (size > 0) {
+            size_t chunk = std::min(size, buffer_size - filled);
+
+            memcpy(buffer + filled, p, chunk);
+            filled += chunk;
+            p += chunk;
+            size -= chunk;
+
+            if (filled == buffer_size)
+                submit();
+        }
+    }
+
+    uint64_t size() const {
+        return written;
+    }
+
+    // Flush all data and close file
+    void close() {
+        if (fd < 0)
+            return;
+
+        size_t tail = filled;
+
+        if (direct) { // Direct writes should be aligned, pad last block and truncate file later
+            filled = (filled + direct_io_align - 1) / direct_io_align * direct_io_align;
+            memset(buffer + tail, 0, filled - tail);
+        }
+
+        if (filled > 0)
+            submit();
+
+        bool failed = shutdown();
+
+        if (!error.empty())
+            throw std::runtime_error(error);
+
+        if (failed)
+            throw std::runtime_error("Error closing file");
+    }
+private:
+    // Pass filled buffer to flusher thread and switch to other one
+    void submit() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        cv.wait(lock, [this] { return pending == nullptr; });
+
+        if (!error.empty()) { // Writer is unusable after error, release flusher and file before reporting it
+            lock.unlock();
+            shutdown();
+
+            throw std::runtime_error(error);
+        }
+
+        pending = buffer;
+        pending_size = filled;
+        cv.notify_all();
+
+        buffer = (buffer == buffers[0]) ? buffers[1] : buffers[0];
+        filled = 0;
+    }
+
+    // Wait for pending write, stop flusher thread and close file, returns whether truncating or closing it failed
+    bool shutdown() {
+        if (fd < 0)
+            return false;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return pending == nullptr; });
+            stopping = true;
+            cv.notify_all();
+        }
+
+        flusher.join();
+
+        bool failed = (direct && error.empty() && ftruncate(fd, written) != 0);
+
+        failed |= (::close(fd) != 0);
+        fd = -1;
+
+        return failed;
+    }
+
+    void flush_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            cv.wait(lock, [this] { return pending != nullptr || stopping; });
+
+            if (pending == nullptr)
+                return;
+
+            const char * data = pending;
+            size_t size = pending_size;
+
+            lock.unlock();
+
+            std::string write_error;
+
+            while (size > 0) {
+                ssize_t res = ::write(fd, data, size);
+
+                if (res < 0 && errno == EINTR)
+                    continue;
+
+                if (res <= 0) {
+                    write_error = std::string("Error writing file: ") + strerror(errno);
+                    break;
+                }
+
+                data += res;
+                size -= res;
+            }
+
+            lock.lock();
+
+            if (!write_error.empty())
+                error = write_error;
+
+            pending = nullptr;
+            cv.notify_all();
+        }
+    }
+};
+
+
+// Data file writer, computes checksums of data blocks and optionally packs values with given field encodings
 
 class stream_data_writer {
-    FILE * file;
+    buffered_file_writer writer;
     uint64_t offset;
+
+    uint32_t block_crc; // Checksum of current block
+    uint32_t block_filled; // Number of bytes in current block
+
+    std::vector<char> packed_buffer;
 public:
-    stream_data_writer(const std::string & file_name): offset(0) {
-        using namespace std;
+    const uint32_t checksum_block_size;
+    std::vector<uint32_t> checksums;
 
-        file = fopen(file_name.c_str(), "wb");
+    const uint32_t n_index_bits;
+    const std::vector<uint8_t> field_encodings; // Empty if values aren't packed
+    const std::vector<float> field_scales;
+public:
+    stream_data_writer(const std::string & file_name, bool direct = false): stream_data_writer(file_name, direct, 0, {}, {}) {}
 
-        if (file == nullptr)
-            throw runtime_error(string("Can't open data file ") + file_name);
-    }
+    stream_data_writer(const std::string & file_name, bool direct, uint32_t n_index_bits, const std::vector<uint8_t> & field_encodings, const std::vector<float> & field_scales):
+        writer(file_name, direct), offset(0), block_crc(0), block_filled(0), checksum_block_size(default_checksum_block_size),
+        n_index_bits(n_index_bits), field_encodings(field_encodings), field_scales(field_scales) {}
+
+    // Write features of one example, returns offset of its end in features
+    uint64_t write(const feature * features, uint64_t n_features) {
+        if (field_encodings.empty()) {
+            write_bytes((const char *) features, n_features * sizeof(feature));
+        } else {
+            packed_buffer.resize(n_features * sizeof(feature));
+            write_bytes(packed_buffer.data(), encode_features(features, n_features, n_index_bits, field_encodings, field_scales, packed_buffer.data()));
+        }
+
+        offset += n_features;
 
-    ~stream_data_writer() {
-        fclose((FILE *)file);
+        return offset;
     }
 
     uint64_t write(const std::vector<feature> & features) {
-        if (fwrite(features.data(), sizeof(feature), features.size(), (FILE *)file) != features.size())
-            throw std::runtime_error("Error writing example count");
-
-        offset += features.size();
+        return write(features.data(), features.size());
+    }
 
+    // Number of written features
+    uint64_t size() const {
         return offset;
     }
+
+    // Number of written bytes
+    uint64_t data_size() const {
+        return writer.size();
+    }
+
+    void close() {
+        if (block_filled > 0)
+            finish_block();
+
+        writer.close();
+    }
+private:
+    void write_bytes(const char * data, uint64_t size) {
+        writer.write(data, size);
+
+        while (size > 0) {
+            uint32_t chunk = std::min<uint64_t>(size, checksum_block_size - block_filled);
+
+            block_crc = crc32c(block_crc, data, chunk);
+            block_filled += chunk;
+            data += chunk;
+            size -= chunk;
+
+            if (block_filled == checksum_block_size)
+                finish_block();
+        }
+    }
+
+    void finish_block() {
+        checksums.push_back(block_crc);
+        block_crc = 0;
+        block_filled = 0;
+    }
+};
+
+
+// Index file writer, spills index sections to temporary files and assembles index from them on finish,
+// so memory usage doesn't depend on number of examples. Temporary files are removed if writer is destroyed
+// without finishing, for example on error
+
+class stream_index_writer {
+    std::string file_name;
+
+    buffered_file_writer labels_writer;
+    buffered_file_writer offsets_writer;
+    buffered_file_writer groups_writer;
+    std::unique_ptr<buffered_file_writer> data_offsets_writer; // Created only for packed data, unpacked offsets are derived from feature offsets
+
+    uint64_t n_examples;
+    bool finished;
+public:
+    stream_index_writer(const std::string & file_name):
+        file_name(file_name),
+        labels_writer(file_name + ".labels.tmp", false, 1024 * 1024),
+        offsets_writer(file_name + ".offsets.tmp", false, 1024 * 1024),
+        groups_writer(file_name + ".groups.tmp", false, 1024 * 1024),
+        n_examples(0), finished(false) {
+
+        uint64_t zero_offset = 0;
+        offsets_writer.write(&zero_offset, sizeof(uint64_t));
+    }
+
+    stream_index_writer(const stream_index_writer &) = delete;
+    stream_index_writer & operator = (const stream_index_writer &) = delete;
+
+    ~stream_index_writer() {
+        if (finished)
+            return;
+
+        for (auto writer : { &labels_writer, &offsets_writer, &groups_writer, data_offsets_writer.get() }) {
+            try {
+                if (writer != nullptr)
+                    writer->close();
+            } catch (...) {
+                // Files are removed anyway
+            }
+        }
+
+        for (const char * section : { ".labels.tmp", ".offsets.tmp", ".groups.tmp", ".data_offsets.tmp" })
+            remove((file_name + section).c_str());
+    }
+
+    // Add example which was just written to data
+    void write(float label, uint64_t group, const stream_data_writer & data) {
+        uint64_t offset = data.size();
+
+        labels_writer.write(&label, sizeof(float));
+        groups_writer.write(&group, sizeof(uint64_t));
+        offsets_writer.write(&offset, sizeof(uint64_t));
+
+        if (!data.field_encodings.empty()) {
+            uint64_t data_offset = data.data_size();
+
+            start_data_offsets();
+            data_offsets_writer->write(&data_offset, sizeof(uint64_t));
+        }
+
+        n_examples ++;
+    }
+
+    uint64_t size() const {
+        return n_examples;
+    }
+
+    // Assemble index of closed data file
+    void finish(const stream_data_writer & data, uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits) {
+        using namespace std;
+
+        file_index index;
+        index.n_examples = n_examples;
+        index.n_fields = n_fields;
+        index.n_indices = n_indices;
+        index.n_index_bits = n_index_bits;
+        index.checksum_block_size = data.checksum_block_size;
+        index.checksums = data.checksums;
+        index.field_encodings = data.field_encodings;
+        index.field_scales = data.field_scales;
+
+        if (index.packed() && (index.field_encodings.size() != n_fields || data.n_index_bits != n_index_bits))
+            throw runtime_error("Data value encodings don't match index");
+
+        if (index.packed())
+            start_data_offsets();
+
+        labels_writer.close();
+        offsets_writer.close();
+        groups_writer.close();
+
+        if (data_offsets_writer)
+            data_offsets_writer->close();
+
+        FILE * file = fopen(file_name.c_str(), "wb");
+
+        if(file == nullptr)
+            throw runtime_error(string("Can't open index file ") + file_name);
+
+        FILE * section_file = nullptr;
+
+        try {
+            write_index_header(file, index);
+
+            vector<char> buffer(4 * 1024 * 1024);
+
+            for (const char * section : { ".labels.tmp", ".offsets.tmp", ".groups.tmp", ".data_offsets.tmp" }) {
+                string section_file_name = file_name + section;
+
+                if (!index.packed() && string(section) == ".data_offsets.tmp")
+                    continue;
+
+                section_file = fopen(section_file_name.c_str(), "rb");
+
+                if (section_file == nullptr)
+                    throw runtime_error(string("Can't open temporary index file ") + section_file_name);
+
+                size_t read;
+                while ((read = fread(buffer.data(), 1, buffer.size(), section_file)) > 0)
+                    if (fwrite(buffer.data(), 1, read, file) != read)
+                        throw runtime_error("Error writing index");
+
+                fclose(section_file);
+                section_file = nullptr;
+            }
+
+            write_index_trailer(file, index);
+        } catch (...) {
+            if (section_file != nullptr)
+                fclose(section_file);
+
+            fclose(file);
+            remove(file_name.c_str());
+
+            throw;
+        }
+
+        if (fclose(file) != 0) {
+            remove(file_name.c_str());
+            throw runtime_error("Error writing index");
+        }
+
+        for (const char * section : { ".labels.tmp", ".offsets.tmp", ".groups.tmp", ".data_offsets.tmp" })
+            remove((file_name + section).c_str());
+
+        finished = true;
+    }
+private:
+    void start_data_offsets() {
+        if (data_offsets_writer)
+            return;
+
+        uint64_t zero_offset = 0;
+
+        data_offsets_writer.reset(new buffered_file_writer(file_name + ".data_offsets.tmp", false, 1024 * 1024));
+        data_offsets_writer->write(&zero_offset, sizeof(uint64_t));
+    }
 };
 
 };
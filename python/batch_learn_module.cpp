@@ -0,0 +1,485 @@
+// Python module over C API of batch-learn models.
+//
+// Arrays are taken through buffer protocol without copying (NumPy arrays, array.array, memoryview...):
+// features - C-contiguous buffer of 8-byte (uint32 index, float32 value) records, like NumPy structured
+// array with dtype [('index', '<u4'), ('value', '<f4')]; offsets - uint64 buffer of n_examples + 1 feature
+// offsets; labels - float32 buffer. Separate uint32 index and float32 value arrays are also accepted, passed
+// to split C API functions as they are. Typed buffers of other item types are rejected, untyped byte buffers (bytes, bytearray)
+// are taken as raw items. GIL is released while models score or train on OpenMP threads.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <batch_learn.h>
+
+#include <string>
+#include <cstring>
+
+
+struct model_object {
+    PyObject_HEAD
+    bl_model * model;
+};
+
+
+static PyObject * error_type;
+
+
+// Item type codes of buffer format in struct module syntax, with native or little-endian byte order marks, field names
+// and struct braces dropped (NumPy record "T{<I:index:<f:value:}" gives "If") and long replaced by sized code.
+// Empty for big-endian formats and ones with repeat counts, which are never accepted
+static std::string item_codes(const char * format) {
+    std::string codes;
+
+    for (const char * p = format != nullptr ? format : "B"; *p != 0; ++ p) {
+        char c = *p;
+
+        if (c == '@' || c == '=' || c == '<' || c == 'T' || c == '{' || c == '}')
+            continue;
+
+        if (c == ':') { // Field name
+            p = strchr(p + 1, ':');
+
+            if (p == nullptr)
+                return "";
+
+            continue;
+        }
+
+        if (c == 'L')
+            c = sizeof(long) == 8 ? 'Q' : 'I';
+
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+            return "";
+
+        codes += c;
+    }
+
+    return codes;
+}
+
+
+// Buffer view released on scope exit
+class buffer_view {
+public:
+    Py_buffer view;
+    bool acquired;
+public:
+    buffer_view(): acquired(false) {}
+
+    ~buffer_view() {
+        release();
+    }
+
+    void release() {
+        if (acquired)
+            PyBuffer_Release(&view);
+
+        acquired = false;
+    }
+
+    // Get contiguous buffer of items of given type codes and size, raising exception on failure
+    bool get(PyObject * obj, const char * codes, Py_ssize_t item_size, const char * name, bool writable = false) {
+        if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0)) != 0)
+            return false;
+
+        acquired = true;
+
+        std::string format_codes = item_codes(view.format);
+        bool raw_bytes = view.itemsize == 1 && (format_codes == "B" || format_codes == "b" || format_codes == "c");
+
+        if (!raw_bytes && (format_codes != codes || view.itemsize != item_size)) {
+            PyErr_Format(PyExc_TypeError, "%s buffer has item format '%s' of %zd bytes, '%s' of %zd bytes expected", name,
+                         view.format != nullptr ? view.format : "B", view.itemsize, codes, item_size);
+            return false;
+        }
+
+        if (view.len % item_size != 0) {
+            PyErr_Format(PyExc_ValueError, "%s buffer size should be multiple of %zd bytes", name, item_size);
+            return false;
+        }
+
+        return true;
+    }
+
+    Py_ssize_t count(Py_ssize_t item_size) const {
+        return view.len / item_size;
+    }
+
+    template <typename T>
+    T * data() const {
+        return (T *) view.buf;
+    }
+};
+
+
+// New float32 array of given size: NumPy one if NumPy is available, array.array otherwise
+static PyObject * new_float_array(Py_ssize_t n) {
+    PyObject * numpy = PyImport_ImportModule("numpy");
+
+    if (numpy != nullptr) {
+        PyObject * result = PyObject_CallMethod(numpy, "zeros", "ns", n, "float32");
+        Py_DECREF(numpy);
+        return result;
+    }
+
+    PyErr_Clear();
+
+    PyObject * array = PyImport_ImportModule("array");
+
+    if (array == nullptr)
+        return nullptr;
+
+    PyObject * zeros = PyBytes_FromStringAndSize(nullptr, n * sizeof(float));
+
+    if (zeros == nullptr) {
+        Py_DECREF(array);
+        return nullptr;
+    }
+
+    memset(PyBytes_AS_STRING(zeros), 0, n * sizeof(float));
+
+    PyObject * result = PyObject_CallMethod(array, "array", "sO", "f", zeros);
+
+    Py_DECREF(zeros);
+    Py_DECREF(array);
+
+    return result;
+}
+
+
+// Features of batch given either as records or as separate index and value arrays
+class feature_batch {
+    buffer_view features_view, indices_view, values_view, offsets_view;
+public:
+    const bl_feature * features; // Null if features are given as separate arrays
+    const uint32_t * indices;
+    const float * values;
+    const uint64_t * offsets;
+    Py_ssize_t n_examples;
+public:
+    feature_batch(): features(nullptr), indices(nullptr), values(nullptr) {}
+
+    bool parse(PyObject * features_obj, PyObject * offsets_obj, PyObject * indices_obj, PyObject * values_obj) {
+        if (!offsets_view.get(offsets_obj, "Q", sizeof(uint64_t), "offsets"))
+            return false;
+
+        if (offsets_view.count(sizeof(uint64_t)) < 1) {
+            PyErr_SetString(PyExc_ValueError, "offsets should have n_examples + 1 elements");
+            return false;
+        }
+
+        offsets = offsets_view.data<uint64_t>();
+        n_examples = offsets_view.count(sizeof(uint64_t)) - 1;
+
+        Py_ssize_t n_features;
+
+        if (features_obj != nullptr && features_obj != Py_None) {
+            if (!features_view.get(features_obj, "If", sizeof(bl_feature), "features"))
+                return false;
+
+            features = features_view.data<bl_feature>();
+            n_features = features_view.count(sizeof(bl_feature));
+        } else if (indices_obj != nullptr && values_obj != nullptr) {
+            if (!indices_view.get(indices_obj, "I", sizeof(uint32_t), "indices") || !values_view.get(values_obj, "f", sizeof(float), "values"))
+                return false;
+
+            n_features = indices_view.count(sizeof(uint32_t));
+
+            if (values_view.count(sizeof(float)) != n_features) {
+                PyErr_SetString(PyExc_ValueError, "indices and values should have the same length");
+                return false;
+            }
+
+            indices = indices_view.data<uint32_t>();
+            values = values_view.data<float>();
+        } else {
+            PyErr_SetString(PyExc_TypeError, "features or indices and values should be given");
+            return false;
+        }
+
+        for (Py_ssize_t i = 0; i < n_examples; ++ i) {
+            if (offsets[i] > offsets[i+1] || offsets[i+1] > uint64_t(n_features)) {
+                PyErr_SetString(PyExc_ValueError, "offsets should be non-decreasing and within features");
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    int score(bl_model * model, float * predictions) const {
+        if (features != nullptr)
+            return bl_score(model, features, offsets, n_examples, predictions);
+
+        return bl_score_split(model, indices, values, offsets, n_examples, predictions);
+    }
+
+    int train(bl_model * model, const float * labels, double * loss) const {
+        if (features != nullptr)
+            return bl_train(model, features, offsets, labels, n_examples, loss);
+
+        return bl_train_split(model, indices, values, offsets, labels, n_examples, loss);
+    }
+};
+
+
+static void model_dealloc(model_object * self) {
+    bl_free(self->model);
+    PyObject_Free(self);
+}
+
+
+static PyObject * model_score(model_object * self, PyObject * args, PyObject * kwargs) {
+    static const char * keywords[] = { "features", "offsets", "indices", "values", "out", nullptr };
+
+    PyObject * features_obj = Py_None, * offsets_obj = nullptr, * indices_obj = nullptr, * values_obj = nullptr, * out_obj = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO$OOO", (char **) keywords, &features_obj, &offsets_obj, &indices_obj, &values_obj, &out_obj))
+        return nullptr;
+
+    if (offsets_obj == nullptr) {
+        PyErr_SetString(PyExc_TypeError, "offsets should be given");
+        return nullptr;
+    }
+
+    feature_batch batch;
+
+    if (!batch.parse(features_obj, offsets_obj, indices_obj, values_obj))
+        return nullptr;
+
+    PyObject * result = out_obj == Py_None ? new_float_array(batch.n_examples) : (Py_INCREF(out_obj), out_obj);
+
+    if (result == nullptr)
+        return nullptr;
+
+    buffer_view predictions;
+
+    if (!predictions.get(result, "f", sizeof(float), "out", true) || predictions.count(sizeof(float)) < batch.n_examples) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "out should have float32 element per example");
+
+        predictions.release();
+        Py_DECREF(result);
+        return nullptr;
+    }
+
+    int status;
+
+    Py_BEGIN_ALLOW_THREADS
+    status = batch.score(self->model, predictions.data<float>());
+    Py_END_ALLOW_THREADS
+
+    if (status != 0) {
+        PyErr_SetString(error_type, bl_last_error());
+        predictions.release();
+        Py_DECREF(result);
+        return nullptr;
+    }
+
+    return result;
+}
+
+
+static PyObject * model_train(model_object * self, PyObject * args, PyObject * kwargs) {
+    static const char * keywords[] = { "features", "offsets", "labels", "indices", "values", nullptr };
+
+    PyObject * features_obj = Py_None, * offsets_obj = nullptr, * labels_obj = nullptr, * indices_obj = nullptr, * values_obj = nullptr;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOO$OO", (char **) keywords, &features_obj, &offsets_obj, &labels_obj, &indices_obj, &values_obj))
+        return nullptr;
+
+    if (offsets_obj == nullptr || labels_obj == nullptr) {
+        PyErr_SetString(PyExc_TypeError, "offsets and labels should be given");
+        return nullptr;
+    }
+
+    feature_batch batch;
+    buffer_view labels;
+
+    if (!batch.parse(features_obj, offsets_obj, indices_obj, values_obj) || !labels.get(labels_obj, "f", sizeof(float), "labels"))
+        return nullptr;
+
+    if (labels.count(sizeof(float)) != batch.n_examples) {
+        PyErr_SetString(PyExc_ValueError, "labels should have float32 element per example");
+        return nullptr;
+    }
+
+    int status;
+    double loss = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    status = batch.train(self->model, labels.data<float>(), &loss);
+    Py_END_ALLOW_THREADS
+
+    if (status != 0) {
+        PyErr_SetString(error_type, bl_last_error());
+        return nullptr;
+    }
+
+    return PyFloat_FromDouble(loss);
+}
+
+
+static PyObject * model_save(model_object * self, PyObject * args) {
+    const char * file_name;
+
+    if (!PyArg_ParseTuple(args, "s", &file_name))
+        return nullptr;
+
+    int status;
+
+    Py_BEGIN_ALLOW_THREADS
+    status = bl_save(self->model, file_name);
+    Py_END_ALLOW_THREADS
+
+    if (status != 0) {
+        PyErr_SetString(error_type, bl_last_error());
+        return nullptr;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static PyMethodDef model_methods[] = {
+    { "score", (PyCFunction) model_score, METH_VARARGS | METH_KEYWORDS, "score(features, offsets, *, indices=None, values=None, out=None) -> float32 array of probabilities (raw scores for models trained with squared or hinge loss)" },
+    { "train", (PyCFunction) model_train, METH_VARARGS | METH_KEYWORDS, "train(features, offsets, labels, *, indices=None, values=None) -> mean loss of examples before update, in loss the model is trained with" },
+    { "save", (PyCFunction) model_save, METH_VARARGS, "save(file_name)" },
+    { nullptr, nullptr, 0, nullptr }
+};
+
+
+static PyTypeObject model_type = {
+    PyVarObject_HEAD_INIT(nullptr, 0)
+    "batch_learn.Model",
+};
+
+
+static PyObject * wrap_model(bl_model * model) {
+    if (model == nullptr) {
+        PyErr_SetString(error_type, bl_last_error());
+        return nullptr;
+    }
+
+    model_object * obj = PyObject_New(model_object, &model_type);
+
+    if (obj == nullptr) {
+        bl_free(model);
+        return nullptr;
+    }
+
+    obj->model = model;
+
+    return (PyObject *) obj;
+}
+
+
+static PyObject * module_ffm(PyObject *, PyObject * args, PyObject * kwargs) {
+    static const char * keywords[] = { "n_fields", "n_indices", "n_index_bits", "n_dim", "seed", "eta", "lambda_", nullptr };
+
+    unsigned n_fields, n_indices, n_index_bits, n_dim = 4;
+    int seed = 0;
+    float eta = 0.2, lambda = 0.00002;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "III|Iiff", (char **) keywords, &n_fields, &n_indices, &n_index_bits, &n_dim, &seed, &eta, &lambda))
+        return nullptr;
+
+    return wrap_model(bl_ffm_create(n_fields, n_indices, n_index_bits, n_dim, seed, eta, lambda));
+}
+
+
+static PyObject * module_nn(PyObject *, PyObject * args, PyObject * kwargs) {
+    static const char * keywords[] = { "n_indices", "n_index_bits", "seed", "eta", "lambda_", nullptr };
+
+    unsigned n_indices, n_index_bits;
+    int seed = 0;
+    float eta = 0.02, lambda = 0.00002;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "II|iff", (char **) keywords, &n_indices, &n_index_bits, &seed, &eta, &lambda))
+        return nullptr;
+
+    return wrap_model(bl_nn_create(n_indices, n_index_bits, seed, eta, lambda));
+}
+
+
+static PyObject * module_load(PyObject *, PyObject * args) {
+    const char * file_name;
+
+    if (!PyArg_ParseTuple(args, "s", &file_name))
+        return nullptr;
+
+    bl_model * model;
+
+    Py_BEGIN_ALLOW_THREADS
+    model = bl_load(file_name);
+    Py_END_ALLOW_THREADS
+
+    return wrap_model(model);
+}
+
+
+static PyObject * module_set_threads(PyObject *, PyObject * args) {
+    int n_threads;
+
+    if (!PyArg_ParseTuple(args, "i", &n_threads))
+        return nullptr;
+
+    bl_set_threads(n_threads);
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject * module_set_verbose(PyObject *, PyObject * args) {
+    int enabled;
+
+    if (!PyArg_ParseTuple(args, "p", &enabled))
+        return nullptr;
+
+    bl_set_verbose(enabled);
+
+    Py_RETURN_NONE;
+}
+
+
+static PyMethodDef module_methods[] = {
+    { "ffm", (PyCFunction) module_ffm, METH_VARARGS | METH_KEYWORDS, "ffm(n_fields, n_indices, n_index_bits, n_dim=4, seed=0, eta=0.2, lambda_=0.00002) -> new ffm model" },
+    { "nn", (PyCFunction) module_nn, METH_VARARGS | METH_KEYWORDS, "nn(n_indices, n_index_bits, seed=0, eta=0.02, lambda_=0.00002) -> new nn model" },
+    { "load", module_load, METH_VARARGS, "load(file_name) -> saved model, read-only" },
+    { "set_threads", module_set_threads, METH_VARARGS, "set_threads(n) - number of scoring and training threads" },
+    { "set_verbose", module_set_verbose, METH_VARARGS, "set_verbose(enabled) - print progress of model creation, loading and saving" },
+    { nullptr, nullptr, 0, nullptr }
+};
+
+
+static PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT, "batch_learn", "Batch-learn models: zero-copy scoring and training on feature batches", -1, module_methods
+};
+
+
+PyMODINIT_FUNC PyInit_batch_learn() {
+    model_type.tp_basicsize = sizeof(model_object);
+    model_type.tp_flags = Py_TPFLAGS_DEFAULT;
+    model_type.tp_doc = "Batch-learn model";
+    model_type.tp_dealloc = (destructor) model_dealloc;
+    model_type.tp_methods = model_methods;
+
+    if (PyType_Ready(&model_type) < 0)
+        return nullptr;
+
+    PyObject * module = PyModule_Create(&module_def);
+
+    if (module == nullptr)
+        return nullptr;
+
+    error_type = PyErr_NewException("batch_learn.Error", PyExc_RuntimeError, nullptr);
+
+    Py_INCREF(error_type);
+    PyModule_AddObject(module, "Error", error_type);
+
+    Py_INCREF(&model_type);
+    PyModule_AddObject(module, "Model", (PyObject *) &model_type);
+
+    return module;
+}
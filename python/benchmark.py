@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+"""Compare scoring in-process through batch_learn module with shelling out to batch-learn CLI.
+
+CLI route: write examples in ffm text format, convert them, run `batch-learn score` and parse text predictions.
+In-process route: pass feature and offset buffers to Model.score.
+
+    PYTHONPATH=build python3 python/benchmark.py --cli build/batch-learn --examples 200000
+"""
+
+import argparse
+import array
+import os
+import random
+import struct
+import subprocess
+import tempfile
+import time
+
+import batch_learn
+
+
+def generate(n_examples, n_fields, n_indices, seed):
+    rnd = random.Random(seed)
+
+    indices, values, offsets, labels = array.array('I'), array.array('f'), array.array('Q', [0]), array.array('f')
+
+    for _ in range(n_examples):
+        positive = rnd.random() < 0.3
+        labels.append(1 if positive else -1)
+
+        for field in range(n_fields):
+            index = rnd.randrange(n_indices // 2) + (n_indices // 2 if positive and field < 2 else 0)
+            indices.append((field << 20) | index)
+            values.append(1.0)
+
+        offsets.append(len(indices))
+
+    features = bytearray(len(indices) * 8)
+
+    for i in range(len(indices)):
+        struct.pack_into('<If', features, i * 8, indices[i], values[i])
+
+    return features, indices, values, offsets, labels
+
+
+def timed(fn):
+    start = time.perf_counter()
+    result = fn()
+    return result, time.perf_counter() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--cli', default='batch-learn', help='batch-learn executable')
+    parser.add_argument('--examples', type=int, default=200000)
+    parser.add_argument('--fields', type=int, default=8)
+    parser.add_argument('--indices', type=int, default=1000)
+    parser.add_argument('--threads', type=int, default=1)
+    parser.add_argument('--repeat', type=int, default=3)
+    args = parser.parse_args()
+
+    batch_learn.set_threads(args.threads)
+
+    features, indices, values, offsets, labels = generate(args.examples, args.fields, args.indices, 2017)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        model_file = os.path.join(tmp, 'model.bin')
+
+        model = batch_learn.ffm(args.fields, args.indices, 20)
+        model.train(features, offsets, labels)
+        model.save(model_file)
+
+        loaded = batch_learn.load(model_file)
+
+        # In-process scoring, best of repeats
+        in_process = min(timed(lambda: loaded.score(features, offsets))[1] for _ in range(args.repeat))
+        predictions = loaded.score(features, offsets)
+
+        # CLI route, including writing text input and parsing text output
+        def cli():
+            text_file, dataset, pred_file = os.path.join(tmp, 'test.ffm'), os.path.join(tmp, 'test'), os.path.join(tmp, 'pred.txt')
+
+            with open(text_file, 'w') as out:
+                for i in range(args.examples):
+                    feats = ' '.join('%d:%d:%g' % (indices[j] >> 20, indices[j] & 0xFFFFF, values[j]) for j in range(offsets[i], offsets[i + 1]))
+                    out.write('%d %s\n' % (labels[i] > 0, feats))
+
+            subprocess.run([args.cli, 'convert', '-f', 'ffm', '-b', '20', '-t', str(args.threads), text_file, '-O', dataset], check=True, stdout=subprocess.DEVNULL)
+            subprocess.run([args.cli, 'score', model_file, dataset, pred_file, '-w', '1', '-t', str(args.threads)], check=True, stdout=subprocess.DEVNULL)
+
+            with open(pred_file) as f:
+                return array.array('f', (float(line) for line in f))
+
+        cli_predictions, cli_time = timed(cli)
+
+    max_diff = max(abs(a - b) for a, b in zip(predictions, cli_predictions))
+
+    print('%d examples, %d threads' % (args.examples, args.threads))
+    print('  in-process: %8.3f s  %10.0f examples/s' % (in_process, args.examples / in_process))
+    print('  cli:        %8.3f s  %10.0f examples/s' % (cli_time, args.examples / cli_time))
+    print('  max prediction difference %.2g (text rounding)' % max_diff)
+
+
+if __name__ == '__main__':
+    main()
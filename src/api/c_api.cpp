@@ -0,0 +1,281 @@
+#include <batch_learn.h>
+
+#include "../models/ffm.hpp"
+#include "../models/nn.hpp"
+
+#include "../util/loss.hpp"
+#include "../util/parallel.hpp"
+
+#include <memory>
+#include <string>
+#include <iostream>
+#include <vector>
+#include <cstddef>
+
+#include <omp.h>
+
+
+static_assert(sizeof(bl_feature) == sizeof(batch_learn::feature) && offsetof(bl_feature, value) == offsetof(batch_learn::feature, value), "Mismatching feature layouts");
+
+
+struct bl_model {
+    std::unique_ptr<model> m;
+    bool read_only; // Weights are mapped from model file without write access
+    std::unique_ptr<loss_function> loss; // Loss model is trained with, defining its outputs
+};
+
+
+struct bl_context {
+    score_context ctx;
+};
+
+
+static thread_local std::string last_error;
+
+static bool verbose = false; // Progress messages of models are printed to standard output
+
+// Call function, storing message of its exception as last error
+template <typename F>
+static bool guarded(F f) {
+    model_log_stream() = verbose ? &std::cout : nullptr;
+
+    try {
+        f();
+        return true;
+    } catch (std::exception & e) {
+        last_error = e.what();
+        return false;
+    }
+}
+
+
+template <typename F>
+static bl_model * create(F f, bool read_only = false) {
+    bl_model * result = nullptr;
+
+    guarded([&] {
+        std::unique_ptr<model> m(f());
+        auto loss = create_loss(m->loss_name());
+
+        result = new bl_model { std::move(m), read_only, std::move(loss) };
+    });
+
+    return result;
+}
+
+
+static inline const batch_learn::feature * cast(const bl_feature * features) {
+    return reinterpret_cast<const batch_learn::feature *>(features);
+}
+
+
+bl_model * bl_ffm_create(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, int seed, float eta, float lambda) {
+    return create([&] { return new ffm_model(n_fields, n_indices, n_index_bits, n_dim, seed, eta, lambda); });
+}
+
+
+bl_model * bl_nn_create(uint32_t n_indices, uint32_t n_index_bits, int seed, float eta, float lambda) {
+    return create([&] { return new nn_model(n_indices, n_index_bits, seed, eta, lambda); });
+}
+
+
+bl_model * bl_load(const char * file_name) {
+    return create([&] { return new ffm_model(std::string(file_name)); }, true);
+}
+
+
+void bl_free(bl_model * model) {
+    delete model;
+}
+
+
+void bl_set_verbose(int enabled) {
+    verbose = enabled != 0;
+}
+
+
+void bl_set_threads(int n_threads) {
+    if (n_threads > 0)
+        omp_set_num_threads(n_threads);
+}
+
+
+// Features of batch given as records, passed to models as is
+struct record_batch {
+    const batch_learn::feature * data;
+    const uint64_t * offsets;
+
+    void get(uint64_t ei, std::vector<batch_learn::feature> &, const batch_learn::feature * & start, const batch_learn::feature * & end) const {
+        start = data + offsets[ei];
+        end = data + offsets[ei+1];
+    }
+};
+
+
+// Features of batch given as separate index and value arrays, interleaved example by example into buffer
+// of calling thread, so batch isn't copied
+struct split_batch {
+    const uint32_t * indices;
+    const float * values;
+    const uint64_t * offsets;
+
+    void get(uint64_t ei, std::vector<batch_learn::feature> & buffer, const batch_learn::feature * & start, const batch_learn::feature * & end) const {
+        buffer.resize(offsets[ei+1] - offsets[ei]);
+
+        for (uint64_t i = offsets[ei], j = 0; i < offsets[ei+1]; ++ i, ++ j) {
+            buffer[j].index = indices[i];
+            buffer[j].value = values[i];
+        }
+
+        start = buffer.data();
+        end = start + buffer.size();
+    }
+};
+
+
+template <typename B>
+static int score_batch(bl_model * model, const B & batch, uint64_t n_examples, float * predictions) {
+    const auto & m = *model->m;
+
+    std::vector<score_context> contexts;
+
+    if (!guarded([&] { for (int i = 0; i < omp_get_max_threads(); ++ i) contexts.push_back(m.create_score_context()); }))
+        return -1;
+
+    parallel_error error;
+
+    #pragma omp parallel
+    {
+        std::vector<batch_learn::feature> buffer;
+
+        #pragma omp for schedule(dynamic, 256)
+        for (uint64_t ei = 0; ei < n_examples; ++ ei) {
+            error.run([&] {
+                const batch_learn::feature * start, * end;
+
+                batch.get(ei, buffer, start, end);
+
+                predictions[ei] = m.score(start, end, compute_norm(start, end), contexts[omp_get_thread_num()]);
+            });
+        }
+    }
+
+    if (error.occurred()) {
+        last_error = error.what();
+        return -1;
+    }
+
+    model->loss->outputs(predictions, predictions, n_examples);
+
+    return 0;
+}
+
+
+int bl_score(bl_model * model, const bl_feature * features, const uint64_t * offsets, uint64_t n_examples, float * predictions) {
+    return score_batch(model, record_batch { cast(features), offsets }, n_examples, predictions);
+}
+
+
+int bl_score_split(bl_model * model, const uint32_t * indices, const float * values, const uint64_t * offsets, uint64_t n_examples, float * predictions) {
+    return score_batch(model, split_batch { indices, values, offsets }, n_examples, predictions);
+}
+
+
+bl_context * bl_context_create(const bl_model * model) {
+    bl_context * result = nullptr;
+
+    guarded([&] { result = new bl_context { model->m->create_score_context() }; });
+
+    return result;
+}
+
+
+void bl_context_free(bl_context * context) {
+    delete context;
+}
+
+
+float bl_score_one(const bl_model * model, bl_context * context, const bl_feature * features, uint32_t n_features) {
+    auto start = cast(features);
+    auto end = start + n_features;
+
+    float t = model->m->score(start, end, compute_norm(start, end), context->ctx);
+
+    model->loss->outputs(&t, &t, 1);
+
+    return t;
+}
+
+
+template <typename B>
+static int train_batch(bl_model * model, const B & batch, const float * labels, uint64_t n_examples, double * loss) {
+    if (model->read_only) {
+        last_error = "Loaded model can't be trained";
+        return -1;
+    }
+
+    auto & m = *model->m;
+
+    std::vector<float> ys, ts; // Labels and scores before update, for loss
+
+    if (!guarded([&] { ys.resize(n_examples); ts.resize(n_examples); }))
+        return -1;
+
+    parallel_error error;
+
+    #pragma omp parallel
+    {
+        std::vector<batch_learn::feature> buffer;
+
+        #pragma omp for schedule(dynamic, 64)
+        for (uint64_t ei = 0; ei < n_examples; ++ ei) {
+            error.run([&] {
+                const batch_learn::feature * start, * end;
+
+                batch.get(ei, buffer, start, end);
+
+                float y = labels[ei] > 0 ? 1.0f : -1.0f;
+                float norm = compute_norm(start, end);
+                float t = m.predict(start, end, norm, true);
+
+                m.update(start, end, norm, model->loss->gradient(y, t));
+
+                ys[ei] = y;
+                ts[ei] = t;
+            });
+        }
+    }
+
+    if (!guarded([&] { m.sync(true); }))
+        return -1;
+
+    if (error.occurred()) {
+        last_error = error.what();
+        return -1;
+    }
+
+    if (loss != nullptr)
+        *loss = n_examples > 0 ? model->loss->total(ys.data(), ts.data(), n_examples) / n_examples : 0;
+
+    return 0;
+}
+
+
+int bl_train(bl_model * model, const bl_feature * features, const uint64_t * offsets, const float * labels, uint64_t n_examples, double * loss) {
+    return train_batch(model, record_batch { cast(features), offsets }, labels, n_examples, loss);
+}
+
+
+int bl_train_split(bl_model * model, const uint32_t * indices, const float * values, const uint64_t * offsets, const float * labels, uint64_t n_examples, double * loss) {
+    return train_batch(model, split_batch { indices, values, offsets }, labels, n_examples, loss);
+}
+
+
+int bl_save(bl_model * model, const char * file_name) {
+    return guarded([&] { model->m->save(file_name); }) ? 0 : -1;
+}
+
+
+const char * bl_last_error(void) {
+    return last_error.c_str();
+}
@@ -1,6 +1,12 @@
+#include "commands/bench_read.hpp"
+#include "commands/bench_train.hpp"
 #include "commands/convert.hpp"
 #include "commands/ffm.hpp"
+#include "commands/inspect.hpp"
 #include "commands/nn.hpp"
+#include "commands/score.hpp"
+#include "commands/shuffle.hpp"
+#include "commands/verify.hpp"
 
 #include <unordered_map>
 #include <iostream>
@@ -56,6 +62,12 @@ int main(int ac, char* av[]) {
     commands.insert(make_pair("convert", unique_ptr<command>(new convert_command())));
     commands.insert(make_pair("ffm", unique_ptr<command>(new ffm_command())));
     commands.insert(make_pair("nn", unique_ptr<command>(new nn_command())));
+    commands.insert(make_pair("inspect", unique_ptr<command>(new inspect_command())));
+    commands.insert(make_pair("shuffle", unique_ptr<command>(new shuffle_command())));
+    commands.insert(make_pair("bench-read", unique_ptr<command>(new bench_read_command())));
+    commands.insert(make_pair("bench-train", unique_ptr<command>(new bench_train_command())));
+    commands.insert(make_pair("verify", unique_ptr<command>(new verify_command())));
+    commands.insert(make_pair("score", unique_ptr<command>(new score_command())));
 
     // Check if command specified
     if (ac <= 1) {
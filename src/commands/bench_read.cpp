@@ -0,0 +1,88 @@
+#include "bench_read.hpp"
+
+#include "../util/dataset.hpp"
+#include "../util/parallel.hpp"
+
+#include <batch_learn.hpp>
+
+#include <random>
+#include <iomanip>
+
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// Ask kernel to evict data file pages, so next run reads from device
+static void drop_file_cache(const std::string & file_name) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        throw std::runtime_error("Can't open " + file_name);
+
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+
+int bench_read_command::run() {
+    using namespace std;
+
+    omp_set_num_threads(n_threads);
+
+    batch_learn_dataset dataset(input_file_name);
+
+    auto batches = dataset.generate_batches(batch_size);
+
+    std::minstd_rand0 rnd(seed);
+    std::shuffle(batches.begin(), batches.end(), rnd);
+
+    uint64_t total_bytes = dataset.index.data_size();
+
+    size_t pos = 0;
+    while (pos < readers.size()) {
+        size_t next = readers.find(',', pos);
+
+        if (next == string::npos)
+            next = readers.size();
+
+        string reader_type = readers.substr(pos, next - pos);
+        pos = next + 1;
+
+        cout << "  " << setw(14) << left << reader_type;
+        cout.flush();
+
+        if (drop_cache)
+            drop_file_cache(dataset.data_file_name);
+
+        auto reader = create_batch_reader(reader_type, dataset.data_file_name, dataset.index, !no_verify, io_depth);
+
+        double start_time = omp_get_wtime();
+
+        reader->start(batches);
+
+        uint64_t checksum = 0;
+        parallel_error error;
+
+        #pragma omp parallel for schedule(dynamic, 1) reduction(+: checksum)
+        for (uint64_t bi = 0; bi < batches.size(); ++ bi) {
+            std::vector<batch_learn::feature> batch_features;
+
+            if (!error.run([&] { reader->read(bi, batch_features); }))
+                continue;
+
+            // Touch data to make sure it's really read
+            for (auto & f : batch_features)
+                checksum += f.index;
+        }
+
+        double elapsed = omp_get_wtime() - start_time;
+
+        error.rethrow();
+
+        cout << setw(10) << right << fixed << setprecision(3) << elapsed << " s" << setw(10) << setprecision(2) << (total_bytes / elapsed / 1e9) << " GB/s  (checksum " << checksum << ")" << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "command.hpp"
+
+
+class bench_read_command : public command {
+protected:
+    std::string input_file_name, readers;
+    uint n_threads, io_depth, batch_size, seed;
+    bool drop_cache, no_verify;
+public:
+    bench_read_command() {
+        using namespace boost::program_options;
+
+        options_desc.add_options()
+            ("readers,r", value<std::string>(&readers)->default_value("buffered,mmap,uring,uring-direct"), "comma-separated list of readers to benchmark")
+            ("io-depth", value<uint>(&io_depth)->default_value(16), "number of batch reads in flight for uring readers")
+            ("batch-size", value<uint>(&batch_size)->default_value(20000), "number of examples in batch")
+            ("drop-cache", bool_switch(&drop_cache), "evict data file from page cache before each run")
+            ("no-verify", bool_switch(&no_verify), "don't verify data checksums")
+            ("seed,s", value<uint>(&seed)->default_value(2017), "seed for batch order")
+            ("threads,t", value<uint>(&n_threads)->default_value(4), "number of threads")
+            ("input-file,I", value<std::string>(&input_file_name)->required(), "input dataset name");
+
+        positional_options_desc.add("input-file", 1);
+    }
+
+    virtual std::string name() { return "bench-read"; }
+    virtual std::string description() { return "measure batch read throughput"; }
+
+    virtual int run();
+};
@@ -0,0 +1,145 @@
+#include "bench_train.hpp"
+
+#include "../util/dataset.hpp"
+#include "../util/loss.hpp"
+
+#include "../models/ffm.hpp"
+#include "../models/nn.hpp"
+
+#include <batch_learn.hpp>
+
+#include <random>
+#include <iomanip>
+#include <algorithm>
+
+#include <omp.h>
+
+
+// Split comma-separated list
+static std::vector<std::string> split_list(const std::string & list) {
+    std::vector<std::string> items;
+
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t next = list.find(',', pos);
+
+        if (next == std::string::npos)
+            next = list.size();
+
+        items.push_back(list.substr(pos, next - pos));
+        pos = next + 1;
+    }
+
+    return items;
+}
+
+
+int bench_train_command::run() {
+    using namespace std;
+
+    omp_set_num_threads(n_threads);
+
+    batch_learn_dataset dataset(input_file_name);
+
+    // Load all examples, so only training is measured
+    cout << "Reading examples... ";
+    cout.flush();
+
+    auto batches = dataset.generate_batches(20000);
+
+    vector<batch_learn::feature> features;
+    vector<uint64_t> offsets(1, 0);
+
+    dataset.start_reading(batches);
+
+    for (uint64_t bi = 0; bi < batches.size(); ++ bi) {
+        vector<batch_learn::feature> batch_features;
+
+        dataset.reader->read(bi, batch_features);
+
+        uint64_t batch_start_offset = dataset.index.offsets[batches[bi].first];
+
+        for (uint64_t ei = batches[bi].first; ei < batches[bi].second; ++ ei)
+            offsets.push_back(features.size() + dataset.index.offsets[ei + 1] - batch_start_offset);
+
+        features.insert(features.end(), batch_features.begin(), batch_features.end());
+    }
+
+    cout << "done." << endl;
+
+    uint64_t n_examples = dataset.index.n_examples;
+    const float * labels = dataset.index.labels.data();
+
+    vector<uint64_t> order(n_examples);
+    vector<float> scores(n_examples);
+
+    for (uint64_t i = 0; i < n_examples; ++ i)
+        order[i] = i;
+
+    simd_loss<logistic_loss> loss_fn;
+
+    vector<pair<string, string>> rows;
+
+    for (auto & model_name : split_list(models))
+        for (auto & optimizer : split_list(optimizers))
+            rows.push_back(make_pair(model_name, optimizer));
+
+    for (auto & row : rows) {
+        unique_ptr<model> m;
+
+        if (row.first == "ffm") {
+            float eta = row.second == "adam" ? ffm_eta * adam_eta_mult : ffm_eta;
+
+            // Plain hogwild training in memory, with dropout and interaction count of ffm command defaults
+            const string numa_mode = "none", shared_file = "";
+            const uint numa_sync_interval = 16, n_update_shards = 0, max_interactions = 0;
+            const bool create_shared = true;
+            const float dropout = 0.5;
+
+            m.reset(new ffm_model(dataset.index.n_fields, dataset.index.n_indices, dataset.index.n_index_bits, n_dim, seed, eta, lambda, numa_mode, numa_sync_interval,
+                                  n_update_shards, shared_file, create_shared, dropout, max_interactions, row.second));
+        } else if (row.first == "nn") {
+            float eta = row.second == "adam" ? nn_eta * adam_eta_mult : nn_eta;
+
+            m.reset(new nn_model(dataset.index.n_indices, dataset.index.n_index_bits, seed, eta, lambda, row.second));
+        } else {
+            throw runtime_error("Unknown model " + row.first + ", supported models: ffm, nn");
+        }
+
+        cout << "  " << setw(6) << left << row.first << setw(10) << row.second;
+        cout.flush();
+
+        std::minstd_rand0 rnd(seed);
+
+        double elapsed = 0;
+
+        for (uint pass = 0; pass < n_passes; ++ pass) {
+            std::shuffle(order.begin(), order.end(), rnd);
+
+            double start_time = omp_get_wtime();
+
+            #pragma omp parallel for schedule(dynamic, 256)
+            for (uint64_t i = 0; i < n_examples; ++ i) {
+                uint64_t ei = order[i];
+
+                batch_learn::feature * start = features.data() + offsets[ei];
+                batch_learn::feature * end = features.data() + offsets[ei + 1];
+
+                float norm = compute_norm(start, end);
+                float t = m->predict(start, end, norm, true);
+
+                m->update(start, end, norm, loss_fn.gradient(labels[ei], t));
+
+                scores[ei] = t;
+            }
+
+            elapsed += omp_get_wtime() - start_time;
+        }
+
+        double loss = loss_fn.total(labels, scores.data(), n_examples) / n_examples;
+
+        cout << setw(10) << right << fixed << setprecision(3) << elapsed << " s" << setw(10) << setprecision(3) << (n_examples * n_passes / elapsed / 1e6) << " M ex/s  (last pass loss " << setprecision(5) << loss << ")" << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "command.hpp"
+
+
+class bench_train_command : public command {
+protected:
+    std::string input_file_name, models, optimizers;
+    uint n_dim, n_passes, n_threads, seed;
+    float ffm_eta, nn_eta, adam_eta_mult, lambda;
+public:
+    bench_train_command() {
+        using namespace boost::program_options;
+
+        options_desc.add_options()
+            ("models,m", value<std::string>(&models)->default_value("ffm,nn"), "comma-separated list of models to benchmark")
+            ("optimizers,o", value<std::string>(&optimizers)->default_value("adagrad,ftrl,adam"), "comma-separated list of optimizers to benchmark")
+            ("dim,k", value<uint>(&n_dim)->default_value(4), "ffm dimensions")
+            ("passes", value<uint>(&n_passes)->default_value(2), "number of training passes over examples")
+            ("ffm-eta", value<float>(&ffm_eta)->default_value(0.2), "ffm learning rate")
+            ("nn-eta", value<float>(&nn_eta)->default_value(0.02), "nn learning rate")
+            ("adam-eta-mult", value<float>(&adam_eta_mult)->default_value(0.05), "multiplier of learning rates for adam")
+            ("lambda", value<float>(&lambda)->default_value(0.00002), "l2 regularization coeff")
+            ("seed,s", value<uint>(&seed)->default_value(2017), "seed for weights and example order")
+            ("threads,t", value<uint>(&n_threads)->default_value(1), "number of threads")
+            ("input-file,I", value<std::string>(&input_file_name)->required(), "input dataset name");
+
+        positional_options_desc.add("input-file", 1);
+    }
+
+    virtual std::string name() { return "bench-train"; }
+    virtual std::string description() { return "measure training throughput of models with each optimizer"; }
+
+    virtual int run();
+};
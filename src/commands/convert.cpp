@@ -1,137 +1,328 @@
 #include "convert.hpp"
 
+#include "../util/hash.hpp"
+#include "../util/pack.hpp"
+#include "../util/text_parser.hpp"
+
 #include <batch_learn.hpp>
 
 #include <fstream>
+#include <iomanip>
+#include <memory>
+
+#include <omp.h>
 
 #include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+enum split_key_type { split_by_ratio, split_by_line, split_by_group };
+
+
+class convert_output {
+public:
+    std::string file_name;
+    double fraction;
+
+    std::unique_ptr<batch_learn::stream_data_writer> data_writer;
+    std::unique_ptr<batch_learn::stream_index_writer> index_writer;
+
+    uint32_t index_bits;
+    bool collect_value_stats; // Values are packed after conversion, so field statistics are collected while writing
+    std::vector<field_value_stats> value_stats;
+
+    bool finished; // Dataset is complete, otherwise partial data is removed
+public:
+    convert_output(const std::string & file_name, double fraction, uint32_t index_bits, bool collect_value_stats, bool direct_io):
+        file_name(file_name), fraction(fraction), index_bits(index_bits), collect_value_stats(collect_value_stats), finished(false) {
+        data_writer.reset(new batch_learn::stream_data_writer(file_name + ".data", direct_io));
+        index_writer.reset(new batch_learn::stream_index_writer(file_name + ".index"));
+    }
+
+    ~convert_output() {
+        if (!finished)
+            remove((file_name + ".data").c_str());
+    }
+
+    void write(float y, uint64_t group, const batch_learn::feature * features, uint64_t n_features) {
+        data_writer->write(features, n_features);
+        index_writer->write(y, group, *data_writer);
+
+        if (!collect_value_stats)
+            return;
+
+        for (uint64_t i = 0; i < n_features; ++ i) {
+            uint32_t field = features[i].index >> index_bits;
+
+            if (field >= value_stats.size())
+                value_stats.resize(field + 1);
+
+            value_stats[field].add(features[i].value);
+        }
+    }
+};
+
+
+// Routes each example to one of output datasets by hash of split key
+class convert_splitter {
+    std::vector<std::unique_ptr<convert_output>> outputs; // Main output goes first and receives everything not taken by splits
+    uint64_t seed_hash;
+    uint32_t index_bits;
+    bool direct_io;
+public:
+    split_key_type key_type;
+
+    uint64_t n_examples;
+    uint32_t n_fields;
+    uint32_t n_indices;
+public:
+    convert_splitter(const std::string & main_file_name, const std::vector<std::string> & split_specs, const std::string & key_name, uint seed, uint index_bits, bool pack_values, bool direct_io):
+        index_bits(index_bits), direct_io(direct_io), n_examples(0), n_fields(0), n_indices(0) {
+        using namespace std;
+
+        if (key_name == "ratio")
+            key_type = split_by_ratio;
+        else if (key_name == "line")
+            key_type = split_by_line;
+        else if (key_name == "group")
+            key_type = split_by_group;
+        else
+            throw runtime_error(string("Unknown split key ") + key_name + ", supported keys: ratio, line, group");
+
+        seed_hash = hash_u64(seed);
+
+        double main_fraction = 1.0;
+        vector<pair<string, double>> splits;
+
+        for (auto & spec : split_specs) {
+            auto delim = spec.rfind(':');
+
+            if (delim == string::npos || delim == 0)
+                throw runtime_error(string("Invalid split spec '") + spec + "', NAME:FRACTION expected");
+
+            double fraction = boost::lexical_cast<double>(spec.substr(delim + 1));
+
+            if (fraction <= 0 || fraction > main_fraction + 1e-9)
+                throw runtime_error(string("Invalid split fraction in '") + spec + "', fractions should be positive and sum to at most 1");
+
+            splits.push_back(make_pair(spec.substr(0, delim), fraction));
+            main_fraction -= fraction;
+        }
+
+        outputs.emplace_back(new convert_output(main_file_name, main_fraction, index_bits, pack_values, direct_io));
+
+        for (auto & split : splits)
+            outputs.emplace_back(new convert_output(split.first, split.second, index_bits, pack_values, direct_io));
+    }
+
+    // Choose output for example given its split key value
+    convert_output & select(uint64_t key) {
+        if (outputs.size() == 1)
+            return *outputs[0];
+
+        double u = hash_to_unit(hash_u64(key ^ seed_hash));
+
+        for (size_t i = 1; i < outputs.size(); ++ i) {
+            if (u < outputs[i]->fraction)
+                return *outputs[i];
+
+            u -= outputs[i]->fraction;
+        }
+
+        return *outputs[0];
+    }
+
+    void write(uint64_t key, float y, uint64_t group, const batch_learn::feature * features, uint64_t n_features) {
+        select(key).write(y, group, features, n_features);
+        n_examples ++;
+    }
+
+    // Write indices of all outputs, they share field and index counts, so models trained on one may be applied to others
+    void finish() {
+        for (auto & output : outputs) {
+            output->data_writer->close();
+            output->index_writer->finish(*output->data_writer, n_fields, n_indices, index_bits);
+            output->finished = true;
+        }
+    }
+
+    // Replace outputs with packed ones, report resulting sizes
+    void pack(bool lossy) {
+        using namespace std;
+
+        for (auto & output : outputs) {
+            if (!pack_dataset(output->file_name, output->value_stats, lossy, direct_io))
+                continue;
 
-constexpr uint max_line_size = 100000;
+            auto index = batch_learn::read_index(output->file_name + ".index");
 
-inline uint32_t h(uint32_t x) {
-    x = ((x >> 16) ^ x) * 0x45d9f3b;
-    x = ((x >> 16) ^ x) * 0x45d9f3b;
-    x = (x >> 16) ^ x;
-    return x;
+            if (index.offsets.back() > 0)
+                cout << output->file_name << " packed to " << setprecision(2) << fixed << (double(index.data_size()) / index.offsets.back()) << " bytes per feature... ";
+        }
+    }
+
+    void print_summary() {
+        if (outputs.size() == 1)
+            return;
+
+        for (auto & output : outputs)
+            std::cout << "  " << output->file_name << ": " << output->index_writer->size() << " examples" << std::endl;
+    }
+};
+
+
+static std::vector<std::string> split_names(const std::string & list) {
+    std::vector<std::string> names;
+
+    for (size_t pos = 0; pos < list.size();) {
+        size_t next = list.find(',', pos);
+
+        if (next == std::string::npos)
+            next = list.size();
+
+        names.push_back(list.substr(pos, next - pos));
+        pos = next + 1;
+    }
+
+    return names;
 }
 
+
 int convert_command::run() {
-    if (input_format_name == std::string("ffm")) {
-        convert_from_ffm();
+    using namespace std;
+
+    omp_set_num_threads(n_threads);
+
+    if (pack_values_mode != "none" && pack_values_mode != "exact" && pack_values_mode != "lossy")
+        throw runtime_error("Unknown value packing mode " + pack_values_mode + ", supported modes: none, exact, lossy");
+
+    unique_ptr<text_parser> parser;
+
+    if (input_format_name == "ffm" || input_format_name == "vw") {
+        if (split_key_name == "group")
+            throw runtime_error("Split by group is not supported for " + input_format_name + " format, it has no groups");
+
+        if (input_format_name == "ffm")
+            parser.reset(new ffm_text_parser(index_bits, rehash_indexes));
+        else
+            parser.reset(new vw_text_parser(index_bits, rehash_indexes, split_names(namespaces)));
+    } else if (input_format_name == "libsvm") {
+        parser.reset(new libsvm_text_parser(index_bits, rehash_indexes));
+    } else if (input_format_name == "csv" || input_format_name == "tsv") {
+        if (split_key_name == "group" && group_column < 0)
+            throw runtime_error("Split by group requires group column");
+
+        parser.reset(create_csv_parser(input_format_name == "csv" ? ',' : '\t'));
     } else {
-        std::cout << "Error: unknown input format, supported formats: ffm" << std::endl;
+        cout << "Error: unknown input format, supported formats: ffm, libsvm, vw, csv, tsv" << endl;
         return -1;
     }
 
-    return 0;
-}
+    convert_splitter splitter(output_file_name, split_specs, split_key_name, split_seed, index_bits, pack_values_mode != "none", direct_io);
 
-void convert_command::convert_from_ffm() {
-    using namespace std;
-    using namespace batch_learn;
-    using boost::format;
+    parser->hash_lines = (splitter.key_type == split_by_line);
 
-    cout << "Converting " << input_file_name << " to " << output_file_name << " using " << index_bits << " index bits... ";
-    cout.flush();
+    convert_text(*parser, splitter);
 
-    FILE * input_file = fopen(input_file_name.c_str(), "r");
-    if (input_file == nullptr)
-        throw runtime_error("Error opening input file");
+    splitter.finish();
+
+    if (pack_values_mode != "none")
+        splitter.pack(pack_values_mode == "lossy");
+
+    cout << "Done." << endl;
+
+    splitter.print_summary();
 
-    file_index output_index;
-    output_index.n_examples = 0;
-    output_index.n_fields = 0;
-    output_index.n_indices = 0;
-    output_index.n_index_bits = index_bits;
-    output_index.offsets.push_back(0);
+    return 0;
+}
 
-    stream_data_writer output_data_writer(output_file_name + ".data");
-    vector<feature> features;
-    char line[max_line_size];
 
-    uint64_t i = 0;
-    while (fgets(line, max_line_size, input_file) != nullptr) {
-        features.clear();
+text_parser * convert_command::create_csv_parser(char delimiter) {
+    using namespace std;
 
-        ++ i;
+    vector<csv_text_parser::column_type> types;
 
-        char *y_char = strtok(line, " \t");
-        float y = (atoi(y_char) > 0) ? 1.0f : -1.0f;
+    auto set_type = [&types](int col, csv_text_parser::column_type type) {
+        if (col < 0)
+            return;
 
-        while (true) {
-            char * feature_char = strtok(nullptr, " \t");
+        if (uint(col) >= types.size())
+            types.resize(col + 1, csv_text_parser::categorical_column);
 
-            if (feature_char == nullptr || *feature_char == '\n')
-                break;
+        if (types[col] != csv_text_parser::categorical_column)
+            throw runtime_error("Column " + to_string(col) + " is given several roles");
 
+        types[col] = type;
+    };
 
-            char * index_delim = strpbrk(feature_char, ":");
+    set_type(label_column, csv_text_parser::label_column);
+    set_type(group_column, csv_text_parser::group_column);
 
-            if (index_delim == nullptr)
-                throw std::runtime_error(str(format("Invalid feature spec '%s' at line %d") % feature_char % i));
+    for (auto col : csv_text_parser::parse_columns(numeric_columns))
+        set_type(col, csv_text_parser::numeric_column);
 
-            char * value_delim = strpbrk(index_delim + 1, ":");
+    for (auto col : csv_text_parser::parse_columns(skip_columns))
+        set_type(col, csv_text_parser::skip_column);
 
-            if (value_delim == nullptr)
-                throw std::runtime_error(str(format("Invalid feature spec '%s' at line %d") % feature_char % i));
+    return new csv_text_parser(index_bits, rehash_indexes, delimiter, has_header, types);
+}
 
-            if (feature_char[0] == ':' || feature_char[0] == 0)
-                throw std::runtime_error(str(format("Empty field in '%s' at line %d") % feature_char % i));
 
-            if (index_delim[1] == ':' || index_delim[1] == 0)
-                throw std::runtime_error(str(format("Empty index in '%s' at line %d") % feature_char % i));
+void convert_command::convert_text(text_parser & parser, convert_splitter & splitter) {
+    using namespace std;
+    using namespace batch_learn;
 
-            if (value_delim[1] == 0)
-                throw std::runtime_error(str(format("Empty value in '%s' at line %d") % feature_char % i));
+    cout << "Converting " << input_file_name << " to " << output_file_name << " using " << index_bits << " index bits... ";
+    cout.flush();
 
-            index_delim[0] = 0;
-            value_delim[0] = 0;
+    FILE * input_file = input_file_name == "-" ? stdin : fopen(input_file_name.c_str(), "r");
+    if (input_file == nullptr)
+        throw runtime_error("Error opening input file");
 
-            uint field = atoi(feature_char);
-            uint index = atoi(index_delim + 1);
-            float value = atof(value_delim + 1);
+    parse_text_parallel(input_file, parser, [&](const parsed_block & block) {
+        splitter.n_fields = max(splitter.n_fields, block.n_fields);
+        splitter.n_indices = max(splitter.n_indices, block.n_indices);
 
-            if (rehash_indexes > 0)
-                index = h(index) % rehash_indexes;
+        for (uint64_t i = 0; i < block.size(); ++ i) {
+            uint64_t split_key = splitter.n_examples + 1;
 
-            if (field >= output_index.n_fields)
-                output_index.n_fields = field + 1;
+            if (splitter.key_type == split_by_line)
+                split_key = block.line_hashes[i];
+            else if (splitter.key_type == split_by_group)
+                split_key = block.groups[i];
 
-            if (index >= output_index.n_indices)
-                output_index.n_indices = index + 1;
+            splitter.write(split_key, block.labels[i], block.groups[i], block.features.data() + block.offsets[i], block.offsets[i+1] - block.offsets[i]);
 
-            feature f;
-            f.index = (field << index_bits) | index;
-            f.value = value;
+            if (splitter.n_examples % progress_step == 0) {
+                uint progress = splitter.n_examples;
+                std::string unit;
 
-            features.push_back(f);
-        }
+                if (progress_step % 1000000 == 0) {
+                    progress /= 1000000;
+                    unit = "M";
+                } else if (progress_step % 1000 == 0) {
+                    progress /= 1000;
+                    unit = "K";
+                }
 
-        output_index.n_examples ++;
-        output_index.labels.push_back(y);
-        output_index.groups.push_back(0); // No group support in ffm format
-        output_index.offsets.push_back(output_data_writer.write(features));
-
-        if (output_index.n_examples % progress_step == 0) {
-            uint progress = output_index.n_examples;
-            std::string unit;
-
-            if (progress_step % 1000000 == 0) {
-                progress /= 1000000;
-                unit = "M";
-            } else if (progress_step % 1000 == 0) {
-                progress /= 1000;
-                unit = "K";
+                cout << progress << unit << "... ";
+                cout.flush();
             }
-
-            cout << progress << unit << "... ";
-            cout.flush();
         }
-    }
+    });
 
-    fclose(input_file);
+    if (input_file != stdin)
+        fclose(input_file);
 
-    write_index(output_file_name + ".index", output_index);
+    // Report field numbers assigned to names
+    auto named_parser = dynamic_cast<named_fields_text_parser *>(&parser);
+    if (named_parser != nullptr) {
+        cout << "fields:";
 
-    cout << "Done." << endl;
+        for (uint32_t f = 0; f < named_parser->field_names.size(); ++ f)
+            cout << " " << f << "='" << named_parser->field_names[f] << "'";
+
+        cout << "... ";
+        cout.flush();
+    }
 }
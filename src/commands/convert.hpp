@@ -3,20 +3,39 @@
 #include "command.hpp"
 
 
+class convert_splitter;
+class text_parser;
+
 class convert_command : public command {
 protected:
-    std::string input_file_name, output_file_name, input_format_name;
-    uint index_bits, progress_step, rehash_indexes;
+    std::string input_file_name, output_file_name, input_format_name, split_key_name;
+    std::string numeric_columns, skip_columns, namespaces, pack_values_mode;
+    std::vector<std::string> split_specs;
+    uint index_bits, progress_step, rehash_indexes, split_seed, n_threads;
+    int label_column, group_column;
+    bool has_header, direct_io;
 public:
-    convert_command(): rehash_indexes(0) {
+    convert_command(): rehash_indexes(0), split_seed(0) {
         using namespace boost::program_options;
 
         options_desc.add_options()
             ("bits,b", value<uint>(&index_bits)->default_value(24), "number of bits to store feature indices")
-            ("rehash", value<uint>(&rehash_indexes), "rehash feature indices to given max")
+            ("rehash", value<uint>(&rehash_indexes), "rehash feature indices to given max (csv/tsv: hash space size, 2^bits by default)")
+            ("direct-io", bool_switch(&direct_io), "write data bypassing page cache (O_DIRECT)")
+            ("pack-values", value<std::string>(&pack_values_mode)->default_value("none"), "pack feature values with per-field encodings (implicit 1.0, u8, fp16) in extra pass after conversion, indices are kept in 4 bytes: none, exact or lossy")
             ("progress,p", value<uint>(&progress_step)->default_value(1000000), "print progress every N examples")
-            ("format,f", value<std::string>(&input_format_name)->required(), "input format name (only ffm supported for now)")
-            ("input-file,I", value<std::string>(&input_file_name)->required(), "input file name")
+            ("format,f", value<std::string>(&input_format_name)->required(), "input format name: ffm, libsvm, vw, csv or tsv")
+            ("threads,t", value<uint>(&n_threads)->default_value(4), "number of parser threads")
+            ("label-column", value<int>(&label_column)->default_value(0), "csv/tsv: label column number (-1 if no label)")
+            ("group-column", value<int>(&group_column)->default_value(-1), "csv/tsv: group column number")
+            ("numeric-columns", value<std::string>(&numeric_columns)->default_value(""), "csv/tsv: columns with bucketized numeric values, like 1-13,15")
+            ("skip-columns", value<std::string>(&skip_columns)->default_value(""), "csv/tsv: columns to ignore")
+            ("header", bool_switch(&has_header), "csv/tsv: skip header line")
+            ("namespaces", value<std::string>(&namespaces)->default_value(""), "vw: comma-separated namespaces in field order, others get next fields as they appear")
+            ("split", value<std::vector<std::string>>(&split_specs)->composing(), "additional output dataset NAME:FRACTION, may be repeated, the rest goes to output file")
+            ("split-by", value<std::string>(&split_key_name)->default_value("ratio"), "split key: ratio (example number), line or group")
+            ("split-seed", value<uint>(&split_seed), "seed of split hashing")
+            ("input-file,I", value<std::string>(&input_file_name)->required(), "input file name, - for stdin")
             ("output-file,O", value<std::string>(&output_file_name)->required(), "output file name");
 
         positional_options_desc.add("input-file", 1).add("output-file", 1);
@@ -27,5 +46,6 @@ public:
 
     virtual int run();
 private:
-    void convert_from_ffm();
+    text_parser * create_csv_parser(char delimiter);
+    void convert_text(text_parser & parser, convert_splitter & splitter);
 };
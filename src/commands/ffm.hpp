@@ -2,26 +2,39 @@
 
 #include "model.hpp"
 #include "../models/ffm.hpp"
+#include "../util/optimizer.hpp"
 
 
 class ffm_command : public model_command {
 protected:
-    uint n_dim;
-    float eta, lambda;
+    uint n_dim, numa_sync_interval, n_update_shards, max_interactions;
+    float eta, lambda, l1, dropout;
+    std::string optimizer, numa_mode, shared_weights_file_name;
 public:
     ffm_command() {
         using namespace boost::program_options;
 
         options_desc.add_options()
+            ("save-model", value<std::string>(&save_model_file_name), "file to save trained model (by process 0 in distributed mode)")
             ("dim,k", value<uint>(&n_dim)->default_value(4), "dimensions")
             ("eta", value<float>(&eta)->default_value(0.2), "learning rate")
-            ("lambda", value<float>(&lambda)->default_value(0.00002), "l2 regularization coeff");
+            ("lambda", value<float>(&lambda)->default_value(0.00002), "l2 regularization coeff")
+            ("optimizer", value<std::string>(&optimizer)->default_value("adagrad"), "optimizer: adagrad, ftrl or adam (use smaller eta, like 0.01)")
+            ("l1", value<float>(&l1)->default_value(0), "ftrl: l1 regularization coeff")
+            ("dropout", value<float>(&dropout)->default_value(0.5), "rate of interactions dropped in training")
+            ("max-interactions", value<uint>(&max_interactions)->default_value(0), "sample interactions of long examples to given expected count in training (0 to train all)")
+            ("numa", value<std::string>(&numa_mode)->default_value("none"), "weights placement over numa nodes: none, replicate, partition or auto (replicate if fits node memory)")
+            ("numa-sync", value<uint>(&numa_sync_interval)->default_value(16), "replicate: number of batches to average all replica weights")
+            ("update-shards", value<uint>(&n_update_shards)->default_value(0), "apply updates by given number of threads owning weight rows by index hash instead of hogwild (at most 64)")
+            ("shared-weights", value<std::string>(&shared_weights_file_name), "keep weights in given file mapped shared by all processes (created by process 0), which train it lock-free");
     }
 
     virtual std::string name() { return "ffm"; }
     virtual std::string description() { return "train and apply ffm model"; }
 
     virtual std::unique_ptr<model> create_model(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits) {
-        return std::unique_ptr<model>(new ffm_model(n_fields, n_indices, n_index_bits, n_dim, seed, eta, lambda));
+        check_optimizer_options(optimizer, l1);
+
+        return std::unique_ptr<model>(new ffm_model(n_fields, n_indices, n_index_bits, n_dim, seed, eta, lambda, numa_mode, numa_sync_interval, n_update_shards, shared_weights_file_name, rank == 0, dropout, max_interactions, optimizer, l1, loss_name));
     }
 };
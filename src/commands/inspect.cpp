@@ -0,0 +1,239 @@
+#include "inspect.hpp"
+
+#include "../util/dataset.hpp"
+#include "../util/hash.hpp"
+#include "../util/hyperloglog.hpp"
+#include "../util/mmap.hpp"
+#include "../util/parallel.hpp"
+#include "../models/ffm.hpp"
+#include "../models/nn.hpp"
+
+#include <batch_learn.hpp>
+
+#include <iomanip>
+#include <limits>
+
+#include <omp.h>
+
+// Number of examples scanned by one task
+constexpr uint64_t inspect_batch_size = 100000;
+
+// Number of log2 buckets in length histograms
+constexpr uint histogram_size = 34;
+
+static const char * encoding_names[] = { "float", "one", "u8", "fp16" };
+
+
+inline uint log2_bucket(uint64_t n) {
+    return n == 0 ? 0 : 64 - __builtin_clzll(n);
+}
+
+
+static void print_histogram(const std::vector<uint64_t> & histogram, uint64_t total) {
+    using namespace std;
+
+    for (uint b = 0; b < histogram.size(); ++ b) {
+        if (histogram[b] == 0)
+            continue;
+
+        uint64_t from = b == 0 ? 0 : 1ull << (b - 1);
+        uint64_t to = b == 0 ? 0 : (1ull << b) - 1;
+
+        cout << "    " << setw(16) << right << (from == to ? to_string(from) : to_string(from) + "-" + to_string(to));
+        cout << setw(14) << histogram[b] << "  " << fixed << setprecision(2) << (100.0 * histogram[b] / total) << "%" << endl;
+    }
+}
+
+
+struct inspect_stats {
+    uint64_t n_features, n_pairs, n_invalid;
+    uint64_t min_features, max_features;
+
+    std::vector<uint64_t> length_histogram;
+
+    std::vector<uint64_t> field_counts;
+    std::vector<uint64_t> field_unit_values;
+    std::vector<float> field_min_values;
+    std::vector<float> field_max_values;
+    std::vector<hyperloglog> field_distinct;
+
+    inspect_stats(uint32_t n_fields):
+        n_features(0), n_pairs(0), n_invalid(0), min_features(std::numeric_limits<uint64_t>::max()), max_features(0),
+        length_histogram(histogram_size, 0),
+        field_counts(n_fields, 0), field_unit_values(n_fields, 0),
+        field_min_values(n_fields, std::numeric_limits<float>::max()), field_max_values(n_fields, std::numeric_limits<float>::lowest()),
+        field_distinct(n_fields) {}
+
+    void merge(const inspect_stats & other) {
+        n_features += other.n_features;
+        n_pairs += other.n_pairs;
+        n_invalid += other.n_invalid;
+        min_features = std::min(min_features, other.min_features);
+        max_features = std::max(max_features, other.max_features);
+
+        for (uint b = 0; b < histogram_size; ++ b)
+            length_histogram[b] += other.length_histogram[b];
+
+        for (uint f = 0; f < field_counts.size(); ++ f) {
+            field_counts[f] += other.field_counts[f];
+            field_unit_values[f] += other.field_unit_values[f];
+            field_min_values[f] = std::min(field_min_values[f], other.field_min_values[f]);
+            field_max_values[f] = std::max(field_max_values[f], other.field_max_values[f]);
+            field_distinct[f].merge(other.field_distinct[f]);
+        }
+    }
+};
+
+
+int inspect_command::run() {
+    using namespace std;
+    using namespace batch_learn;
+
+    omp_set_num_threads(n_threads);
+
+    batch_learn_dataset dataset(input_file_name);
+    const file_index & index = dataset.index;
+
+    double start_time = omp_get_wtime();
+
+    // Check index consistency first, data scan relies on it
+    if (index.offsets[0] != 0)
+        throw runtime_error("Index offsets don't start from zero");
+
+    for (uint64_t ei = 0; ei < index.n_examples; ++ ei)
+        if (index.offsets[ei+1] < index.offsets[ei])
+            throw runtime_error("Index offsets are not monotonic at example " + to_string(ei));
+
+    mapped_file data(dataset.data_file_name, MADV_SEQUENTIAL);
+
+    if (data.size() != index.data_size())
+        throw runtime_error("Data file size " + to_string(data.size()) + " doesn't match index, expected " + to_string(index.data_size()));
+
+    // Scan data in parallel
+    uint32_t index_mask = (1ul << index.n_index_bits) - 1;
+
+    auto batches = dataset.generate_batches(inspect_batch_size);
+
+    inspect_stats total(index.n_fields);
+    parallel_error error;
+
+    #pragma omp parallel
+    {
+        inspect_stats local(index.n_fields);
+        vector<feature> decoded;
+
+        #pragma omp for schedule(dynamic, 1) nowait
+        for (uint64_t bi = 0; bi < batches.size(); ++ bi) {
+            const feature * features = data.data<feature>();
+            uint64_t batch_offset = 0;
+
+            // Packed data is decoded batch by batch
+            if (index.packed()) {
+                batch_offset = index.offsets[batches[bi].first];
+                decoded.resize(index.offsets[batches[bi].second] - batch_offset);
+
+                if (!error.run([&] { decode_features(index, batches[bi].first, batches[bi].second, data.data<char>() + index.data_offsets[batches[bi].first], decoded.data()); }))
+                    continue;
+
+                features = decoded.data();
+            }
+
+            for (auto ei = batches[bi].first; ei < batches[bi].second; ++ ei) {
+                uint64_t n = index.offsets[ei+1] - index.offsets[ei];
+
+                local.n_features += n;
+                local.n_pairs += n * (n - (n > 0)) / 2;
+                local.min_features = std::min(local.min_features, n);
+                local.max_features = std::max(local.max_features, n);
+                local.length_histogram[log2_bucket(n)] ++;
+
+                for (const feature * f = features + (index.offsets[ei] - batch_offset); f != features + (index.offsets[ei+1] - batch_offset); ++ f) {
+                    uint32_t field = f->index >> index.n_index_bits;
+                    uint32_t idx = f->index & index_mask;
+
+                    if (field >= index.n_fields || idx >= index.n_indices) {
+                        local.n_invalid ++;
+                        continue;
+                    }
+
+                    local.field_counts[field] ++;
+                    local.field_unit_values[field] += (f->value == 1.0f);
+                    local.field_min_values[field] = std::min(local.field_min_values[field], f->value);
+                    local.field_max_values[field] = std::max(local.field_max_values[field], f->value);
+                    local.field_distinct[field].add(hash_u64(idx));
+                }
+            }
+        }
+
+        #pragma omp critical
+        total.merge(local);
+    }
+
+    error.rethrow();
+
+    // Index statistics
+    uint64_t n_positive = 0, n_groups = 0, min_group = numeric_limits<uint64_t>::max(), max_group = 0;
+    vector<uint64_t> group_histogram(histogram_size, 0);
+
+    for (uint64_t ei = 0, gs = 0; ei < index.n_examples; ++ ei) {
+        n_positive += index.labels[ei] > 0;
+
+        // Groups are runs of consecutive examples with same id
+        if (ei + 1 == index.n_examples || index.groups[ei+1] != index.groups[ei]) {
+            uint64_t size = ei + 1 - gs;
+
+            n_groups ++;
+            min_group = std::min(min_group, size);
+            max_group = std::max(max_group, size);
+            group_histogram[log2_bucket(size)] ++;
+
+            gs = ei + 1;
+        }
+    }
+
+    double elapsed = omp_get_wtime() - start_time;
+    uint64_t n_examples = std::max<uint64_t>(index.n_examples, 1);
+
+    cout << endl;
+    cout << "Examples: " << index.n_examples << ", features: " << total.n_features << ", fields: " << index.n_fields << ", indices: " << index.n_indices << " (" << index.n_index_bits << " index bits)" << endl;
+    cout << "Labels: " << n_positive << " positive (" << fixed << setprecision(2) << (100.0 * n_positive / n_examples) << "%), " << (index.n_examples - n_positive) << " negative" << endl;
+
+    cout << endl << "Features per example: min " << (index.n_examples > 0 ? total.min_features : 0) << ", mean " << setprecision(2) << (double(total.n_features) / n_examples) << ", max " << total.max_features << endl;
+    print_histogram(total.length_histogram, n_examples);
+
+    cout << endl << "Groups: " << n_groups << ", size min " << (n_groups > 0 ? min_group : 0) << ", mean " << setprecision(2) << (double(index.n_examples) / std::max<uint64_t>(n_groups, 1)) << ", max " << max_group << endl;
+    print_histogram(group_histogram, std::max<uint64_t>(n_groups, 1));
+
+    cout << endl << "Fields:" << endl;
+    cout << "    " << setw(6) << "field" << setw(14) << "features" << setw(12) << "distinct" << setw(12) << "min value" << setw(12) << "max value" << setw(10) << "unit %" << setw(10) << "encoding" << endl;
+
+    for (uint32_t f = 0; f < index.n_fields; ++ f) {
+        uint64_t cnt = total.field_counts[f];
+
+        cout << "    " << setw(6) << f << setw(14) << cnt << setw(12) << uint64_t(cnt > 0 ? total.field_distinct[f].estimate() + 0.5 : 0);
+
+        if (cnt > 0)
+            cout << setw(12) << setprecision(4) << total.field_min_values[f] << setw(12) << total.field_max_values[f] << setw(10) << setprecision(2) << (100.0 * total.field_unit_values[f] / cnt);
+        else
+            cout << setw(12) << "-" << setw(12) << "-" << setw(10) << "-";
+
+        cout << setw(10) << encoding_names[index.packed() ? index.field_encodings[f] : value_float] << endl;
+    }
+
+    cout << endl << "Out of bounds features: " << total.n_invalid << endl;
+
+    double mean_pairs = double(total.n_pairs) / n_examples;
+    double mean_features = double(total.n_features) / n_examples;
+
+    cout << endl << "Model estimates:" << endl;
+    cout << "    ffm (k = " << n_dim << "): " << setprecision(1) << (ffm_model::n_weights(index.n_fields, index.n_indices, n_dim) * sizeof(float) / 1024.0 / 1024) << " MB weights, ";
+    cout << setprecision(1) << mean_pairs << " interactions and " << ffm_model::n_predict_ops(mean_features, mean_pairs, n_dim) << " multiply-adds per example" << endl;
+    cout << "    nn: " << setprecision(1) << (nn_model::n_weights(index.n_indices) * sizeof(float) / 1024.0 / 1024) << " MB weights, ";
+    cout << setprecision(1) << nn_model::n_predict_ops(mean_features) << " multiply-adds per example" << endl;
+
+    cout << endl << "Data: " << setprecision(2) << (double(data.size()) / std::max<uint64_t>(total.n_features, 1)) << " bytes per feature" << endl;
+
+    cout << endl << "Scanned " << (data.size() / 1024 / 1024) << " MB in " << setprecision(3) << elapsed << " seconds (" << setprecision(2) << (data.size() / elapsed / 1e9) << " GB/s)" << endl;
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "command.hpp"
+
+
+class inspect_command : public command {
+protected:
+    std::string input_file_name;
+    uint n_dim, n_threads;
+public:
+    inspect_command() {
+        using namespace boost::program_options;
+
+        options_desc.add_options()
+            ("dim,k", value<uint>(&n_dim)->default_value(4), "ffm dimensions to estimate model size and cost")
+            ("threads,t", value<uint>(&n_threads)->default_value(4), "number of threads")
+            ("input-file,I", value<std::string>(&input_file_name)->required(), "input dataset name");
+
+        positional_options_desc.add("input-file", 1);
+    }
+
+    virtual std::string name() { return "inspect"; }
+    virtual std::string description() { return "print dataset statistics"; }
+
+    virtual int run();
+};
@@ -1,12 +1,22 @@
 #include "model.hpp"
 
 #include "../util/dataset.hpp"
+#include "../util/queue.hpp"
+#include "../util/text_parser.hpp"
+#include "../util/topology.hpp"
+#include "../util/scheduler.hpp"
+#include "../util/distributed.hpp"
+#include "../util/loss.hpp"
+#include "../util/parallel.hpp"
 
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <random>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include <immintrin.h>
 #include <omp.h>
@@ -16,6 +26,7 @@
 // Batch configuration
 const uint32_t batch_size = 20000;
 const uint32_t mini_batch_size = 24;
+const uint32_t prefetch_batches = 2; // Next own batches of thread to prefetch
 
 
 static std::default_random_engine rnd(2017);
@@ -31,111 +42,617 @@ std::vector<std::pair<uint64_t, uint64_t>> generate_mini_batches(uint64_t begin,
 }
 
 
-float compute_norm(batch_learn::feature * fa, batch_learn::feature * fb) {
-    float norm = 0;
+// Train on example, returning its score before update, losses of scores are summed in batches
+float train_on_example(model & m, const loss_function & loss_fn, float y, batch_learn::feature * start, batch_learn::feature * end) {
+    float norm = compute_norm(start, end);
 
-    for (batch_learn::feature * f = fa; f != fb; ++ f)
-        norm += f->value * f->value;
+    float t = m.predict(start, end, norm, true);
 
-    return norm;
+    m.update(start, end, norm, loss_fn.gradient(y, t));
+
+    return t;
 }
 
 
-double train_on_dataset(model & m, const batch_learn_dataset & dataset) {
-    time_t start_time = time(nullptr);
+// Queues of examples which model wants to train on other numa nodes, drained by threads running there.
+// Each thread appends examples to its own per-node blocks without locking, full blocks (and all of them
+// at the end of batch) are moved to node queue, so queue lock is taken once per block, not per example.
+class example_router {
+    static constexpr uint max_nodes = 64;
+    static constexpr uint max_queue_size = 4 * batch_size; // Bound memory when node has no training threads
+    static constexpr uint block_size = 256; // Examples appended by thread before passing them to node
+
+    // Examples with features stored contiguously, as in batches
+    struct routed_block {
+        std::vector<float> labels;
+        std::vector<uint64_t> offsets;
+        std::vector<batch_learn::feature> features;
+
+        routed_block(): offsets(1, 0) {}
+
+        uint64_t size() const {
+            return labels.size();
+        }
+
+        void append(float y, const batch_learn::feature * start, const batch_learn::feature * end) {
+            labels.push_back(y);
+            features.insert(features.end(), start, end);
+            offsets.push_back(features.size());
+        }
+
+        void clear() {
+            labels.clear();
+            offsets.resize(1);
+            features.clear();
+        }
+    };
+
+    struct node_queue {
+        std::mutex mutex;
+        std::vector<routed_block> blocks;
+        std::atomic<uint64_t> size{0}; // Examples in blocks, checked without lock
+        char padding[64]; // Keep queues of nodes in separate cache lines
+    };
+
+    struct thread_blocks {
+        std::vector<routed_block> nodes;
+        char padding[64]; // Keep blocks of threads in separate cache lines
+    };
+
+    std::vector<node_queue> queues;
+    std::vector<thread_blocks> threads;
+public:
+    example_router(): queues(max_nodes), threads(omp_get_max_threads()) {
+        for (auto & t : threads)
+            t.nodes.resize(max_nodes);
+    }
+
+    // Queue example for given node, false if it should be trained locally
+    bool push(int node, float y, const batch_learn::feature * start, const batch_learn::feature * end) {
+        uint t = omp_get_thread_num();
+
+        if (node < 0 || node >= int(max_nodes) || t >= threads.size())
+            return false;
+
+        auto & block = threads[t].nodes[node];
+
+        if (queues[node].size.load(std::memory_order_relaxed) + block.size() >= max_queue_size)
+            return false;
+
+        block.append(y, start, end);
+
+        if (block.size() >= block_size)
+            publish(node, block);
+
+        return true;
+    }
+
+    // Pass examples appended by calling thread to their nodes
+    void flush() {
+        uint t = omp_get_thread_num();
+
+        if (t >= threads.size())
+            return;
+
+        for (uint node = 0; node < max_nodes; ++ node)
+            if (threads[t].nodes[node].size() > 0)
+                publish(node, threads[t].nodes[node]);
+    }
+
+    // Train on examples queued for node, returns their loss
+    double drain(model & m, const loss_function & loss_fn, int node) {
+        if (node < 0 || node >= int(max_nodes))
+            return 0.0;
+
+        auto & queue = queues[node];
+
+        if (queue.size.load(std::memory_order_relaxed) == 0)
+            return 0.0;
+
+        std::vector<routed_block> blocks;
+
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            std::swap(blocks, queue.blocks);
+        }
+
+        double loss = 0.0;
+        std::vector<float> ts;
+
+        for (auto & b : blocks) {
+            queue.size -= b.size();
+
+            ts.resize(b.size());
+
+            for (uint64_t i = 0; i < b.size(); ++ i)
+                ts[i] = train_on_example(m, loss_fn, b.labels[i], b.features.data() + b.offsets[i], b.features.data() + b.offsets[i+1]);
+
+            loss += loss_fn.total(b.labels.data(), ts.data(), ts.size());
+        }
+
+        return loss;
+    }
+
+    // Train on all queued examples, all threads should have flushed theirs
+    double drain_all(model & m, const loss_function & loss_fn) {
+        double loss = 0.0;
+
+        for (uint node = 0; node < max_nodes; ++ node)
+            loss += drain(m, loss_fn, node);
+
+        return loss;
+    }
+private:
+    void publish(int node, routed_block & block) {
+        auto & queue = queues[node];
+
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        queue.size += block.size();
+        queue.blocks.push_back(std::move(block));
+
+        block = routed_block();
+    }
+};
+
+
+// Train on examples of one batch, example offsets point into batch features and start from offsets[0],
+// examples which model prefers to train on other numa node are passed to them through router
+double train_on_batch(model & m, const loss_function & loss_fn, uint64_t n_examples, const float * labels, const uint64_t * offsets, batch_learn::feature * features, example_router & router) {
+    auto mini_batches = generate_mini_batches(0, n_examples);
+
+    std::shuffle(mini_batches.begin(), mini_batches.end(), rnd);
+
+    int node = current_numa_node();
+
+    // Labels and scores of examples trained here
+    std::vector<float> ys, ts;
+
+    ys.reserve(n_examples);
+    ts.reserve(n_examples);
+
+    for (auto mb = mini_batches.begin(); mb != mini_batches.end(); ++ mb) {
+        for (auto ei = mb->first; ei < mb->second; ++ ei) {
+            float y = labels[ei];
+
+            auto start = features + (offsets[ei] - offsets[0]);
+            auto end = features + (offsets[ei+1] - offsets[0]);
+
+            int target = m.example_node(start, end);
+
+            if (target >= 0 && target != node && router.push(target, y, start, end))
+                continue;
+
+            ys.push_back(y);
+            ts.push_back(train_on_example(m, loss_fn, y, start, end));
+        }
+    }
+
+    router.flush();
+
+    double loss = loss_fn.total(ys.data(), ts.data(), ts.size()) + router.drain(m, loss_fn, node);
+
+    m.sync(false);
+
+    return loss;
+}
+
+
+// Compute loss of batch examples without training, offsets as in train_on_batch
+double evaluate_on_batch(model & m, const loss_function & loss_fn, uint64_t n_examples, const float * labels, const uint64_t * offsets, batch_learn::feature * features) {
+    std::vector<float> ts(n_examples);
+
+    score_context ctx = m.create_score_context();
+
+    for (uint64_t ei = 0; ei < n_examples; ++ ei) {
+        auto start = features + (offsets[ei] - offsets[0]);
+        auto end = features + (offsets[ei+1] - offsets[0]);
+
+        float norm = compute_norm(start, end);
+        ts[ei] = m.score(start, end, norm, ctx);
+    }
+
+    return loss_fn.total(labels, ts.data(), n_examples);
+}
+
 
+// Training or evaluation pass over batch dataset
+struct dataset_pass {
+    const batch_learn_dataset & dataset;
+    bool train;
+
+    std::vector<std::pair<uint64_t, uint64_t>> batches;
+
+    double loss;
+    uint64_t cnt;
+
+    std::atomic<time_t> start_time; // Time first batch was taken
+    time_t end_time;
+
+    dataset_pass(const batch_learn_dataset & dataset, bool train): dataset(dataset), train(train), loss(0), cnt(0), start_time(0), end_time(0) {
+        batches = dataset.generate_batches(batch_size);
+
+        if (train)
+            std::shuffle(batches.begin(), batches.end(), rnd);
+    }
+
+    dataset_pass(const batch_learn_dataset & dataset, bool train, const std::vector<std::pair<uint64_t, uint64_t>> & batches):
+        dataset(dataset), train(train), batches(batches), loss(0), cnt(0), start_time(0), end_time(0) {}
+
+    void print_result() const {
+        std::cout << cnt << " examples processed in " << (end_time - (start_time > 0 ? time_t(start_time) : end_time)) << " seconds, loss = " << std::fixed << std::setprecision(5) << (loss / cnt) << std::endl;
+    }
+};
+
+
+// Run passes over batch datasets with work-stealing scheduler, threads which find no batches
+// of a pass left start the next one while the rest finish its tail
+static void run_dataset_passes(model & m, const loss_function & loss_fn, const std::vector<dataset_pass *> & passes) {
+    std::vector<uint64_t> n_batches;
+
+    for (auto pass : passes) {
+        pass->dataset.start_reading(pass->batches);
+        n_batches.push_back(pass->batches.size());
+    }
+
+    example_router router;
+    work_stealing_scheduler scheduler(0, prefetch_batches);
+
+    scheduler.run(n_batches, [&](uint pi, uint64_t bi) {
+        dataset_pass & pass = *passes[pi];
+
+        time_t not_started = 0;
+        pass.start_time.compare_exchange_strong(not_started, time(nullptr));
+
+        auto batch_start_index = pass.batches[bi].first;
+        auto batch_end_index = pass.batches[bi].second;
+
+        auto labels = pass.dataset.index.labels.data() + batch_start_index;
+        auto offsets = pass.dataset.index.offsets.data() + batch_start_index;
+
+        std::vector<batch_learn::feature> batch_features;
+        pass.dataset.reader->read(bi, batch_features);
+
+        double loss = pass.train
+            ? train_on_batch(m, loss_fn, batch_end_index - batch_start_index, labels, offsets, batch_features.data(), router)
+            : evaluate_on_batch(m, loss_fn, batch_end_index - batch_start_index, labels, offsets, batch_features.data());
+
+        #pragma omp atomic
+        pass.loss += loss;
+
+        #pragma omp atomic
+        pass.cnt += batch_end_index - batch_start_index;
+    }, [&](uint pi, uint64_t bi) {
+        passes[pi]->dataset.reader->prefetch(bi);
+    }, [&](uint pi) {
+        dataset_pass & pass = *passes[pi];
+
+        if (pass.train) {
+            pass.loss += router.drain_all(m, loss_fn);
+            m.sync(true);
+        }
+
+        pass.end_time = time(nullptr);
+    });
+}
+
+
+double train_on_dataset(model & m, const loss_function & loss_fn, const batch_learn_dataset & dataset) {
     std::cout << "  Training... ";
     std::cout.flush();
 
-    auto batches = dataset.generate_batches(batch_size);
+    dataset_pass pass(dataset, true);
 
-    std::shuffle(batches.begin(), batches.end(), rnd);
+    run_dataset_passes(m, loss_fn, { &pass });
+    pass.print_result();
 
-    double loss = 0.0;
-    uint64_t cnt = 0;
+    return pass.loss;
+}
 
-    // Iterate over batches, read each and then iterate over examples
-    #pragma omp parallel for schedule(dynamic, 1) reduction(+: loss) reduction(+: cnt)
-    for (uint64_t bi = 0; bi < batches.size(); ++ bi) {
-        auto batch_start_index = batches[bi].first;
-        auto batch_end_index = batches[bi].second;
 
-        auto batch_start_offset = dataset.index.offsets[batch_start_index];
-        auto batch_end_offset = dataset.index.offsets[batch_end_index];
+// Model wrapper recording feature indices of trained examples, rows of which are exchanged between processes
+class touch_tracking_model : public model {
+    model & m;
+    uint32_t index_mask, n_rows;
+    std::vector<std::atomic<uint64_t>> touched;
+public:
+    touch_tracking_model(model & m, uint32_t n_rows, uint32_t n_index_bits): m(m), index_mask((1ul << n_index_bits) - 1), n_rows(n_rows), touched((n_rows + 63) / 64) {
+        for (auto & w : touched)
+            w = 0;
+    }
 
-        auto mini_batches = generate_mini_batches(batch_start_index, batch_end_index);
+    virtual float predict(const batch_learn::feature * start, const batch_learn::feature * end, float norm, bool train) {
+        return m.predict(start, end, norm, train);
+    }
 
-        std::vector<batch_learn::feature> batch_features = batch_learn::read_batch(dataset.data_file_name, batch_start_offset, batch_end_offset);
-        batch_learn::feature * batch_features_data = batch_features.data();
+    virtual float score(const batch_learn::feature * start, const batch_learn::feature * end, float norm, score_context & ctx) const {
+        return m.score(start, end, norm, ctx);
+    }
+
+    virtual size_t score_scratch_size() const {
+        return m.score_scratch_size();
+    }
+
+    virtual void update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa) {
+        for (const batch_learn::feature * f = start; f != end; ++ f) {
+            uint32_t index = f->index & index_mask;
+
+            if (index < n_rows)
+                touched[index >> 6].fetch_or(1ull << (index & 63), std::memory_order_relaxed);
+        }
+
+        m.update(start, end, norm, kappa);
+    }
+
+    virtual int example_node(const batch_learn::feature * start, const batch_learn::feature * end) {
+        return m.example_node(start, end);
+    }
+
+    virtual void sync(bool full) {
+        m.sync(full);
+    }
+
+    virtual uint32_t row_size() const {
+        return m.row_size();
+    }
 
-        std::shuffle(mini_batches.begin(), mini_batches.end(), rnd);
+    virtual void read_row(uint32_t index, float * values) const {
+        m.read_row(index, values);
+    }
 
-        for (auto mb = mini_batches.begin(); mb != mini_batches.end(); ++ mb) {
-            for (auto ei = mb->first; ei < mb->second; ++ ei) {
-                float y = dataset.index.labels[ei];
+    virtual void write_row(uint32_t index, const float * values) {
+        m.write_row(index, values);
+    }
 
-                auto start_offset = dataset.index.offsets[ei] - batch_start_offset;
-                auto end_offset = dataset.index.offsets[ei+1] - batch_start_offset;
+    virtual std::vector<std::pair<float *, size_t>> dense_parameters() {
+        return m.dense_parameters();
+    }
 
-                float norm = compute_norm(batch_features_data + start_offset, batch_features_data + end_offset);
+    virtual bool shared_weights() const {
+        return m.shared_weights();
+    }
 
-                float t = m.predict(batch_features_data + start_offset, batch_features_data + end_offset, norm, true);
-                float expnyt = exp(-y*t);
+    virtual void save(const std::string & file_name) {
+        m.save(file_name);
+    }
 
-                m.update(batch_features_data + start_offset, batch_features_data + end_offset, norm, -y * expnyt / (1+expnyt));
+    // Rows touched since previous call in ascending order
+    std::vector<uint32_t> take_touched() {
+        std::vector<uint32_t> rows;
 
-                loss += log(1+exp(-y*t));
-            }
+        for (uint64_t w = 0; w < touched.size(); ++ w) {
+            uint64_t bits = touched[w].exchange(0);
+
+            for (; bits != 0; bits &= bits - 1)
+                rows.push_back(w * 64 + __builtin_ctzll(bits));
         }
 
-        cnt += batch_end_index - batch_start_index;
+        return rows;
+    }
+};
+
+
+// Exchange touched rows and dense parameters of model with other processes and replace them by averages
+static void average_parameters(touch_tracking_model & m, parameter_averager & averager) {
+    auto rows = m.take_touched();
+    uint32_t row_size = m.row_size();
+
+    std::vector<float> values(rows.size() * row_size), dense;
+
+    #pragma omp parallel for schedule(static)
+    for (uint64_t i = 0; i < rows.size(); ++ i)
+        m.read_row(rows[i], values.data() + i * row_size);
+
+    auto dense_parameters = m.dense_parameters();
+
+    for (auto & p : dense_parameters)
+        dense.insert(dense.end(), p.first, p.first + p.second);
+
+    averager.average(rows, values, row_size, dense);
+
+    #pragma omp parallel for schedule(static)
+    for (uint64_t i = 0; i < rows.size(); ++ i)
+        m.write_row(rows[i], values.data() + i * row_size);
+
+    size_t pos = 0;
+
+    for (auto & p : dense_parameters) {
+        std::copy(dense.begin() + pos, dense.begin() + pos + p.second, p.first);
+        pos += p.second;
+    }
+}
+
+
+// Shuffle dataset batches and take share of process of given rank. Engine is seeded by caller (with seed and epoch)
+// and isn't shared with training threads, so all processes get the same permutation and disjoint shares
+static std::vector<std::pair<uint64_t, uint64_t>> own_shuffled_batches(const batch_learn_dataset & dataset, uint64_t shuffle_seed, uint rank, uint world) {
+    auto batches = dataset.generate_batches(batch_size);
+
+    std::default_random_engine batch_rnd(shuffle_seed);
+    std::shuffle(batches.begin(), batches.end(), batch_rnd);
+
+    std::vector<std::pair<uint64_t, uint64_t>> own_batches;
+
+    for (uint64_t bi = rank; bi < batches.size(); bi += world)
+        own_batches.push_back(batches[bi]);
+
+    return own_batches;
+}
+
+
+// Train on share of dataset batches of process of given rank, averaging parameters with other processes every sync_batches
+// batches. All processes shuffle batches in the same way and run the same number of averaging rounds.
+double train_on_dataset_distributed(touch_tracking_model & m, const loss_function & loss_fn, const batch_learn_dataset & dataset, parameter_averager & averager, uint64_t shuffle_seed, uint rank, uint world, uint sync_batches) {
+    std::cout << "  Training... ";
+    std::cout.flush();
+
+    time_t start_time = time(nullptr);
+    uint64_t start_sent = averager.bytes_sent, start_received = averager.bytes_received, start_rounds = averager.n_rounds;
+
+    sync_batches = std::max<uint>(sync_batches, 1);
+
+    auto own_batches = own_shuffled_batches(dataset, shuffle_seed, rank, world);
+
+    uint64_t n_batches = (dataset.index.n_examples + batch_size - 1) / batch_size;
+    uint64_t max_own_batches = (n_batches + world - 1) / world; // Share of rank 0
+    uint64_t n_rounds = std::max<uint64_t>((max_own_batches + sync_batches - 1) / sync_batches, 1);
+
+    double loss = 0.0;
+    uint64_t cnt = 0;
+
+    for (uint64_t round = 0; round < n_rounds; ++ round) {
+        auto from = std::min<uint64_t>(round * sync_batches, own_batches.size());
+        auto to = std::min<uint64_t>(from + sync_batches, own_batches.size());
+
+        dataset_pass pass(dataset, true, std::vector<std::pair<uint64_t, uint64_t>>(own_batches.begin() + from, own_batches.begin() + to));
+
+        run_dataset_passes(m, loss_fn, { &pass });
+        average_parameters(m, averager);
+
+        loss += pass.loss;
+        cnt += pass.cnt;
     }
 
     std::cout << cnt << " examples processed in " << (time(nullptr) - start_time) << " seconds, loss = " << std::fixed << std::setprecision(5) << (loss / cnt) << std::endl;
+    std::cout << "  Averaged parameters of " << world << " processes " << (averager.n_rounds - start_rounds) << " times, sent " << std::setprecision(1) << ((averager.bytes_sent - start_sent) / 1024.0 / 1024) << " MB, received " << ((averager.bytes_received - start_received) / 1024.0 / 1024) << " MB" << std::endl;
 
     return loss;
 }
 
 
-double evaluate_on_dataset(model & m, const batch_learn_dataset & dataset) {
+// Train on share of dataset batches of process of given rank directly into weights shared with other processes,
+// returning when all processes are done with the epoch
+double train_on_dataset_shared(model & m, const loss_function & loss_fn, const batch_learn_dataset & dataset, parameter_averager & averager, uint64_t shuffle_seed, uint rank, uint world) {
+    std::cout << "  Training... ";
+    std::cout.flush();
+
     time_t start_time = time(nullptr);
 
+    auto own_batches = own_shuffled_batches(dataset, shuffle_seed, rank, world);
+
+    dataset_pass pass(dataset, true, own_batches);
+
+    run_dataset_passes(m, loss_fn, { &pass });
+
+    std::cout << pass.cnt << " examples processed in " << (time(nullptr) - start_time) << " seconds, loss = " << std::fixed << std::setprecision(5) << (pass.loss / pass.cnt) << std::endl;
+
+    averager.barrier();
+
+    return pass.loss;
+}
+
+
+// Evaluate models on dataset, reporting loss and speed of each
+static void compare_models(model & a, model & b, const loss_function & loss_fn, const batch_learn_dataset & dataset) {
+    for (model * m : { &a, &b }) {
+        std::cout << "  Evaluating " << m->kernels_name() << " model... ";
+        std::cout.flush();
+
+        dataset_pass pass(dataset, false);
+
+        double start_time = omp_get_wtime();
+        run_dataset_passes(*m, loss_fn, { &pass });
+        double elapsed = omp_get_wtime() - start_time;
+
+        std::cout << "loss = " << std::fixed << std::setprecision(5) << (pass.loss / pass.cnt) << ", " << std::setprecision(0) << (pass.cnt / elapsed) << " examples per second" << std::endl;
+    }
+}
+
+
+// Train on dataset and evaluate on validation one, evaluation starts while last train batches are processed
+void train_and_evaluate_on_datasets(model & m, const loss_function & loss_fn, const batch_learn_dataset & train_dataset, const batch_learn_dataset & val_dataset) {
+    std::cout << "  Training... ";
+    std::cout.flush();
+
+    dataset_pass train_pass(train_dataset, true), val_pass(val_dataset, false);
+
+    run_dataset_passes(m, loss_fn, { &train_pass, &val_pass });
+    train_pass.print_result();
+
     std::cout << "  Evaluating... ";
+    val_pass.print_result();
+}
+
+
+// Train on text dataset parsed on the fly: parser threads feed training threads through bounded queue,
+// parsed examples are optionally written to binary cache dataset in input order, parser is pinned to reader cpus if given
+double train_on_text(model & m, const loss_function & loss_fn, const std::string & file_name, text_parser & parser, uint n_parser_threads, const std::string & cache_file_name, const std::vector<int> & reader_cpus) {
+    using namespace batch_learn;
+
+    time_t start_time = time(nullptr);
+
+    std::cout << "  Training on text... ";
     std::cout.flush();
 
-    auto batches = dataset.generate_batches(batch_size);
+    FILE * input_file = file_name == "-" ? stdin : fopen(file_name.c_str(), "r");
+    if (input_file == nullptr)
+        throw std::runtime_error(std::string("Error opening input file ") + file_name);
 
-    double loss = 0.0;
-    uint32_t cnt = 0;
+    std::unique_ptr<stream_data_writer> cache_data_writer;
+    std::unique_ptr<stream_index_writer> cache_index_writer;
+    uint32_t cache_n_fields = 0, cache_n_indices = 0;
 
-    std::vector<float> predictions(dataset.index.n_examples);
+    if (!cache_file_name.empty()) {
+        cache_data_writer.reset(new stream_data_writer(cache_file_name + ".data"));
+        cache_index_writer.reset(new stream_index_writer(cache_file_name + ".index"));
+    }
 
-    // Iterate over batches, read each and then iterate over examples
-    #pragma omp parallel for schedule(dynamic, 1) reduction(+: loss) reduction(+: cnt)
-    for (uint32_t bi = 0; bi < batches.size(); ++ bi) {
-        auto batch_start_index = batches[bi].first;
-        auto batch_end_index = batches[bi].second;
+    bounded_queue<parsed_block> queue(2 * omp_get_max_threads());
+    parallel_error parser_error;
 
-        auto batch_start_offset = dataset.index.offsets[batch_start_index];
-        auto batch_end_offset = dataset.index.offsets[batch_end_index];
+    std::thread producer([&] {
+        parser_error.run([&] {
+            if (!reader_cpus.empty()) // Parser threads inherit affinity of producer
+                pin_thread(reader_cpus);
 
-        std::vector<batch_learn::feature> batch_features = batch_learn::read_batch(dataset.data_file_name, batch_start_offset, batch_end_offset);
-        batch_learn::feature * batch_features_data = batch_features.data();
+            parse_text_parallel(input_file, parser, [&](parsed_block & block) {
+                if (cache_data_writer) {
+                    cache_n_fields = std::max(cache_n_fields, block.n_fields);
+                    cache_n_indices = std::max(cache_n_indices, block.n_indices);
 
-        for (auto ei = batch_start_index; ei < batch_end_index; ++ ei) {
-            float y = dataset.index.labels[ei];
+                    for (uint64_t i = 0; i < block.size(); ++ i) {
+                        cache_data_writer->write(block.features.data() + block.offsets[i], block.offsets[i+1] - block.offsets[i]);
+                        cache_index_writer->write(block.labels[i], block.groups[i], *cache_data_writer);
+                    }
+                }
 
-            auto start_offset = dataset.index.offsets[ei] - batch_start_offset;
-            auto end_offset = dataset.index.offsets[ei+1] - batch_start_offset;
+                parsed_block item(block.n_index_bits);
+                std::swap(item, block);
+                queue.push(std::move(item));
+            }, n_parser_threads);
+        });
 
-            float norm = compute_norm(batch_features_data + start_offset, batch_features_data + end_offset);
-            float t = m.predict(batch_features_data + start_offset, batch_features_data + end_offset, norm, false);
+        queue.close();
+    });
 
-            loss += log(1+exp(-y*t));
-            predictions[ei] = 1 / (1+exp(-t));
+    double loss = 0.0;
+    uint64_t cnt = 0;
+
+    example_router router;
+
+    #pragma omp parallel reduction(+: loss) reduction(+: cnt)
+    {
+        parsed_block block;
+
+        while (queue.pop(block)) {
+            loss += train_on_batch(m, loss_fn, block.size(), block.labels.data(), block.offsets.data(), block.features.data(), router);
+            cnt += block.size();
         }
+    }
 
-        cnt += batch_end_index - batch_start_index;
+    producer.join();
+
+    loss += router.drain_all(m, loss_fn);
+    m.sync(true);
+
+    if (input_file != stdin)
+        fclose(input_file);
+
+    parser_error.rethrow();
+
+    if (cache_data_writer) {
+        cache_data_writer->close();
+        cache_index_writer->finish(*cache_data_writer, cache_n_fields, cache_n_indices, parser.n_index_bits);
     }
 
     std::cout << cnt << " examples processed in " << (time(nullptr) - start_time) << " seconds, loss = " << std::fixed << std::setprecision(5) << (loss / cnt) << std::endl;
@@ -143,7 +660,20 @@ double evaluate_on_dataset(model & m, const batch_learn_dataset & dataset) {
     return loss;
 }
 
-void predict_on_dataset(model & m, const batch_learn_dataset & dataset, std::ostream & out) {
+
+double evaluate_on_dataset(model & m, const loss_function & loss_fn, const batch_learn_dataset & dataset) {
+    std::cout << "  Evaluating... ";
+    std::cout.flush();
+
+    dataset_pass pass(dataset, false);
+
+    run_dataset_passes(m, loss_fn, { &pass });
+    pass.print_result();
+
+    return pass.loss;
+}
+
+void predict_on_dataset(model & m, const loss_function & loss_fn, const batch_learn_dataset & dataset, std::ostream & out) {
     time_t start_time = time(nullptr);
 
     std::cout << "  Predicting... ";
@@ -151,29 +681,38 @@ void predict_on_dataset(model & m, const batch_learn_dataset & dataset, std::ost
 
     auto batches = dataset.generate_batches(batch_size);
 
+    dataset.start_reading(batches);
+
     uint64_t cnt = 0;
 
+    score_context ctx = m.create_score_context();
+
     // Iterate over batches, read each and then iterate over examples
     for (uint64_t bi = 0; bi < batches.size(); ++ bi) {
         auto batch_start_index = batches[bi].first;
         auto batch_end_index = batches[bi].second;
 
         auto batch_start_offset = dataset.index.offsets[batch_start_index];
-        auto batch_end_offset = dataset.index.offsets[batch_end_index];
 
-        std::vector<batch_learn::feature> batch_features = batch_learn::read_batch(dataset.data_file_name, batch_start_offset, batch_end_offset);
+        std::vector<batch_learn::feature> batch_features;
+        dataset.reader->read(bi, batch_features);
         batch_learn::feature * batch_features_data = batch_features.data();
 
+        std::vector<float> outputs(batch_end_index - batch_start_index);
+
         for (auto ei = batch_start_index; ei < batch_end_index; ++ ei) {
             auto start_offset = dataset.index.offsets[ei] - batch_start_offset;
             auto end_offset = dataset.index.offsets[ei+1] - batch_start_offset;
 
             float norm = compute_norm(batch_features_data + start_offset, batch_features_data + end_offset);
-            float t = m.predict(batch_features_data + start_offset, batch_features_data + end_offset, norm, false);
-
-            out << 1/(1+exp(-t)) << std::endl;
+            outputs[ei - batch_start_index] = m.score(batch_features_data + start_offset, batch_features_data + end_offset, norm, ctx);
         }
 
+        loss_fn.outputs(outputs.data(), outputs.data(), outputs.size());
+
+        for (float p : outputs)
+            out << p << std::endl;
+
         cnt += batch_end_index - batch_start_index;
     }
 
@@ -181,45 +720,185 @@ void predict_on_dataset(model & m, const batch_learn_dataset & dataset, std::ost
 }
 
 
+// Pin OpenMP worker threads with given strategy and report placement
+static void place_threads(const cpu_topology & topology, const std::string & strategy, uint n_threads) {
+    using namespace std;
+
+    cout << "Topology: " << topology.describe() << ", using " << n_threads << " threads";
+
+    if (strategy == "none") {
+        cout << endl;
+        return;
+    }
+
+    auto sets = topology.placement(strategy, n_threads);
+    parallel_error pin_error;
+
+    #pragma omp parallel num_threads(n_threads)
+    pin_error.run([&] { pin_thread(sets[omp_get_thread_num()]); });
+
+    pin_error.rethrow();
+
+    cout << ", pinned " << strategy << " to cpus";
+
+    for (auto & set : sets) {
+        cout << " ";
+
+        for (size_t i = 0; i < set.size(); ++ i)
+            cout << (i > 0 ? "," : "") << set[i];
+    }
+
+    cout << endl;
+}
+
+
 int model_command::run() {
     using namespace std;
 
+    cpu_topology topology;
+
+    n_threads = parse_thread_count(threads_spec, topology);
+
     omp_set_num_threads(n_threads);
+    place_threads(topology, pin_strategy, n_threads);
+
     rnd.seed(seed);
 
-    auto ds_train = batch_learn_dataset(train_file_name);
+    unique_ptr<loss_function> loss_fn = create_loss(loss_name);
+
+    unique_ptr<batch_learn_dataset> ds_train;
+    unique_ptr<text_parser> train_parser;
+    unique_ptr<model> model;
+    uint32_t n_index_bits;
+    vector<int> reader_cpus;
+
+    unique_ptr<parameter_averager> averager;
+
+    if (train_format_name == "binary") {
+        ds_train.reset(new batch_learn_dataset(train_file_name, reader_type, io_depth, !no_verify));
+
+        // Connect to other processes in distributed mode, others create model when process 0 has initialized it (shared weights)
+        if (world_size > 1) {
+            cout << "Connecting process " << rank << " of " << world_size << " to " << coordinator_address << "... ";
+            cout.flush();
+
+            averager.reset(new parameter_averager(rank, world_size, coordinator_address));
+
+            cout << "done." << endl;
+
+            if (rank > 0)
+                averager->barrier();
+        }
+
+        n_index_bits = ds_train->index.n_index_bits;
+        model = create_model(ds_train->index.n_fields, ds_train->index.n_indices, n_index_bits);
+
+        if (averager && rank == 0)
+            averager->barrier();
+    } else {
+        if (world_size > 1)
+            throw runtime_error("Distributed training requires binary train dataset");
+
+        if (train_format_name == "ffm")
+            train_parser.reset(new ffm_text_parser(text_index_bits, rehash_text_indices ? n_text_indices : 0));
+        else if (train_format_name == "libsvm")
+            train_parser.reset(new libsvm_text_parser(text_index_bits, rehash_text_indices ? n_text_indices : 0));
+        else
+            throw runtime_error("Unknown train format " + train_format_name + ", supported formats: binary, ffm, libsvm");
 
-    auto model = create_model(ds_train.index.n_fields, ds_train.index.n_indices, ds_train.index.n_index_bits);
+        if (train_file_name == "-" && train_cache_file_name.empty() && n_epochs > 1)
+            throw runtime_error("Training on stdin for several epochs requires --train-cache");
 
-    if (val_file_name.empty()) { // No validation set given, just train
-        for (uint epoch = 0; epoch < n_epochs; ++ epoch) {
-            cout << "Epoch " << epoch << "..." << endl;
+        n_index_bits = text_index_bits;
+        model = create_model(n_text_fields, n_text_indices, n_index_bits);
 
-            train_on_dataset(*model, ds_train);
+        // Keep parser near storage when pinning
+        int node = file_numa_node(train_file_name);
+
+        if (pin_strategy != "none" && node >= 0 && topology.n_nodes > 1) {
+            reader_cpus = topology.node_cpus(node);
+            cout << "Parser threads are placed on numa node " << node << " of " << train_file_name << " device" << endl;
         }
-    } else { // Train with validation each epoch
-        auto ds_val = batch_learn_dataset(val_file_name);
+    }
 
-        if (ds_val.index.n_index_bits != ds_train.index.n_index_bits)
+    unique_ptr<batch_learn_dataset> ds_val;
+
+    if (!val_file_name.empty()) { // Validate each epoch
+        ds_val.reset(new batch_learn_dataset(val_file_name, reader_type, io_depth, !no_verify));
+
+        if (ds_val->index.n_index_bits != n_index_bits)
             throw std::runtime_error("Mismatching index bits in train and val");
+    }
+
+    // Processes with separate weights exchange touched rows
+    unique_ptr<touch_tracking_model> tracker;
 
-        for (uint epoch = 0; epoch < n_epochs; ++ epoch) {
-            cout << "Epoch " << epoch << "..." << endl;
+    if (averager && !model->shared_weights())
+        tracker.reset(new touch_tracking_model(*model, ds_train->index.n_indices, n_index_bits));
 
-            train_on_dataset(*model, ds_train);
-            evaluate_on_dataset(*model, ds_val);
+    for (uint epoch = 0; epoch < n_epochs; ++ epoch) {
+        cout << "Epoch " << epoch << "..." << endl;
+
+        if (averager && !tracker) { // Shared weights: process 0 evaluates while others wait for next epoch
+            train_on_dataset_shared(*model, *loss_fn, *ds_train, *averager, uint64_t(seed) + epoch, rank, world_size);
+
+            if (ds_val && rank == 0)
+                evaluate_on_dataset(*model, *loss_fn, *ds_val);
+
+            averager->barrier();
+            continue;
+        }
+
+        if (averager) {
+            train_on_dataset_distributed(*tracker, *loss_fn, *ds_train, *averager, uint64_t(seed) + epoch, rank, world_size, sync_batches);
+
+            if (ds_val)
+                evaluate_on_dataset(*model, *loss_fn, *ds_val);
+
+            continue;
+        }
+
+        if (ds_train && ds_val && overlap_eval) {
+            train_and_evaluate_on_datasets(*model, *loss_fn, *ds_train, *ds_val);
+            continue;
         }
+
+        if (ds_train) {
+            train_on_dataset(*model, *loss_fn, *ds_train);
+        } else {
+            train_on_text(*model, *loss_fn, train_file_name, *train_parser, n_parser_threads, train_cache_file_name, reader_cpus);
+
+            // Next epochs read binary cache, text is parsed again if there is no cache
+            if (!train_cache_file_name.empty())
+                ds_train.reset(new batch_learn_dataset(train_cache_file_name, reader_type, io_depth, !no_verify));
+        }
+
+        if (ds_val)
+            evaluate_on_dataset(*model, *loss_fn, *ds_val);
+    }
+
+    if (!save_model_file_name.empty() && rank == 0)
+        model->save(save_model_file_name);
+
+    // Quantize model for predictions, reporting its quality and speed
+    if (int8) {
+        auto quantized = model->quantize(int8_kernels);
+
+        if (ds_val)
+            compare_models(*model, *quantized, *loss_fn, *ds_val);
+
+        model = std::move(quantized);
     }
 
-    // Predict on test if given
-    if (!test_file_name.empty() && !pred_file_name.empty()) {
-        auto ds_test = batch_learn_dataset(test_file_name);
+    // Predict on test if given, only first process writes predictions in distributed mode
+    if (!test_file_name.empty() && !pred_file_name.empty() && rank == 0) {
+        batch_learn_dataset ds_test(test_file_name, reader_type, io_depth, !no_verify);
 
-        if (ds_test.index.n_index_bits != ds_train.index.n_index_bits)
+        if (ds_test.index.n_index_bits != n_index_bits)
             throw std::runtime_error("Mismatching index bits in train and test");
 
         ofstream out(pred_file_name);
-        predict_on_dataset(*model, ds_test, out);
+        predict_on_dataset(*model, *loss_fn, ds_test, out);
     }
 
     return 0;
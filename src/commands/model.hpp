@@ -7,7 +7,12 @@
 class model_command : public command {
 protected:
     std::string train_file_name, val_file_name, test_file_name, pred_file_name;
-    uint n_epochs, n_threads, seed;
+    std::string save_model_file_name; // Option is registered by commands of models supporting saving
+    std::string train_format_name, train_cache_file_name, reader_type, threads_spec, pin_strategy, int8_kernels, loss_name;
+    uint n_epochs, n_threads, seed, io_depth, rank, world_size, sync_batches;
+    std::string coordinator_address;
+    uint n_text_fields, n_text_indices, text_index_bits, n_parser_threads;
+    bool rehash_text_indices, no_verify, overlap_eval, int8;
 public:
     model_command(): seed(0) {
         using namespace boost::program_options;
@@ -17,9 +22,28 @@ public:
             ("val", value<std::string>(&val_file_name), "validation dataset file")
             ("test", value<std::string>(&test_file_name), "test dataset file")
             ("pred", value<std::string>(&pred_file_name), "file to save predictions")
+            ("int8", bool_switch(&int8), "quantize trained model to int8 for predictions, comparing it with fp32 one on validation dataset")
+            ("int8-kernels", value<std::string>(&int8_kernels)->default_value("auto"), "int8 kernels: auto (best supported by cpu), avx2 or vnni")
+            ("loss", value<std::string>(&loss_name)->default_value("logistic"), "loss: logistic (predictions are probabilities), squared or hinge (predictions are scores)")
             ("seed,s", value<uint>(&seed), "random seed")
             ("epochs", value<uint>(&n_epochs)->default_value(10), "number of epochs")
-            ("threads,t", value<uint>(&n_threads)->default_value(4), "number of threads");
+            ("threads,t", value<std::string>(&threads_spec)->default_value("4"), "number of threads, auto to use all available cpus within cgroup quota")
+            ("pin", value<std::string>(&pin_strategy)->default_value("none"), "thread pinning: none, compact, scatter or numa (thread per node in turn)")
+            ("reader", value<std::string>(&reader_type)->default_value("buffered"), "batch reader: buffered, mmap, uring or uring-direct")
+            ("io-depth", value<uint>(&io_depth)->default_value(16), "number of batch reads in flight for uring readers")
+            ("no-verify", bool_switch(&no_verify), "don't verify data checksums on read")
+            ("overlap-eval", bool_switch(&overlap_eval), "start validation while last train batches of epoch are processed")
+            ("world", value<uint>(&world_size)->default_value(1), "distributed: number of training processes, each trains on its share of batches")
+            ("rank", value<uint>(&rank)->default_value(0), "distributed: number of this process, process 0 coordinates averaging")
+            ("coordinator", value<std::string>(&coordinator_address)->default_value("127.0.0.1:7070"), "distributed: host:port process 0 listens on")
+            ("sync-batches", value<uint>(&sync_batches)->default_value(4), "distributed: number of own batches between parameter averaging")
+            ("train-format", value<std::string>(&train_format_name)->default_value("binary"), "train dataset format: binary, or ffm/libsvm text (- for stdin) parsed on the fly")
+            ("train-cache", value<std::string>(&train_cache_file_name), "text train: save parsed dataset in binary format and use it after first epoch")
+            ("fields", value<uint>(&n_text_fields)->default_value(1), "text train: number of fields")
+            ("indices", value<uint>(&n_text_indices)->default_value(1 << 20), "text train: number of in-field indices, larger ones are ignored")
+            ("bits,b", value<uint>(&text_index_bits)->default_value(24), "text train: number of bits to store feature indices")
+            ("rehash", bool_switch(&rehash_text_indices), "text train: rehash feature indices to index count")
+            ("parser-threads", value<uint>(&n_parser_threads)->default_value(2), "text train: number of parser threads");
 
         positional_options_desc.add("test", 1).add("pred", 1);
     }
@@ -2,24 +2,30 @@
 
 #include "model.hpp"
 #include "../models/nn.hpp"
+#include "../util/optimizer.hpp"
 
 
 class nn_command : public model_command {
 protected:
-    float eta, lambda;
+    float eta, lambda, l1;
+    std::string optimizer;
 public:
     nn_command() {
         using namespace boost::program_options;
 
         options_desc.add_options()
             ("eta", value<float>(&eta)->default_value(0.02), "learning rate")
-            ("lambda", value<float>(&lambda)->default_value(0.00002), "l2 regularization coeff");
+            ("lambda", value<float>(&lambda)->default_value(0.00002), "l2 regularization coeff")
+            ("optimizer", value<std::string>(&optimizer)->default_value("adagrad"), "optimizer: adagrad, ftrl or adam (use smaller eta, like 0.001)")
+            ("l1", value<float>(&l1)->default_value(0), "ftrl: l1 regularization coeff");
     }
 
     virtual std::string name() { return "nn"; }
     virtual std::string description() { return "train and apply nn model"; }
 
     virtual std::unique_ptr<model> create_model(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits) {
-        return std::unique_ptr<model>(new nn_model(n_indices, n_index_bits, seed, eta, lambda));
+        check_optimizer_options(optimizer, l1);
+
+        return std::unique_ptr<model>(new nn_model(n_indices, n_index_bits, seed, eta, lambda, optimizer, l1));
     }
 };
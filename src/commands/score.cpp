@@ -0,0 +1,260 @@
+#include "score.hpp"
+#include "model.hpp"
+
+#include "../models/ffm.hpp"
+#include "../util/dataset.hpp"
+#include "../util/loss.hpp"
+#include "../util/parallel.hpp"
+
+#include <batch_learn.hpp>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cmath>
+
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+
+// Scoring result and memory usage of worker process, in shared memory
+struct worker_stats {
+    uint64_t n_examples;
+    double pretouch_time, score_time;
+    uint64_t rss, pss, shared, private_, pmd_mapped; // Bytes
+};
+
+
+// Model saved to file, by its format
+static std::unique_ptr<model> load_model(const std::string & file_name) {
+    char magic[8] = {};
+
+    std::ifstream in(file_name, std::ios::binary);
+
+    if (!in.read(magic, sizeof(magic)))
+        throw std::runtime_error("Can't read model file " + file_name);
+
+    if (memcmp(magic, "BLFFM", 5) == 0)
+        return std::unique_ptr<model>(new ffm_model(file_name));
+
+    throw std::runtime_error("Unknown format of model file " + file_name);
+}
+
+
+// Memory usage of calling process from smaps rollup (or status on old kernels)
+static void read_memory_stats(worker_stats & stats) {
+    std::ifstream in("/proc/self/smaps_rollup");
+
+    bool rollup = in.good();
+
+    if (!rollup)
+        in.open("/proc/self/status");
+
+    stats.rss = stats.pss = stats.shared = stats.private_ = stats.pmd_mapped = 0;
+
+    for (std::string line; std::getline(in, line);) {
+        std::istringstream ss(line);
+        std::string key;
+        uint64_t kb = 0;
+
+        if (!(ss >> key >> kb))
+            continue;
+
+        uint64_t bytes = kb * 1024;
+
+        if (key == "Rss:" || key == "VmRSS:")
+            stats.rss = bytes;
+        else if (key == "Pss:")
+            stats.pss = bytes;
+        else if (key == "Shared_Clean:" || key == "Shared_Dirty:" || key == "RssFile:" || key == "RssShmem:")
+            stats.shared += bytes;
+        else if (key == "Private_Clean:" || key == "Private_Dirty:" || key == "RssAnon:")
+            stats.private_ += bytes;
+        else if (key == "FilePmdMapped:" || key == "ShmemPmdMapped:")
+            stats.pmd_mapped += bytes;
+    }
+}
+
+
+// Score share of batches of worker, predictions (outputs of model loss) are stored by example number
+static void score_worker(model & m, const loss_function & loss_fn, batch_learn_dataset & dataset, const std::vector<std::pair<uint64_t, uint64_t>> & batches,
+                         float * predictions, worker_stats & stats, bool pretouch) {
+    double start_time = omp_get_wtime();
+
+    if (pretouch) // Page tables aren't inherited for shared file mappings, so each worker faults them in again
+        m.pretouch();
+
+    stats.pretouch_time = omp_get_wtime() - start_time;
+
+    dataset.start_reading(batches);
+
+    parallel_error error;
+
+    std::vector<score_context> contexts;
+
+    for (int i = 0; i < omp_get_max_threads(); ++ i)
+        contexts.push_back(m.create_score_context());
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (uint64_t bi = 0; bi < batches.size(); ++ bi) {
+        std::vector<batch_learn::feature> batch_features;
+        score_context & ctx = contexts[omp_get_thread_num()];
+
+        if (!error.run([&] { dataset.reader->read(bi, batch_features); }))
+            continue;
+
+        auto batch_start_offset = dataset.index.offsets[batches[bi].first];
+
+        for (auto ei = batches[bi].first; ei < batches[bi].second; ++ ei) {
+            auto start = batch_features.data() + (dataset.index.offsets[ei] - batch_start_offset);
+            auto end = batch_features.data() + (dataset.index.offsets[ei+1] - batch_start_offset);
+
+            predictions[ei] = m.score(start, end, compute_norm(start, end), ctx);
+        }
+
+        loss_fn.outputs(predictions + batches[bi].first, predictions + batches[bi].first, batches[bi].second - batches[bi].first);
+    }
+
+    error.rethrow();
+
+    stats.score_time = omp_get_wtime() - start_time - stats.pretouch_time;
+
+    for (auto & b : batches)
+        stats.n_examples += b.second - b.first;
+
+    read_memory_stats(stats);
+}
+
+
+int score_command::run() {
+    using namespace std;
+
+    if (n_workers == 0)
+        throw runtime_error("Worker count should be positive");
+
+    cout << "Loading model " << model_file_name << "... ";
+    cout.flush();
+
+    auto m = load_model(model_file_name);
+    auto loss_fn = create_loss(m->loss_name());
+
+    cout << "done." << endl;
+
+    if (!no_pretouch) {
+        cout << "Pre-touching model pages... ";
+        cout.flush();
+
+        double start_time = omp_get_wtime();
+        m->pretouch();
+
+        cout << "done in " << fixed << setprecision(2) << (omp_get_wtime() - start_time) << " seconds." << endl;
+    }
+
+    batch_learn_dataset dataset(test_file_name, "buffered", io_depth, !no_verify);
+
+    auto batches = dataset.generate_batches(20000);
+
+    // Results are written by workers to memory shared with them
+    uint64_t predictions_size = dataset.index.n_examples * sizeof(float) + n_workers * sizeof(worker_stats);
+    void * results = mmap(nullptr, predictions_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (results == MAP_FAILED)
+        throw runtime_error("Can't allocate predictions memory");
+
+    worker_stats * stats = (worker_stats *) results;
+    float * predictions = (float *) (stats + n_workers);
+
+    memset(stats, 0, n_workers * sizeof(worker_stats));
+
+    cout << "Scoring by " << n_workers << " workers with " << n_threads << " threads each... ";
+    cout.flush(); // Buffered output would be written by children too
+
+    double start_time = omp_get_wtime();
+    vector<pid_t> workers;
+
+    // Fork workers before any OpenMP threads are started in parent, they inherit model mapping
+    for (uint w = 0; w < n_workers; ++ w) {
+        pid_t pid = fork();
+
+        if (pid < 0)
+            throw runtime_error("Can't fork scoring worker");
+
+        if (pid == 0) {
+            int status = 0;
+
+            try {
+                omp_set_num_threads(n_threads);
+
+                vector<pair<uint64_t, uint64_t>> own_batches;
+
+                for (uint64_t bi = w; bi < batches.size(); bi += n_workers)
+                    own_batches.push_back(batches[bi]);
+
+                dataset.reader = create_batch_reader(reader_type, dataset.data_file_name, dataset.index, !no_verify, io_depth);
+
+                score_worker(*m, *loss_fn, dataset, own_batches, predictions, stats[w], !no_pretouch);
+            } catch (exception & e) {
+                cerr << "Worker " << w << " error: " << e.what() << endl;
+                status = 1;
+            }
+
+            _exit(status); // Don't run parent destructors in child
+        }
+
+        workers.push_back(pid);
+    }
+
+    uint n_failed = 0;
+
+    for (pid_t pid : workers) {
+        int status;
+
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            n_failed ++;
+    }
+
+    if (n_failed > 0) {
+        munmap(results, predictions_size);
+        throw runtime_error(to_string(n_failed) + " scoring workers failed");
+    }
+
+    double elapsed = omp_get_wtime() - start_time;
+
+    cout << dataset.index.n_examples << " examples processed in " << fixed << setprecision(2) << elapsed << " seconds." << endl;
+
+    // Report memory of workers: model pages should be in shared set, counted once in Pss
+    uint64_t total_rss = 0, total_pss = 0;
+
+    cout << "  worker  examples  pretouch s  score s   rss MB   pss MB  shared MB  private MB  huge MB" << endl;
+
+    for (uint w = 0; w < n_workers; ++ w) {
+        auto & s = stats[w];
+
+        cout << "  " << setw(6) << w << setw(10) << s.n_examples << setprecision(3) << setw(12) << s.pretouch_time << setw(9) << s.score_time << setprecision(1)
+             << setw(9) << (s.rss / 1048576.0) << setw(9) << (s.pss / 1048576.0) << setw(11) << (s.shared / 1048576.0) << setw(12) << (s.private_ / 1048576.0) << setw(9) << (s.pmd_mapped / 1048576.0) << endl;
+
+        total_rss += s.rss;
+        total_pss += s.pss;
+    }
+
+    cout << "  Sum of worker rss " << (total_rss / 1048576.0) << " MB, proportional " << (total_pss / 1048576.0) << " MB" << endl;
+
+    cout << "Writing predictions... ";
+    cout.flush();
+
+    ofstream out(pred_file_name);
+
+    for (uint64_t i = 0; i < dataset.index.n_examples; ++ i)
+        out << predictions[i] << '\n';
+
+    munmap(results, predictions_size);
+
+    cout << "done." << endl;
+
+    return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "command.hpp"
+
+
+class score_command : public command {
+protected:
+    std::string model_file_name, test_file_name, pred_file_name, reader_type;
+    uint n_workers, n_threads, io_depth;
+    bool no_pretouch, no_verify;
+public:
+    score_command() {
+        using namespace boost::program_options;
+
+        options_desc.add_options()
+            ("workers,w", value<uint>(&n_workers)->default_value(4), "number of forked scoring processes sharing model mapping")
+            ("threads,t", value<uint>(&n_threads)->default_value(1), "number of threads of each worker")
+            ("reader", value<std::string>(&reader_type)->default_value("buffered"), "batch reader: buffered, mmap, uring or uring-direct")
+            ("io-depth", value<uint>(&io_depth)->default_value(16), "number of batch reads in flight for uring readers")
+            ("no-pretouch", bool_switch(&no_pretouch), "don't fault in model pages before scoring")
+            ("no-verify", bool_switch(&no_verify), "don't verify data checksums on read")
+            ("model", value<std::string>(&model_file_name)->required(), "model file saved with --save-model")
+            ("test", value<std::string>(&test_file_name)->required(), "dataset to score")
+            ("pred", value<std::string>(&pred_file_name)->required(), "file to save predictions");
+
+        positional_options_desc.add("model", 1).add("test", 1).add("pred", 1);
+    }
+
+    virtual std::string name() { return "score"; }
+    virtual std::string description() { return "score dataset with saved model by pool of processes"; }
+
+    virtual int run();
+};
@@ -0,0 +1,222 @@
+#include "shuffle.hpp"
+
+#include "../util/dataset.hpp"
+#include "../util/parallel.hpp"
+
+#include <batch_learn.hpp>
+
+#include <algorithm>
+#include <random>
+#include <cstdio>
+
+#include <omp.h>
+
+#include <boost/format.hpp>
+
+// Number of examples scattered by one task
+constexpr uint64_t scatter_batch_size = 20000;
+
+// Per-thread bucket buffer size bounds
+constexpr uint64_t min_flush_size = 64 * 1024;
+constexpr uint64_t max_flush_size = 4 * 1024 * 1024;
+
+
+// Example record in temporary bucket file, example features follow it
+struct shuffle_record {
+    uint64_t example;
+    uint64_t group;
+    float label;
+    uint32_t n_features;
+};
+
+
+struct shuffle_bucket {
+    FILE * file;
+    omp_lock_t lock;
+};
+
+
+// Closes and removes bucket files which are still open when leaving scope, so they aren't left after error
+struct shuffle_bucket_cleanup {
+    std::vector<shuffle_bucket> & buckets;
+    const std::vector<std::string> & file_names;
+
+    ~shuffle_bucket_cleanup() {
+        for (uint b = 0; b < buckets.size(); ++ b) {
+            if (buckets[b].file == nullptr)
+                continue;
+
+            fclose(buckets[b].file);
+            remove(file_names[b].c_str());
+            omp_destroy_lock(&buckets[b].lock);
+        }
+    }
+};
+
+
+static void flush_bucket_buffer(shuffle_bucket & bucket, std::vector<char> & buffer) {
+    if (buffer.empty())
+        return;
+
+    omp_set_lock(&bucket.lock);
+    size_t written = fwrite(buffer.data(), 1, buffer.size(), bucket.file);
+    omp_unset_lock(&bucket.lock);
+
+    if (written != buffer.size())
+        throw std::runtime_error("Error writing bucket file");
+
+    buffer.clear();
+}
+
+
+int shuffle_command::run() {
+    using namespace std;
+    using namespace batch_learn;
+    using boost::format;
+
+    omp_set_num_threads(n_threads);
+
+    batch_learn_dataset input(input_file_name);
+    const file_index & index = input.index;
+
+    if (temp_file_prefix.empty())
+        temp_file_prefix = output_file_name;
+
+    uint64_t memory_limit = uint64_t(memory_mb) * 1024 * 1024;
+    uint64_t total_size = index.offsets.back() * sizeof(feature) + index.n_examples * sizeof(shuffle_record);
+
+    if (n_buckets == 0)
+        n_buckets = max<uint64_t>(1, (total_size + memory_limit - 1) / memory_limit);
+
+    uint64_t flush_size = std::min(std::max(memory_limit / (uint64_t(n_threads) * n_buckets), min_flush_size), max_flush_size);
+
+    cout << "Shuffling " << input_file_name << " to " << output_file_name << " using " << n_buckets << " buckets... ";
+    cout.flush();
+
+    time_t start_time = time(nullptr);
+
+    vector<shuffle_bucket> buckets(n_buckets, shuffle_bucket { nullptr });
+    vector<string> bucket_file_names(n_buckets);
+    shuffle_bucket_cleanup cleanup { buckets, bucket_file_names };
+
+    for (uint b = 0; b < n_buckets; ++ b) {
+        bucket_file_names[b] = str(format("%s.shuffle.%d") % temp_file_prefix % b);
+        buckets[b].file = fopen(bucket_file_names[b].c_str(), "w+b");
+
+        if (buckets[b].file == nullptr)
+            throw runtime_error(string("Can't open bucket file ") + bucket_file_names[b]);
+
+        omp_init_lock(&buckets[b].lock);
+    }
+
+    auto batches = input.generate_batches(scatter_batch_size);
+
+    input.start_reading(batches);
+
+    parallel_error error;
+
+    // Scatter examples to buckets, each thread accumulates own buffers and appends them to bucket files under lock
+    #pragma omp parallel
+    {
+        vector<vector<char>> buffers(n_buckets);
+        vector<feature> batch_features;
+
+        #pragma omp for schedule(dynamic, 1)
+        for (uint64_t bi = 0; bi < batches.size(); ++ bi) {
+            auto batch_start_index = batches[bi].first;
+            auto batch_end_index = batches[bi].second;
+
+            auto batch_start_offset = index.offsets[batch_start_index];
+
+            if (error.occurred() || !error.run([&] { input.reader->read(bi, batch_features); }))
+                continue;
+
+            // Bucket assignment depends only on seed and batch, not on thread scheduling
+            seed_seq batch_seed { uint64_t(seed), bi };
+            default_random_engine batch_rnd(batch_seed);
+            uniform_int_distribution<uint> bucket_distr(0, n_buckets - 1);
+
+            for (auto ei = batch_start_index; ei < batch_end_index; ++ ei) {
+                auto start_offset = index.offsets[ei] - batch_start_offset;
+                auto end_offset = index.offsets[ei+1] - batch_start_offset;
+
+                shuffle_record record;
+                record.example = ei;
+                record.group = index.groups[ei];
+                record.label = index.labels[ei];
+                record.n_features = end_offset - start_offset;
+
+                uint b = bucket_distr(batch_rnd);
+                auto & buffer = buffers[b];
+
+                buffer.insert(buffer.end(), (const char *) &record, (const char *) (&record + 1));
+                buffer.insert(buffer.end(), (const char *) (batch_features.data() + start_offset), (const char *) (batch_features.data() + end_offset));
+
+                if (buffer.size() >= flush_size && !error.run([&] { flush_bucket_buffer(buckets[b], buffer); }))
+                    break;
+            }
+        }
+
+        for (uint b = 0; b < n_buckets && !error.occurred(); ++ b)
+            error.run([&] { flush_bucket_buffer(buckets[b], buffers[b]); });
+    }
+
+    error.rethrow();
+
+    cout << "scattered in " << (time(nullptr) - start_time) << " seconds... ";
+    cout.flush();
+
+    // Gather buckets one by one, shuffling each in memory
+    stream_data_writer output_data_writer(output_file_name + ".data", false, index.n_index_bits, index.field_encodings, index.field_scales); // Keep input value packing
+    stream_index_writer output_index_writer(output_file_name + ".index");
+    default_random_engine rnd(seed);
+
+    vector<char> buffer;
+    vector<const shuffle_record *> records;
+
+    for (uint b = 0; b < n_buckets; ++ b) {
+        FILE * file = buckets[b].file;
+
+        if (fseek(file, 0, SEEK_END) != 0)
+            throw runtime_error("Can't seek bucket file");
+
+        buffer.resize(ftell(file));
+        rewind(file);
+
+        if (fread(buffer.data(), 1, buffer.size(), file) != buffer.size())
+            throw runtime_error("Error reading bucket file");
+
+        fclose(file);
+        remove(bucket_file_names[b].c_str());
+        omp_destroy_lock(&buckets[b].lock);
+
+        buckets[b].file = nullptr;
+
+        records.clear();
+        for (const char * p = buffer.data(); p < buffer.data() + buffer.size();) {
+            auto record = (const shuffle_record *) p;
+
+            records.push_back(record);
+            p += sizeof(shuffle_record) + record->n_features * sizeof(feature);
+        }
+
+        // Restore source order before shuffling, so result doesn't depend on scatter thread interleaving
+        sort(records.begin(), records.end(), [](const shuffle_record * a, const shuffle_record * b) { return a->example < b->example; });
+        shuffle(records.begin(), records.end(), rnd);
+
+        for (auto record : records) {
+            output_data_writer.write((const feature *) (record + 1), record->n_features);
+            output_index_writer.write(record->label, record->group, output_data_writer);
+        }
+    }
+
+    if (output_index_writer.size() != index.n_examples)
+        throw runtime_error("Example count mismatch after shuffle");
+
+    output_data_writer.close();
+    output_index_writer.finish(output_data_writer, index.n_fields, index.n_indices, index.n_index_bits);
+
+    cout << "Done in " << (time(nullptr) - start_time) << " seconds." << endl;
+
+    return 0;
+}
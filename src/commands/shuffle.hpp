@@ -0,0 +1,30 @@
+#pragma once
+
+#include "command.hpp"
+
+
+class shuffle_command : public command {
+protected:
+    std::string input_file_name, output_file_name, temp_file_prefix;
+    uint n_buckets, n_threads, memory_mb, seed;
+public:
+    shuffle_command(): seed(0) {
+        using namespace boost::program_options;
+
+        options_desc.add_options()
+            ("buckets", value<uint>(&n_buckets)->default_value(0), "number of temporary buckets (0 - choose by memory limit)")
+            ("memory,m", value<uint>(&memory_mb)->default_value(1024), "memory limit for one bucket in MB")
+            ("temp-prefix", value<std::string>(&temp_file_prefix), "prefix for temporary bucket files (output file name by default)")
+            ("seed,s", value<uint>(&seed), "random seed")
+            ("threads,t", value<uint>(&n_threads)->default_value(4), "number of threads")
+            ("input-file,I", value<std::string>(&input_file_name)->required(), "input dataset name")
+            ("output-file,O", value<std::string>(&output_file_name)->required(), "output dataset name");
+
+        positional_options_desc.add("input-file", 1).add("output-file", 1);
+    }
+
+    virtual std::string name() { return "shuffle"; }
+    virtual std::string description() { return "shuffle examples of batch-learn dataset"; }
+
+    virtual int run();
+};
@@ -0,0 +1,151 @@
+#include "verify.hpp"
+
+#include "../util/dataset.hpp"
+#include "../util/mmap.hpp"
+
+#include <batch_learn.hpp>
+
+#include <iomanip>
+#include <cmath>
+
+#include <omp.h>
+
+// Maximum number of reported errors
+constexpr uint max_reported_errors = 10;
+
+// Number of examples checked by one task
+constexpr uint64_t verify_batch_size = 100000;
+
+
+int verify_command::run() {
+    using namespace std;
+    using namespace batch_learn;
+
+    omp_set_num_threads(n_threads);
+
+    batch_learn_dataset dataset(input_file_name);
+    const file_index & index = dataset.index;
+
+    double start_time = omp_get_wtime();
+
+    vector<string> errors;
+    uint64_t n_errors = 0;
+
+    auto report = [&](const string & error) {
+        #pragma omp critical
+        {
+            if (errors.size() < max_reported_errors)
+                errors.push_back(error);
+
+            n_errors ++;
+        }
+    };
+
+    cout << "Checking index... ";
+    cout.flush();
+
+    if (index.offsets[0] != 0 || index.data_offset(0) != 0)
+        report("Index offsets don't start from zero");
+
+    for (uint64_t ei = 0; ei < index.n_examples; ++ ei) {
+        if (index.offsets[ei+1] < index.offsets[ei] || index.data_offset(ei+1) < index.data_offset(ei))
+            report("Index offsets are not monotonic at example " + to_string(ei));
+
+        if (!std::isfinite(index.labels[ei]))
+            report("Label of example " + to_string(ei) + " is not finite");
+    }
+
+    bool index_ok = (n_errors == 0);
+
+    mapped_file data(dataset.data_file_name, MADV_SEQUENTIAL);
+
+    uint64_t data_size = index.data_size();
+
+    if (data.size() != data_size) {
+        report("Data file size " + to_string(data.size()) + " doesn't match index, expected " + to_string(data_size));
+        data_size = std::min<uint64_t>(data_size, data.size());
+    }
+
+    cout << "Done." << endl;
+
+    cout << "Checking data";
+    if (index.checksum_block_size == 0)
+        cout << " (no checksums, format version 1)";
+    cout << "... ";
+    cout.flush();
+
+    // Check data checksums by blocks in parallel
+    if (index.checksum_block_size > 0) {
+        uint64_t block_size = index.checksum_block_size;
+        uint64_t n_blocks = (data_size + block_size - 1) / block_size;
+
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (uint64_t block = 0; block < n_blocks; ++ block) {
+            uint64_t from = block * block_size;
+            uint64_t to = std::min(from + block_size, data_size);
+
+            if (block >= index.checksums.size() || crc32c(0, data.data<char>() + from, to - from) != index.checksums[block])
+                report("Checksum mismatch in data block " + to_string(block) + " (bytes " + to_string(from) + "-" + to_string(to) + ")");
+        }
+    }
+
+    // Check features of examples present in data, it's possible only with consistent index
+    uint64_t n_examples = 0;
+    while (index_ok && n_examples < index.n_examples && index.data_offset(n_examples + 1) <= data_size)
+        n_examples ++;
+
+    auto batches = dataset.generate_batches(verify_batch_size);
+    uint32_t index_mask = (1ul << index.n_index_bits) - 1;
+
+    #pragma omp parallel
+    {
+        vector<feature> decoded;
+
+        #pragma omp for schedule(dynamic, 1)
+        for (uint64_t bi = 0; bi < batches.size(); ++ bi) {
+            uint64_t from = batches[bi].first, to = std::min(batches[bi].second, n_examples);
+
+            if (from >= to)
+                continue;
+
+            const feature * features = data.data<feature>() + index.offsets[from];
+
+            if (index.packed()) {
+                decoded.resize(index.offsets[to] - index.offsets[from]);
+
+                try {
+                    decode_features(index, from, to, data.data<char>() + index.data_offsets[from], decoded.data());
+                } catch (exception & e) {
+                    report(e.what());
+                    continue;
+                }
+
+                features = decoded.data();
+            }
+
+            for (uint64_t i = 0; i < index.offsets[to] - index.offsets[from]; ++ i) {
+                uint32_t field = features[i].index >> index.n_index_bits;
+                uint32_t idx = features[i].index & index_mask;
+
+                if (field >= index.n_fields || idx >= index.n_indices)
+                    report("Feature " + to_string(index.offsets[from] + i) + " is out of bounds: field " + to_string(field) + ", index " + to_string(idx));
+                else if (!std::isfinite(features[i].value))
+                    report("Feature " + to_string(index.offsets[from] + i) + " value is not finite");
+            }
+        }
+    }
+
+    double elapsed = omp_get_wtime() - start_time;
+
+    cout << "Done." << endl;
+
+    for (auto & error : errors)
+        cout << "  " << error << endl;
+
+    if (n_errors > errors.size())
+        cout << "  ... and " << (n_errors - errors.size()) << " more" << endl;
+
+    cout << (n_errors == 0 ? "Dataset is OK" : to_string(n_errors) + " errors found") << ", checked " << (data.size() / 1024 / 1024) << " MB in " << fixed << setprecision(3) << elapsed << " seconds (" << setprecision(2) << (data.size() / elapsed / 1e9) << " GB/s)" << endl;
+
+    return n_errors == 0 ? 0 : 1;
+}
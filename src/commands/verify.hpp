@@ -0,0 +1,25 @@
+#pragma once
+
+#include "command.hpp"
+
+
+class verify_command : public command {
+protected:
+    std::string input_file_name;
+    uint n_threads;
+public:
+    verify_command() {
+        using namespace boost::program_options;
+
+        options_desc.add_options()
+            ("threads,t", value<uint>(&n_threads)->default_value(4), "number of threads")
+            ("input-file,I", value<std::string>(&input_file_name)->required(), "input dataset name");
+
+        positional_options_desc.add("input-file", 1);
+    }
+
+    virtual std::string name() { return "verify"; }
+    virtual std::string description() { return "check dataset checksums and consistency"; }
+
+    virtual int run();
+};
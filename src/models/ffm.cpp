@@ -1,6 +1,9 @@
 #include "ffm.hpp"
+#include "ffm_int8.hpp"
 
 #include "../util/model.hpp"
+#include "../util/topology.hpp"
+#include "../util/optimizer.hpp"
 
 #include <iostream>
 #include <iomanip>
@@ -8,129 +11,780 @@
 #include <algorithm>
 
 #include <cstring>
+#include <thread>
+
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 class state {
 public:
-    std::vector<uint64_t> dropout_mask;
-    float dropout_mult;
+    std::vector<uint64_t> pairs; // Kept interactions of sampled example as feature numbers a << 32 | b, b < a
+    bool all_pairs = true;
+    float dropout_mult = 1;
+    uint replica = 0; // Weights replica chosen in predict and updated after it
+private:
+    uint64_t rnd[2] = { 0, 0 }; // Xorshift128+ state, seeded from RDRAND on first use
 public:
-    void init_train_dropout_mask(int len) {
-        dropout_mult = 2.0;
-        dropout_mask.resize((len + 63) / 64);
+    // Keep each of n * (n - 1) / 2 interactions of n features with given probability: gaps between kept
+    // interactions are drawn from geometric distribution, so dropped ones aren't visited at all
+    void sample_pairs(uint n_features, double keep) {
+        all_pairs = false;
+        dropout_mult = 1 / keep;
+        pairs.clear();
+
+        float inv_log_drop = 1 / std::log1p(-keep);
+
+        uint64_t a = 1, b = skip(inv_log_drop);
+
+        while (a < n_features) {
+            if (b >= a) { // Carry over to next rows of interaction triangle
+                b -= a;
+                ++ a;
+                continue;
+            }
 
-        for (uint64_t * p = dropout_mask.data(); p != dropout_mask.data() + dropout_mask.size(); ++ p)
-            if (_rdrand64_step((unsigned long long *)p) != 1)
-                throw std::runtime_error("Error generating random number!");
+            pairs.push_back(a << 32 | b);
+
+            b += 1 + skip(inv_log_drop);
+        }
+    }
+
+    void keep_all_pairs() {
+        all_pairs = true;
+        dropout_mult = 1;
+    }
+private:
+    // Number of dropped interactions before next kept one
+    uint64_t skip(float inv_log_drop) {
+        float gap = std::floor(std::log(uniform()) * inv_log_drop);
 
+        return gap < 1e18f ? uint64_t(gap) : uint64_t(1e18);
     }
 
-    void init_test_dropout_mask(int len) {
-        dropout_mult = 1.0;
-        dropout_mask.resize((len + 63) / 64);
+    // Uniform random number in (0, 1]
+    float uniform() {
+        if (rnd[0] == 0 && rnd[1] == 0)
+            for (uint64_t * p = rnd; p != rnd + 2; ++ p)
+                if (_rdrand64_step((unsigned long long *)p) != 1)
+                    throw std::runtime_error("Error generating random number!");
 
-        memset(dropout_mask.data(), 0xFF, dropout_mask.size() * sizeof(uint64_t));
+        uint64_t x = rnd[0], y = rnd[1];
+
+        rnd[0] = y;
+        x ^= x << 23;
+        rnd[1] = x ^ y ^ (x >> 17) ^ (y >> 26);
+
+        return (((rnd[1] + y) >> 40) + 1) * (1.0f / 16777216.0f);
     }
 };
 
+
 static thread_local state local_state;
 
 
+// Initialize weight vectors of n rows given stride apart, optimizer state is initialized separately
 template <typename D>
-static void init_ffm_weights(float * weights, uint64_t n, uint32_t n_dim, uint32_t n_dim_aligned, D gen, std::default_random_engine & rnd) {
-    float * w = weights;
-
+static void init_ffm_weights(float * weights, uint64_t n, uint32_t n_dim, uint32_t n_dim_aligned, uint32_t stride, D gen, std::default_random_engine & rnd) {
     for(uint64_t i = 0; i < n; i++) {
-        for (uint d = 0; d < n_dim; d++, w++)
-            *w = gen(rnd);
+        float * w = weights + i * stride;
 
-        for (uint d = n_dim; d < n_dim_aligned; d++, w++)
-            *w = 0;
+        for (uint d = 0; d < n_dim; d++)
+            w[d] = gen(rnd);
 
-        for (uint d = n_dim_aligned; d < 2*n_dim_aligned; d++, w++)
-            *w = 1;
+        for (uint d = n_dim; d < n_dim_aligned; d++)
+            w[d] = 0;
     }
 }
 
 
-static void init_lin_weights(float * weights, uint64_t n) {
-    float * w = weights;
+// Update of interaction weights of pair, new values are stored only for requested sides
+template <typename O>
+static inline void update_pair(const O & opt, float * wa, float * wb, uint n_dim, uint n_dim_aligned, __m256 xmm_kappa_val, __m256 xmm_lambda, bool store_a, bool store_b) {
+    for(uint d = 0; d < n_dim; d += 8) {
+        // Load weights
+        __m256 xmm_wa = _mm256_load_ps(wa + d);
+        __m256 xmm_wb = _mm256_load_ps(wb + d);
 
-    for(uint64_t i = 0; i < n; i++) {
-        *w++ = 0;
-        *w++ = 1;
+        // Compute gradient values
+        __m256 xmm_ga = _mm256_add_ps(_mm256_mul_ps(xmm_lambda, xmm_wa), _mm256_mul_ps(xmm_kappa_val, xmm_wb));
+        __m256 xmm_gb = _mm256_add_ps(_mm256_mul_ps(xmm_lambda, xmm_wb), _mm256_mul_ps(xmm_kappa_val, xmm_wa));
+
+        // Update weights with their state
+        if (store_a)
+            opt.update(wa + d, xmm_wa, xmm_ga, n_dim_aligned);
+
+        if (store_b)
+            opt.update(wb + d, xmm_wb, xmm_gb, n_dim_aligned);
+    }
+}
+
+
+ffm_model::ffm_model(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, int seed, float eta, float lambda, const std::string & numa_mode, uint sync_interval, uint n_shards,
+                     const std::string & shared_file, bool create_shared, float dropout, uint max_interactions, const std::string & optimizer, float l1, const std::string & loss):
+    sync_interval(std::max<uint>(sync_interval, 1)), sync_counter(0), n_shards(n_shards), n_producers(0), stopping(false),
+    shared_file_name(shared_file), shared_data(nullptr), shared_size(0), dropout(dropout), max_interactions(max_interactions), loss(loss), update_step(0) {
+    if (dropout < 0 || dropout >= 1)
+        throw std::runtime_error("Dropout rate should be in [0, 1)");
+
+    if (n_shards > 64) // Shards of example are kept in 64-bit mask
+        throw std::runtime_error("Number of update shards should be at most 64");
+
+    init_dimensions(n_fields, n_indices, n_index_bits, n_dim, optimizer);
+
+    this->eta = eta;
+    this->lambda = lambda;
+    this->l1 = l1;
+
+    std::default_random_engine rnd(seed);
+
+    bias = bias_storage;
+
+    uint64_t n_ffm_weights = uint64_t(n_indices) * index_stride;
+    uint64_t total_weights = n_weights(n_fields, n_indices, n_dim, n_slots - 1);
+
+    if (!shared_file.empty()) {
+        if (numa_mode != "none")
+            throw std::runtime_error("Numa weights placement can't be used with shared weights file");
+
+        if (!create_shared) {
+            attach_shared_file();
+            start_shards();
+            return;
+        }
+    }
+
+    // Choose weights placement over numa nodes
+    std::string mode = numa_mode;
+    std::vector<int> nodes;
+
+    if (mode != "none") {
+        cpu_topology topology;
+
+        nodes = topology.node_list();
+
+        if (mode == "auto") {
+            uint64_t min_node_memory = UINT64_MAX;
+
+            for (int node : nodes)
+                min_node_memory = std::min(min_node_memory, node_memory(node));
+
+            // Replicate model if replica takes less than quarter of node memory
+            if (nodes.size() < 2)
+                mode = "none";
+            else if (total_weights * sizeof(float) * 4 <= min_node_memory)
+                mode = "replicate";
+            else
+                mode = "partition";
+        } else if (mode != "replicate" && mode != "partition") {
+            throw std::runtime_error("Unknown numa mode " + numa_mode + ", supported modes: none, replicate, partition, auto");
+        }
+
+        if (mode == "replicate") {
+            cpu_replicas.resize(CPU_SETSIZE, 0);
+
+            for (auto & c : topology.cpus)
+                cpu_replicas[c.cpu] = std::find(nodes.begin(), nodes.end(), c.node) - nodes.begin();
+        }
+
+        if (mode == "partition")
+            nodes.resize(std::min<size_t>(nodes.size(), 64));
+    }
+
+    uint n_replicas = mode == "replicate" ? nodes.size() : 1;
+    bool bound = true;
+
+    if (this->n_shards > 0 && n_replicas > 1) // Check before weights are allocated, as they aren't freed if constructor throws
+        throw std::runtime_error("Sharded updates can't be used with replicated weights");
+
+    try {
+        model_log() << "Allocating " << (total_weights * sizeof(float) / 1024 / 1024) << " MB memory for model weights";
+
+        if (n_replicas > 1)
+            model_log() << " on each of " << n_replicas << " numa nodes";
+
+        model_log() << "... ";
+        model_log().flush();
+
+        if (!shared_file.empty())
+            create_shared_file();
+
+        for (uint r = ffm_replicas.size(); r < n_replicas; ++ r) {
+            ffm_replicas.push_back(malloc_aligned<float>(n_ffm_weights));
+            lin_replicas.push_back(malloc_aligned<float>(uint64_t(n_indices) * n_slots));
+
+            // Bind pages before they are touched by initialization
+            if (mode == "replicate") {
+                bound &= bind_memory(ffm_replicas[r], n_ffm_weights * sizeof(float), { nodes[r] });
+                bound &= bind_memory(lin_replicas[r], uint64_t(n_indices) * n_slots * sizeof(float), { nodes[r] });
+            }
+        }
+
+        if (mode == "partition") {
+            for (uint p = 0; p < nodes.size(); ++ p) {
+                uint64_t from = uint64_t(n_indices) * p / nodes.size(), to = uint64_t(n_indices) * (p + 1) / nodes.size();
+
+                bound &= bind_memory(ffm_replicas[0] + from * index_stride, (to - from) * index_stride * sizeof(float), { nodes[p] });
+            }
+
+            bound &= bind_memory(lin_replicas[0], uint64_t(n_indices) * n_slots * sizeof(float), nodes, true);
+
+            partition_nodes = nodes;
+        }
+
+        model_log() << "done." << std::endl;
+    } catch (std::bad_alloc & e) {
+        throw std::runtime_error("Can't allocate weights memory");
+    }
+
+    if (!bound)
+        model_log() << "Warning: can't set numa policy of weights memory, pages are placed on first touch" << std::endl;
+
+    if (mode == "replicate")
+        model_log() << "Weights are replicated on " << n_replicas << " numa nodes and averaged every " << this->sync_interval << " batches" << std::endl;
+    else if (mode == "partition")
+        model_log() << "Weights are partitioned by index over " << nodes.size() << " numa nodes, examples are trained on node owning most of their weights" << std::endl;
+
+    model_log() << "Initializing weights... ";
+    model_log().flush();
+
+    init_ffm_weights(ffm_replicas[0], size_t(n_indices) * n_fields, n_dim, n_dim_aligned, field_stride, std::uniform_real_distribution<float>(0.0, 1.0/sqrt(n_dim)), rnd);
+
+    for (uint64_t i = 0; i < n_indices; ++ i)
+        lin_replicas[0][i * n_slots] = 0;
+
+    bias[0] = 0;
+
+    (this->*init_state_impl)();
+
+    for (uint r = 1; r < n_replicas; ++ r) {
+        memcpy(ffm_replicas[r], ffm_replicas[0], n_ffm_weights * sizeof(float));
+        memcpy(lin_replicas[r], lin_replicas[0], uint64_t(n_indices) * n_slots * sizeof(float));
+    }
+
+    model_log() << "done." << std::endl;
+
+    start_shards();
+}
+
+
+ffm_model::ffm_model(const std::string & file_name):
+    sync_interval(1), sync_counter(0), n_shards(0), n_producers(0), stopping(false),
+    shared_file_name(file_name), shared_data(nullptr), shared_size(0), dropout(0), max_interactions(0), loss("logistic"), update_step(0), eta(0), lambda(0), l1(0) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        throw std::runtime_error("Can't open model file " + file_name);
+
+    ffm_file_header header;
+    struct stat st;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, "BLFFM", 5) != 0) {
+        close(fd);
+        throw std::runtime_error(file_name + " is not ffm model file");
+    }
+
+    std::string optimizer(header.optimizer, strnlen(header.optimizer, sizeof(header.optimizer)));
+
+    loss.assign(header.loss, strnlen(header.loss, sizeof(header.loss)));
+
+    if (header.version != ffm_file_version || (optimizer != "adagrad" && optimizer != "ftrl" && optimizer != "adam") || (loss != "logistic" && loss != "squared" && loss != "hinge")) {
+        close(fd);
+        throw std::runtime_error("Model file " + file_name + " has unsupported version");
+    }
+
+    ffm_file_header expected = file_header(header.n_fields, header.n_indices, header.n_index_bits, header.n_dim, optimizer, loss);
+
+    if (header.ffm_offset != expected.ffm_offset || header.lin_offset != expected.lin_offset || fstat(fd, &st) != 0 || uint64_t(st.st_size) != expected.file_size) {
+        close(fd);
+        throw std::runtime_error("Model file " + file_name + " is truncated");
     }
+
+    init_dimensions(header.n_fields, header.n_indices, header.n_index_bits, header.n_dim, optimizer);
+
+    map_shared_file(fd, expected.file_size, false);
+    use_shared_weights();
 }
 
 
-ffm_model::ffm_model(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, int seed, float eta, float lambda) {
+void ffm_model::init_dimensions(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, const std::string & optimizer) {
     this->n_fields = n_fields;
     this->n_indices = n_indices;
     this->n_index_bits = n_index_bits;
     this->n_dim = n_dim;
-    this->eta = eta;
-    this->lambda = lambda;
+    this->optimizer = optimizer;
 
     n_dim_aligned = ((n_dim - 1) / align_floats + 1) * align_floats;
+    n_slots = 1 + optimizer_state_size(optimizer);
 
-    index_stride = n_fields * n_dim_aligned * 2;
-    field_stride = n_dim_aligned * 2;
+    if (optimizer == "adagrad")
+        use_optimizer<adagrad_optimizer>();
+    else if (optimizer == "ftrl")
+        use_optimizer<ftrl_optimizer>();
+    else
+        use_optimizer<adam_optimizer>();
+
+    index_stride = n_fields * n_dim_aligned * n_slots;
+    field_stride = n_dim_aligned * n_slots;
     index_mask = (1ul << n_index_bits) - 1;
+}
 
-    std::default_random_engine rnd(seed);
 
-    bias_w = 0;
-    bias_wg = 1;
+template <typename O>
+void ffm_model::use_optimizer() {
+    update_impl = &ffm_model::update_with<O>;
+    apply_update_impl = &ffm_model::apply_update<O>;
+    init_state_impl = &ffm_model::init_state<O>;
+}
 
-    try {
-        uint64_t total_weights = size_t(n_indices) * n_fields * n_dim_aligned * 2 + n_indices * 2;
 
-        std::cout << "Allocating " << (total_weights * sizeof(float) / 1024 / 1024) << " MB memory for model weights... ";
-        std::cout.flush();
+// Initialize optimizer state of all initialized weights in first replica and of bias
+template <typename O>
+void ffm_model::init_state() {
+    O opt(eta, l1, 0);
 
-        ffm_weights = malloc_aligned<float>(uint64_t(n_indices) * n_fields * n_dim_aligned * 2);
-        lin_weights = malloc_aligned<float>(n_indices * 2);
+    float * ffm_weights = ffm_replicas[0];
+    float * lin_weights = lin_replicas[0];
 
-        std::cout << "done." << std::endl;
-    } catch (std::bad_alloc & e) {
-        throw std::runtime_error("Can't allocate weights memory");
+    for (uint64_t i = 0; i < uint64_t(n_indices) * n_fields; ++ i)
+        for (uint d = 0; d < n_dim_aligned; ++ d)
+            opt.init(ffm_weights + i * field_stride + d, n_dim_aligned);
+
+    for (uint64_t i = 0; i < n_indices; ++ i)
+        opt.init(lin_weights + i * n_slots, 1);
+
+    opt.init(bias, 1);
+}
+
+
+// Start update threads owning weight rows
+void ffm_model::start_shards() {
+    if (n_shards == 0)
+        return;
+
+    n_producers = omp_get_max_threads();
+
+    for (uint i = 0; i < n_producers * n_shards; ++ i)
+        shard_queues.emplace_back(new spsc_queue<uint64_t>(shard_queue_size));
+
+    for (uint shard = 0; shard < n_shards; ++ shard)
+        shard_parkings.emplace_back(new shard_parking());
+
+    for (uint shard = 0; shard < n_shards; ++ shard)
+        shard_threads.emplace_back(&ffm_model::run_shard, this, shard);
+
+    model_log() << "Updates are applied by " << n_shards << " threads owning weight rows by index hash" << std::endl;
+}
+
+
+ffm_file_header ffm_model::file_header(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, const std::string & optimizer, const std::string & loss) {
+    ffm_file_header header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, "BLFFM\0\0\0", sizeof(header.magic));
+    memcpy(header.optimizer, optimizer.data(), std::min(optimizer.size(), sizeof(header.optimizer)));
+    memcpy(header.loss, loss.data(), std::min(loss.size(), sizeof(header.loss)));
+
+    uint32_t n_slots = 1 + optimizer_state_size(optimizer);
+
+    header.version = ffm_file_version;
+    header.n_fields = n_fields;
+    header.n_indices = n_indices;
+    header.n_index_bits = n_index_bits;
+    header.n_dim = n_dim;
+    header.n_dim_aligned = aligned_float_array_size(n_dim);
+
+    auto align = [](uint64_t offset) { return (offset + ffm_file_align - 1) / ffm_file_align * ffm_file_align; };
+
+    header.ffm_offset = align(sizeof(header));
+    header.lin_offset = align(header.ffm_offset + uint64_t(n_indices) * n_fields * header.n_dim_aligned * n_slots * sizeof(float));
+    header.file_size = header.lin_offset + uint64_t(n_indices) * n_slots * sizeof(float);
+
+    return header;
+}
+
+
+// Create weights file of model size and map it shared, weights are initialized by caller
+void ffm_model::create_shared_file() {
+    ffm_file_header header = file_header(n_fields, n_indices, n_index_bits, n_dim, optimizer, loss);
+
+    int fd = open(shared_file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+        throw std::runtime_error("Can't create shared weights file " + shared_file_name);
+
+    if (ftruncate(fd, header.file_size) != 0) {
+        close(fd);
+        throw std::runtime_error("Can't resize shared weights file " + shared_file_name);
+    }
+
+    map_shared_file(fd, header.file_size, true);
+    memcpy(shared_data, &header, sizeof(header));
+    use_shared_weights();
+}
+
+
+// Map weights file created and initialized by other process
+void ffm_model::attach_shared_file() {
+    ffm_file_header expected = file_header(n_fields, n_indices, n_index_bits, n_dim, optimizer, loss);
+
+    int fd = open(shared_file_name.c_str(), O_RDWR);
+
+    if (fd < 0)
+        throw std::runtime_error("Can't open shared weights file " + shared_file_name);
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || uint64_t(st.st_size) != expected.file_size) {
+        close(fd);
+        throw std::runtime_error("Shared weights file " + shared_file_name + " doesn't match model size");
+    }
+
+    map_shared_file(fd, expected.file_size, true);
+
+    ffm_file_header header;
+    memcpy(&header, shared_data, sizeof(header));
+
+    if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.n_fields != n_fields || header.n_indices != n_indices || header.n_dim != n_dim)
+        throw std::runtime_error("Shared weights file " + shared_file_name + " has different model dimensions");
+
+    if (memcmp(header.optimizer, expected.optimizer, sizeof(header.optimizer)) != 0)
+        throw std::runtime_error("Shared weights file " + shared_file_name + " is trained by different optimizer");
+
+    if (memcmp(header.loss, expected.loss, sizeof(header.loss)) != 0)
+        throw std::runtime_error("Shared weights file " + shared_file_name + " is trained with different loss");
+
+    use_shared_weights();
+
+    model_log() << "Attached " << (shared_size / 1024 / 1024) << " MB shared weights file " << shared_file_name << std::endl;
+}
+
+
+// Map file at huge page aligned address, so aligned weight blocks may be backed by huge pages where file system allows it
+void ffm_model::map_shared_file(int fd, uint64_t size, bool writable) {
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t mapped_size = (size + page_size - 1) / page_size * page_size;
+
+    char * reserved = (char *) mmap(nullptr, mapped_size + ffm_file_align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    void * ptr = MAP_FAILED;
+
+    if (reserved != MAP_FAILED) {
+        char * aligned = (char *) ((uintptr_t(reserved) + ffm_file_align - 1) / ffm_file_align * ffm_file_align);
+
+        ptr = mmap(aligned, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED | MAP_FIXED, fd, 0);
+
+        // Release rest of reservation around mapping
+        if (aligned > reserved)
+            munmap(reserved, aligned - reserved);
+
+        if (reserved + mapped_size + ffm_file_align > aligned + mapped_size)
+            munmap(aligned + mapped_size, reserved + mapped_size + ffm_file_align - (aligned + mapped_size));
     }
 
-    std::cout << "Initializing weights... ";
-    std::cout.flush();
+    close(fd);
 
-    init_ffm_weights(ffm_weights, size_t(n_indices) * n_fields, n_dim, n_dim_aligned, std::uniform_real_distribution<float>(0.0, 1.0/sqrt(n_dim)), rnd);
-    init_lin_weights(lin_weights, n_indices);
+    if (ptr == MAP_FAILED)
+        throw std::runtime_error("Can't map weights file " + shared_file_name);
 
-    std::cout << "done." << std::endl;
+    madvise(ptr, size, MADV_HUGEPAGE);
+
+    shared_data = (char *) ptr;
+    shared_size = size;
+}
+
+
+std::unique_ptr<model> ffm_model::quantize(const std::string & kernels) const {
+    return std::unique_ptr<model>(new ffm_int8_model(*this, kernels));
+}
+
+
+void ffm_model::pretouch() {
+    if (shared_data == nullptr)
+        return;
+
+#ifdef MADV_POPULATE_READ
+    if (madvise(shared_data, shared_size, MADV_POPULATE_READ) == 0)
+        return;
+#endif
+
+    // Older kernel, read one value of each page
+    madvise(shared_data, shared_size, MADV_WILLNEED);
+
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    volatile char sink = 0;
+
+    for (uint64_t offset = 0; offset < shared_size; offset += page_size)
+        sink += shared_data[offset];
+}
+
+
+// Point weights and bias to mapped file
+void ffm_model::use_shared_weights() {
+    auto header = (ffm_file_header *) shared_data;
+
+    ffm_replicas.push_back((float *) (shared_data + header->ffm_offset));
+    lin_replicas.push_back((float *) (shared_data + header->lin_offset));
+
+    bias = header->bias;
+}
+
+
+void ffm_model::save(const std::string & file_name) {
+    sync(true);
+
+    model_log() << "Saving model to " << file_name << "... ";
+    model_log().flush();
+
+    if (shared_data != nullptr && file_name == shared_file_name) { // Model is already there
+        if (msync(shared_data, shared_size, MS_SYNC) != 0)
+            throw std::runtime_error("Can't sync shared weights file " + shared_file_name);
+
+        model_log() << "done." << std::endl;
+        return;
+    }
+
+    ffm_file_header header = file_header(n_fields, n_indices, n_index_bits, n_dim, optimizer, loss);
+
+    memcpy(header.bias, bias, n_slots * sizeof(float));
+
+    FILE * file = fopen(file_name.c_str(), "wb");
+
+    if (file == nullptr)
+        throw std::runtime_error("Can't open model file " + file_name);
+
+    uint64_t ffm_size = header.lin_offset - header.ffm_offset;
+    uint64_t n_ffm_weights = uint64_t(n_indices) * index_stride;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fseeko(file, header.ffm_offset, SEEK_SET) == 0
+        && fwrite(ffm_replicas[0], sizeof(float), n_ffm_weights, file) == n_ffm_weights
+        && fseeko(file, header.ffm_offset + ffm_size, SEEK_SET) == 0
+        && fwrite(lin_replicas[0], sizeof(float), uint64_t(n_indices) * n_slots, file) == uint64_t(n_indices) * n_slots;
+
+    if (fclose(file) != 0 || !ok)
+        throw std::runtime_error("Error writing model file " + file_name);
+
+    model_log() << "done." << std::endl;
+}
+
+
+uint64_t ffm_model::n_weights(uint32_t n_fields, uint32_t n_indices, uint32_t n_dim, uint32_t n_state) {
+    return (uint64_t(n_indices) * n_fields * aligned_float_array_size(n_dim) + n_indices) * (1 + n_state);
+}
+
+
+double ffm_model::n_predict_ops(double n_features, double n_interactions, uint32_t n_dim) {
+    return n_interactions * aligned_float_array_size(n_dim) + n_features;
 }
 
 
 ffm_model::~ffm_model() {
-    free(ffm_weights);
-    free(lin_weights);
+    stopping = true;
+
+    for (auto & parking : shard_parkings) {
+        std::lock_guard<std::mutex> lock(parking->mutex);
+        parking->cv.notify_one();
+    }
+
+    for (auto & t : shard_threads)
+        t.join();
+
+    if (shared_data != nullptr) {
+        munmap(shared_data, shared_size);
+
+        ffm_replicas.erase(ffm_replicas.begin());
+        lin_replicas.erase(lin_replicas.begin());
+    }
+
+    for (float * w : ffm_replicas)
+        free(w);
+
+    for (float * w : lin_replicas)
+        free(w);
+}
+
+
+int ffm_model::example_node(const batch_learn::feature * start, const batch_learn::feature * end) {
+    if (partition_nodes.size() < 2)
+        return -1;
+
+    // Count weight rows of example in each partition
+    uint counts[64] = {};
+
+    for (const batch_learn::feature * f = start; f != end; ++ f) {
+        uint index = f->index & index_mask;
+        uint field = f->index >> n_index_bits;
+
+        if (index < n_indices && field < n_fields)
+            counts[uint64_t(index) * partition_nodes.size() / n_indices] ++;
+    }
+
+    return partition_nodes[std::max_element(counts, counts + partition_nodes.size()) - counts];
+}
+
+
+void ffm_model::sync(bool full) {
+    // Wait for shards to apply all passed updates
+    if (full)
+        for (auto & queue : shard_queues)
+            while (!queue->empty())
+                std::this_thread::yield();
+
+    if (ffm_replicas.size() < 2)
+        return;
+
+    if (full) {
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (uint64_t from = 0; from < n_indices; from += 4096)
+            average_replicas(from, std::min<uint64_t>(from + 4096, n_indices));
+    } else {
+        // Average next slice of indices, full round takes sync_interval calls
+        uint64_t slice = sync_counter ++ % sync_interval;
+
+        average_replicas(uint64_t(n_indices) * slice / sync_interval, uint64_t(n_indices) * (slice + 1) / sync_interval);
+    }
+}
+
+
+uint32_t ffm_model::row_size() const {
+    return index_stride + n_slots;
+}
+
+
+void ffm_model::read_row(uint32_t index, float * values) const {
+    memcpy(values, ffm_replicas[0] + uint64_t(index) * index_stride, index_stride * sizeof(float));
+    memcpy(values + index_stride, lin_replicas[0] + uint64_t(index) * n_slots, n_slots * sizeof(float));
+}
+
+
+void ffm_model::write_row(uint32_t index, const float * values) {
+    for (uint r = 0; r < ffm_replicas.size(); ++ r) {
+        memcpy(ffm_replicas[r] + uint64_t(index) * index_stride, values, index_stride * sizeof(float));
+        memcpy(lin_replicas[r] + uint64_t(index) * n_slots, values + index_stride, n_slots * sizeof(float));
+    }
+}
+
+
+std::vector<std::pair<float *, size_t>> ffm_model::dense_parameters() {
+    return { std::make_pair(bias, size_t(n_slots)) };
+}
+
+
+// Replace weights and optimizer state of given indices in all replicas by their mean
+void ffm_model::average_replicas(uint64_t from, uint64_t to) {
+    uint n_replicas = ffm_replicas.size();
+    float mult = 1.0f / n_replicas;
+
+    for (uint64_t index = from; index < to; ++ index) {
+        for (uint64_t i = index * index_stride; i < (index + 1) * index_stride; ++ i) {
+            float total = 0;
+
+            for (uint r = 0; r < n_replicas; ++ r)
+                total += ffm_replicas[r][i];
+
+            for (uint r = 0; r < n_replicas; ++ r)
+                ffm_replicas[r][i] = total * mult;
+        }
+
+        for (uint64_t i = index * n_slots; i < (index + 1) * n_slots; ++ i) {
+            float total = 0;
+
+            for (uint r = 0; r < n_replicas; ++ r)
+                total += lin_replicas[r][i];
+
+            for (uint r = 0; r < n_replicas; ++ r)
+                lin_replicas[r][i] = total * mult;
+        }
+    }
 }
 
 
 float ffm_model::predict(const batch_learn::feature * start, const batch_learn::feature * end, float norm, bool train) {
     uint feature_count = end - start;
-    uint interaction_count = feature_count * (feature_count + 1) / 2;
+    uint64_t interaction_count = uint64_t(feature_count) * (feature_count - 1) / 2;
+
+    // Probability to keep interaction: dropout in train, capped by expected interaction count of example
+    double keep = train ? 1 - dropout : 1;
 
-    if (train)
-        local_state.init_train_dropout_mask(interaction_count);
+    if (train && max_interactions > 0 && keep * interaction_count > max_interactions)
+        keep = double(max_interactions) / interaction_count;
+
+    if (keep < 1)
+        local_state.sample_pairs(feature_count, keep);
     else
-        local_state.init_test_dropout_mask(interaction_count);
+        local_state.keep_all_pairs();
+
+    // Use replica of the node thread runs on
+    int cpu = ffm_replicas.size() > 1 ? sched_getcpu() : -1;
+    local_state.replica = cpu >= 0 && cpu < int(cpu_replicas.size()) ? cpu_replicas[cpu] : 0;
 
-    auto dropout_mask = local_state.dropout_mask.data();
-    float dropout_mult = local_state.dropout_mult;
+    if (local_state.all_pairs)
+        return predict_all_pairs(start, end, norm, local_state.replica);
 
+    const float * ffm_weights = ffm_replicas[local_state.replica];
+    const float * lin_weights = lin_replicas[local_state.replica];
 
-    float linear_total = bias_w;
+    float linear_total = *bias;
     float linear_norm = end - start;
 
+    for (const batch_learn::feature * fa = start; fa != end; ++ fa) {
+        uint index_a = fa->index &  index_mask;
+        uint field_a = fa->index >> n_index_bits;
+
+        // Check index/field bounds
+        if (index_a >= n_indices || field_a >= n_fields)
+            continue;
+
+        linear_total += fa->value * lin_weights[index_a*n_slots] / linear_norm;
+    }
+
     __m256 xmm_total = _mm256_set1_ps(0);
 
-    uint i = 0;
+    for (uint64_t pair : local_state.pairs) {
+        const batch_learn::feature * fa = start + (pair >> 32);
+        const batch_learn::feature * fb = start + (pair & 0xFFFFFFFF);
+
+        uint index_a = fa->index &  index_mask;
+        uint field_a = fa->index >> n_index_bits;
+        uint index_b = fb->index &  index_mask;
+        uint field_b = fb->index >> n_index_bits;
+
+        // Check index/field bounds
+        if (index_a >= n_indices || field_a >= n_fields || index_b >= n_indices || field_b >= n_fields)
+            continue;
+
+        const float * wa = ffm_weights + index_a * index_stride + field_b * field_stride;
+        const float * wb = ffm_weights + index_b * index_stride + field_a * field_stride;
+
+        __m256 xmm_val = _mm256_set1_ps(local_state.dropout_mult * fa->value * fb->value / norm);
+
+        for(uint d = 0; d < n_dim; d += 8)
+            xmm_total = _mm256_add_ps(xmm_total, _mm256_mul_ps(_mm256_mul_ps(_mm256_load_ps(wa + d), _mm256_load_ps(wb + d)), xmm_val));
+    }
+
+    return sum(xmm_total) + linear_total;
+}
+
+
+float ffm_model::score(const batch_learn::feature * start, const batch_learn::feature * end, float norm, score_context & ctx) const {
+    int cpu = ffm_replicas.size() > 1 ? sched_getcpu() : -1;
+
+    return predict_all_pairs(start, end, norm, cpu >= 0 && cpu < int(cpu_replicas.size()) ? cpu_replicas[cpu] : 0);
+}
+
+
+// Prediction with all interactions (without dropout), using given weights replica
+float ffm_model::predict_all_pairs(const batch_learn::feature * start, const batch_learn::feature * end, float norm, uint replica) const {
+    const float * ffm_weights = ffm_replicas[replica];
+    const float * lin_weights = lin_replicas[replica];
+
+    float linear_total = *bias;
+    float linear_norm = end - start;
+
+    __m256 xmm_total = _mm256_set1_ps(0);
 
     for (const batch_learn::feature * fa = start; fa != end; ++ fa) {
         uint index_a = fa->index &  index_mask;
@@ -141,31 +795,25 @@ float ffm_model::predict(const batch_learn::feature * start, const batch_learn::
         if (index_a >= n_indices || field_a >= n_fields)
             continue;
 
-        linear_total += value_a * lin_weights[index_a*2] / linear_norm;
+        linear_total += value_a * lin_weights[index_a*n_slots] / linear_norm;
 
-        for (const batch_learn::feature * fb = start; fb != fa; ++ fb, ++ i) {
+        const float * wa_row = ffm_weights + index_a * index_stride;
+
+        for (const batch_learn::feature * fb = start; fb != fa; ++ fb) {
             uint index_b = fb->index &  index_mask;
             uint field_b = fb->index >> n_index_bits;
-            float value_b = fb->value;
 
             // Check index/field bounds
             if (index_b >= n_indices || field_b >= n_fields)
                 continue;
 
-            if (test_mask_bit(dropout_mask, i) == 0)
-                continue;
-
-            float * wa = ffm_weights + index_a * index_stride + field_b * field_stride;
-            float * wb = ffm_weights + index_b * index_stride + field_a * field_stride;
+            const float * wa = wa_row + field_b * field_stride;
+            const float * wb = ffm_weights + index_b * index_stride + field_a * field_stride;
 
-            __m256 xmm_val = _mm256_set1_ps(dropout_mult * value_a * value_b / norm);
+            __m256 xmm_val = _mm256_set1_ps(value_a * fb->value / norm);
 
-            for(uint d = 0; d < n_dim; d += 8) {
-                __m256 xmm_wa = _mm256_load_ps(wa + d);
-                __m256 xmm_wb = _mm256_load_ps(wb + d);
-
-                xmm_total = _mm256_add_ps(xmm_total, _mm256_mul_ps(_mm256_mul_ps(xmm_wa, xmm_wb), xmm_val));
-            }
+            for(uint d = 0; d < n_dim; d += 8)
+                xmm_total = _mm256_add_ps(xmm_total, _mm256_mul_ps(_mm256_mul_ps(_mm256_load_ps(wa + d), _mm256_load_ps(wb + d)), xmm_val));
         }
     }
 
@@ -174,15 +822,63 @@ float ffm_model::predict(const batch_learn::feature * start, const batch_learn::
 
 
 void ffm_model::update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa) {
-    auto dropout_mask = local_state.dropout_mask.data();
-    float dropout_mult = local_state.dropout_mult;
+    (this->*update_impl)(start, end, norm, kappa);
+}
+
+
+template <typename O>
+void ffm_model::update_with(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa) {
+    uint64_t step = O::uses_step ? update_step.fetch_add(1, std::memory_order_relaxed) : 0;
+
+    if (!shard_threads.empty()) {
+        push_update(start, end, norm, kappa, step);
+    } else {
+        const uint64_t * pairs = local_state.all_pairs ? nullptr : local_state.pairs.data();
+
+        apply_update<O>(start, end, norm, kappa, pairs, local_state.pairs.size(), local_state.dropout_mult, step, local_state.replica, -1);
+    }
+
+    // Update bias
+    O(eta, l1, step).update(bias, kappa, 1);
+}
+
+
+// Apply example gradient of given update step to weights of given replica, only to rows owned by shard if it's not negative.
+// Interactions are given as feature numbers a << 32 | b (as in state), all of them are updated if pairs is null
+template <typename O>
+void ffm_model::apply_update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa, const uint64_t * pairs, uint64_t n_pairs, float dropout_mult, uint64_t step, uint replica, int shard) {
+    float * ffm_weights = ffm_replicas[replica];
+    float * lin_weights = lin_replicas[replica];
 
     float linear_norm = end - start;
 
-    __m256 xmm_eta = _mm256_set1_ps(eta);
+    O opt(eta, l1, step);
+
     __m256 xmm_lambda = _mm256_set1_ps(lambda);
 
-    uint i = 0;
+    auto update_interaction = [&](const batch_learn::feature * fa, const batch_learn::feature * fb) {
+        uint index_a = fa->index &  index_mask;
+        uint field_a = fa->index >> n_index_bits;
+        uint index_b = fb->index &  index_mask;
+        uint field_b = fb->index >> n_index_bits;
+
+        // Check index/field bounds
+        if (index_a >= n_indices || field_a >= n_fields || index_b >= n_indices || field_b >= n_fields)
+            return;
+
+        bool own_a = shard < 0 || shard_of(index_a) == uint(shard);
+        bool own_b = shard < 0 || shard_of(index_b) == uint(shard);
+
+        if (!own_a && !own_b)
+            return;
+
+        float * wa = ffm_weights + index_a * index_stride + field_b * field_stride;
+        float * wb = ffm_weights + index_b * index_stride + field_a * field_stride;
+
+        __m256 xmm_kappa_val = _mm256_set1_ps(kappa * dropout_mult * fa->value * fb->value / norm);
+
+        update_pair(opt, wa, wb, n_dim, n_dim_aligned, xmm_kappa_val, xmm_lambda, own_a, own_b);
+    };
 
     for (const batch_learn::feature * fa = start; fa != end; ++ fa) {
         uint index_a = fa->index &  index_mask;
@@ -193,62 +889,172 @@ void ffm_model::update(const batch_learn::feature * start, const batch_learn::fe
         if (index_a >= n_indices || field_a >= n_fields)
             continue;
 
-        float g = lambda * lin_weights[index_a*2] + kappa * value_a / linear_norm;
-        float wg = lin_weights[index_a*2 + 1] + g*g;
+        if (shard < 0 || shard_of(index_a) == uint(shard)) {
+            float * w = lin_weights + uint64_t(index_a) * n_slots;
 
-        lin_weights[index_a*2] -= eta * g / sqrt(wg);
-        lin_weights[index_a*2 + 1] = wg;
+            opt.update(w, lambda * w[0] + kappa * value_a / linear_norm, 1);
+        }
 
-        for (const batch_learn::feature * fb = start; fb != fa; ++ fb, ++ i) {
-            uint index_b = fb->index &  index_mask;
-            uint field_b = fb->index >> n_index_bits;
-            float value_b = fb->value;
+        if (pairs == nullptr)
+            for (const batch_learn::feature * fb = start; fb != fa; ++ fb)
+                update_interaction(fa, fb);
+    }
 
-            // Check index/field bounds
-            if (index_b >= n_indices || field_b >= n_fields)
-                continue;
+    if (pairs != nullptr)
+        for (const uint64_t * p = pairs; p != pairs + n_pairs; ++ p)
+            update_interaction(start + (*p >> 32), start + (*p & 0xFFFFFFFF));
+}
 
-            if (test_mask_bit(dropout_mask, i) == 0)
-                continue;
 
-            float * wa = ffm_weights + index_a * index_stride + field_b * field_stride;
-            float * wb = ffm_weights + index_b * index_stride + field_a * field_stride;
+// Pass example gradient to shards owning its rows, messages longer than queue are pushed in parts
+void ffm_model::push_update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa, uint64_t step) {
+    uint producer = omp_get_thread_num();
+
+    if (producer >= n_producers)
+        throw std::runtime_error("Sharded updates were started for " + std::to_string(n_producers) + " training threads, more threads can't be used with this model");
+
+    // Message: feature count, kept interaction count, kappa, norm, dropout multiplier, all interactions flag, update step, features, kept interactions
+    thread_local std::vector<uint64_t> message;
+
+    uint64_t n_features = end - start;
+    uint64_t n_pairs = local_state.all_pairs ? 0 : local_state.pairs.size();
+
+    message.resize(4 + n_features + n_pairs);
 
-            float * wga = wa + n_dim_aligned;
-            float * wgb = wb + n_dim_aligned;
+    uint32_t header[6] = { uint32_t(n_features), uint32_t(n_pairs) };
 
-            __m256 xmm_kappa_val = _mm256_set1_ps(kappa * dropout_mult * value_a * value_b / norm);
+    memcpy(header + 2, &kappa, sizeof(float));
+    memcpy(header + 3, &norm, sizeof(float));
+    memcpy(header + 4, &local_state.dropout_mult, sizeof(float));
+    header[5] = local_state.all_pairs;
+
+    memcpy(message.data(), header, 3 * sizeof(uint64_t));
+    message[3] = step;
+    memcpy(message.data() + 4, start, n_features * sizeof(uint64_t));
+    memcpy(message.data() + 4 + n_features, local_state.pairs.data(), n_pairs * sizeof(uint64_t));
+
+    uint64_t shards = 0;
+
+    for (const batch_learn::feature * f = start; f != end; ++ f) {
+        uint index = f->index & index_mask;
+
+        if (index < n_indices && (f->index >> n_index_bits) < n_fields)
+            shards |= 1ull << shard_of(index);
+    }
 
-            for(uint d = 0; d < n_dim; d += 8) {
-                // Load weights
-                __m256 xmm_wa = _mm256_load_ps(wa + d);
-                __m256 xmm_wb = _mm256_load_ps(wb + d);
+    for (uint shard = 0; shard < n_shards; ++ shard) {
+        if ((shards >> shard & 1) == 0)
+            continue;
 
-                __m256 xmm_wga = _mm256_load_ps(wga + d);
-                __m256 xmm_wgb = _mm256_load_ps(wgb + d);
+        auto & queue = *shard_queues[producer * n_shards + shard];
+        auto & parking = *shard_parkings[shard];
 
-                // Compute gradient values
-                __m256 xmm_ga = _mm256_add_ps(_mm256_mul_ps(xmm_lambda, xmm_wa), _mm256_mul_ps(xmm_kappa_val, xmm_wb));
-                __m256 xmm_gb = _mm256_add_ps(_mm256_mul_ps(xmm_lambda, xmm_wb), _mm256_mul_ps(xmm_kappa_val, xmm_wa));
+        for (size_t pushed = 0; pushed < message.size();) {
+            size_t part = std::min(message.size() - pushed, queue.capacity() / 2);
 
-                // Update weights
-                xmm_wga = _mm256_add_ps(xmm_wga, _mm256_mul_ps(xmm_ga, xmm_ga));
-                xmm_wgb = _mm256_add_ps(xmm_wgb, _mm256_mul_ps(xmm_gb, xmm_gb));
+            while (!queue.try_push(message.data() + pushed, part))
+                std::this_thread::yield();
 
-                xmm_wa  = _mm256_sub_ps(xmm_wa, _mm256_mul_ps(xmm_eta, _mm256_mul_ps(_mm256_rsqrt_ps(xmm_wga), xmm_ga)));
-                xmm_wb  = _mm256_sub_ps(xmm_wb, _mm256_mul_ps(xmm_eta, _mm256_mul_ps(_mm256_rsqrt_ps(xmm_wgb), xmm_gb)));
+            pushed += part;
 
-                // Store weights
-                _mm256_store_ps(wa + d, xmm_wa);
-                _mm256_store_ps(wb + d, xmm_wb);
+            // Pairs with fence of parking shard: either it sees the message or we see it parked
+            std::atomic_thread_fence(std::memory_order_seq_cst);
 
-                _mm256_store_ps(wga + d, xmm_wga);
-                _mm256_store_ps(wgb + d, xmm_wgb);
+            if (parking.parked.load(std::memory_order_relaxed)) {
+                std::lock_guard<std::mutex> lock(parking.mutex);
+                parking.cv.notify_one();
             }
         }
     }
+}
 
-    // Update bias
-    bias_wg += kappa;
-    bias_w -= eta * kappa / sqrt(bias_wg);
+
+bool ffm_model::shard_queues_empty(uint shard) const {
+    for (uint producer = 0; producer < n_producers; ++ producer)
+        if (!shard_queues[producer * n_shards + shard]->empty())
+            return false;
+
+    return true;
+}
+
+
+// Apply updates from all producer queues to rows of shard until model is destroyed, parking when they stay empty.
+// Updates of each training thread are applied in order they were made, but queues of different threads are
+// taken in turn, so their interleaving depends on timing and sharded training isn't bitwise reproducible.
+void ffm_model::run_shard(uint shard) {
+    auto & parking = *shard_parkings[shard];
+
+    // Messages of each producer, assembled from parts when they are longer than queue
+    std::vector<std::vector<uint64_t>> messages(n_producers);
+    std::vector<size_t> received(n_producers, 0);
+
+    uint idle_rounds = 0;
+
+    while (!stopping) {
+        bool any = false;
+
+        for (uint producer = 0; producer < n_producers; ++ producer) {
+            auto & queue = *shard_queues[producer * n_shards + shard];
+            auto & message = messages[producer];
+
+            // Take limited number of messages from each queue in turn
+            for (uint k = 0; k < 64 && !queue.empty(); ++ k) {
+                if (received[producer] == 0) {
+                    uint32_t n_features = queue[0] & 0xFFFFFFFF, n_pairs = queue[0] >> 32;
+
+                    message.resize(4 + n_features + n_pairs);
+                }
+
+                size_t n = std::min(queue.size(), message.size() - received[producer]);
+
+                for (size_t j = 0; j < n; ++ j)
+                    message[received[producer] + j] = queue[j];
+
+                received[producer] += n;
+                any = true;
+
+                if (received[producer] < message.size()) { // Wait for next part
+                    queue.pop(n);
+                    break;
+                }
+
+                uint32_t header[6];
+                memcpy(header, message.data(), 3 * sizeof(uint64_t));
+
+                uint32_t n_features = header[0], n_pairs = header[1];
+
+                float kappa, norm, dropout_mult;
+                memcpy(&kappa, header + 2, sizeof(float));
+                memcpy(&norm, header + 3, sizeof(float));
+                memcpy(&dropout_mult, header + 4, sizeof(float));
+
+                auto features = (const batch_learn::feature *) (message.data() + 4);
+
+                const uint64_t * pairs = header[5] ? nullptr : message.data() + 4 + n_features;
+
+                (this->*apply_update_impl)(features, features + n_features, norm, kappa, pairs, n_pairs, dropout_mult, message[3], 0, shard);
+
+                // Last part is popped after update is applied, so sync sees empty queues only when all updates are done
+                queue.pop(n);
+                received[producer] = 0;
+            }
+        }
+
+        if (any) {
+            idle_rounds = 0;
+        } else if (++ idle_rounds < 64) {
+            std::this_thread::yield();
+        } else {
+            parking.parked.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            {
+                std::unique_lock<std::mutex> lock(parking.mutex);
+                parking.cv.wait(lock, [&] { return stopping || !shard_queues_empty(shard); });
+            }
+
+            parking.parked.store(false, std::memory_order_relaxed);
+            idle_rounds = 0;
+        }
+    }
 }
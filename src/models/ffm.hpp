@@ -2,24 +2,166 @@
 
 #include "model.hpp"
 
+#include "../util/queue.hpp"
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+
+// Header of ffm model file, followed by interaction and linear weights (with optimizer state) at aligned offsets
+struct ffm_file_header {
+    char magic[8];
+    uint32_t version, n_fields, n_indices, n_index_bits, n_dim, n_dim_aligned;
+    char optimizer[8];
+    float bias[4]; // Bias and its optimizer state
+    uint64_t ffm_offset, lin_offset, file_size;
+    char loss[8];
+};
+
+constexpr uint32_t ffm_file_version = 1;
+
+constexpr uint64_t ffm_file_align = 1 << 21; // Weight blocks start at huge page boundaries
+
 
 class ffm_model : public model {
+    friend class ffm_int8_model;
+
     uint32_t n_fields, n_indices, n_index_bits, n_dim;
 
-    uint32_t n_dim_aligned, index_stride, field_stride, index_mask;
+    uint32_t n_dim_aligned, n_slots, index_stride, field_stride, index_mask; // Weight and optimizer state vectors take n_slots per field
+
+    std::vector<float *> ffm_replicas; // Weights of each numa node replica, single one if not replicated
+    std::vector<float *> lin_replicas;
+    std::vector<uint> cpu_replicas; // Replica used by each cpu
+
+    std::vector<int> partition_nodes; // Nodes owning equal index ranges of weights, if partitioned
 
-    float * ffm_weights;
-    float * lin_weights;
+    uint sync_interval; // Number of partial syncs to average all replica weights
+    std::atomic<uint64_t> sync_counter;
 
-    float bias_w;
-    float bias_wg;
+    // Sharded updates: weight rows are owned by update threads by index hash, training threads pass
+    // examples with their gradient to owners through queue of each training thread to each owner
+    static constexpr size_t shard_queue_size = 1 << 16;
+
+    // Idle update thread parks on condition variable, producers wake it after pushing if it's parked
+    struct shard_parking {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::atomic<bool> parked;
+
+        shard_parking(): parked(false) {}
+    };
+
+    uint n_shards, n_producers;
+    std::vector<std::unique_ptr<spsc_queue<uint64_t>>> shard_queues;
+    std::vector<std::unique_ptr<shard_parking>> shard_parkings;
+    std::vector<std::thread> shard_threads;
+    std::atomic<bool> stopping;
+
+    float * bias; // Point to header of shared weights file or to bias_storage
+    float bias_storage[4];
+
+    // Weights file mapped by several training processes, if given
+    std::string shared_file_name;
+    char * shared_data;
+    uint64_t shared_size;
+
+    float dropout; // Rate of interactions dropped in training
+    uint max_interactions; // Expected number of interactions trained per example, if positive
+
+    std::string optimizer;
+    std::string loss;
+
+    char step_padding[64]; // Keep update step counter, changed by all training threads, in separate cache line
+    std::atomic<uint64_t> update_step; // Number of updates, for optimizers depending on it
+    char step_padding_end[64];
 
     float eta;
     float lambda;
+    float l1;
+
+    // Kernels of chosen optimizer
+    void (ffm_model::*update_impl)(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa);
+    void (ffm_model::*apply_update_impl)(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa, const uint64_t * pairs, uint64_t n_pairs, float dropout_mult, uint64_t step, uint replica, int shard);
+    void (ffm_model::*init_state_impl)();
 public:
-    ffm_model(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, int seed, float eta, float lambda);
+    // Numa mode: none, replicate (weights per node, averaged every sync_interval batches), partition (index ranges per node) or auto,
+    // updates are applied by n_shards owner threads if it's positive. If shared file is given weights are kept in it,
+    // mapped shared between processes: file is created and initialized if create_shared is set, otherwise existing one is attached.
+    // Interactions are dropped in training with given rate, long examples may be sampled further to max_interactions (0 for all).
+    // Weights are trained by optimizer adagrad, ftrl (with l1 regularization) or adam, loss is stored in saved model to choose its outputs
+    ffm_model(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, int seed, float eta, float lambda, const std::string & numa_mode = "none", uint sync_interval = 16, uint n_shards = 0,
+              const std::string & shared_file = "", bool create_shared = true, float dropout = 0.5, uint max_interactions = 0, const std::string & optimizer = "adagrad", float l1 = 0,
+              const std::string & loss = "logistic");
+
+    // Model saved to file, for scoring only: weights are mapped read-only and shared with other processes mapping it
+    explicit ffm_model(const std::string & file_name);
     virtual ~ffm_model();
 
+    // Number of float weights (including optimizer state of n_state values per weight) allocated by model of given size
+    static uint64_t n_weights(uint32_t n_fields, uint32_t n_indices, uint32_t n_dim, uint32_t n_state = 1);
+
+    // Number of multiply-adds in prediction for example with given (mean) feature and interaction count
+    static double n_predict_ops(double n_features, double n_interactions, uint32_t n_dim);
+
+    // Header of model file with given dimensions and weight block offsets
+    static ffm_file_header file_header(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, const std::string & optimizer, const std::string & loss);
+
     virtual float predict(const batch_learn::feature * start, const batch_learn::feature * end, float norm, bool train);
     virtual void update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa);
+
+    virtual float score(const batch_learn::feature * start, const batch_learn::feature * end, float norm, score_context & ctx) const;
+
+    virtual int example_node(const batch_learn::feature * start, const batch_learn::feature * end);
+    virtual void sync(bool full);
+
+    virtual uint32_t row_size() const;
+    virtual void read_row(uint32_t index, float * values) const;
+    virtual void write_row(uint32_t index, const float * values);
+    virtual std::vector<std::pair<float *, size_t>> dense_parameters();
+
+    virtual bool shared_weights() const { return shared_data != nullptr; }
+    virtual void save(const std::string & file_name);
+    virtual void pretouch();
+
+    virtual std::unique_ptr<model> quantize(const std::string & kernels) const;
+
+    virtual std::string loss_name() const { return loss; }
+private:
+    void init_dimensions(uint32_t n_fields, uint32_t n_indices, uint32_t n_index_bits, uint32_t n_dim, const std::string & optimizer);
+
+    template <typename O>
+    void use_optimizer();
+
+    template <typename O>
+    void init_state();
+
+    void average_replicas(uint64_t from, uint64_t to);
+
+    float predict_all_pairs(const batch_learn::feature * start, const batch_learn::feature * end, float norm, uint replica) const;
+
+    template <typename O>
+    void update_with(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa);
+
+    template <typename O>
+    void apply_update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa, const uint64_t * pairs, uint64_t n_pairs, float dropout_mult, uint64_t step, uint replica, int shard);
+    void push_update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa, uint64_t step);
+    void run_shard(uint shard);
+    bool shard_queues_empty(uint shard) const;
+    void start_shards();
+
+    void create_shared_file();
+    void attach_shared_file();
+    void map_shared_file(int fd, uint64_t size, bool writable);
+    void use_shared_weights();
+
+    // Shard owning weight rows of index
+    uint shard_of(uint index) const {
+        return (uint64_t(uint32_t(index * 2654435761u)) * n_shards) >> 32;
+    }
 };
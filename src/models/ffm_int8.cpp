@@ -0,0 +1,94 @@
+#include "ffm_int8.hpp"
+
+#include "../util/model.hpp"
+#include "../util/int8.hpp"
+
+#include <cstring>
+
+
+ffm_int8_model::ffm_int8_model(const ffm_model & m, const std::string & kernels):
+    n_fields(m.n_fields), n_indices(m.n_indices), n_index_bits(m.n_index_bits), n_dim(m.n_dim), index_mask(m.index_mask), bias(*m.bias), loss(m.loss), predict_impl(nullptr) {
+    this->kernels = choose_int8_kernels(kernels);
+
+#ifdef INT8_VNNI_KERNELS
+    if (this->kernels == "vnni")
+        predict_impl = &ffm_int8_model::predict_vnni;
+#endif
+
+#ifdef INT8_AVX2_KERNELS
+    if (this->kernels == "avx2")
+        predict_impl = &ffm_int8_model::predict_with<int8_dot<int8_avx2_kernels>>;
+#endif
+
+    n_dim_q = (n_dim + 15) / 16 * 16;
+
+    uint64_t n_rows = uint64_t(n_indices) * n_fields;
+
+    weights = malloc_aligned<int8_t>(n_rows * n_dim_q);
+    scales = malloc_aligned<float>(n_rows);
+    lin_weights = malloc_aligned<float>(n_indices);
+
+    const float * ffm_weights = m.ffm_replicas[0];
+    const float * ffm_lin_weights = m.lin_replicas[0];
+
+    #pragma omp parallel for schedule(static)
+    for (uint64_t row = 0; row < n_rows; ++ row)
+        scales[row] = quantize_s8(ffm_weights + row * m.field_stride, n_dim, n_dim_q, weights + row * n_dim_q);
+
+    for (uint32_t i = 0; i < n_indices; ++ i)
+        lin_weights[i] = ffm_lin_weights[uint64_t(i) * m.n_slots];
+}
+
+
+ffm_int8_model::~ffm_int8_model() {
+    free(weights);
+    free(scales);
+    free(lin_weights);
+}
+
+
+template <typename K>
+float ffm_int8_model::predict_with(const batch_learn::feature * start, const batch_learn::feature * end, float norm) const {
+    float linear_total = bias;
+    float linear_norm = end - start;
+
+    float total = 0;
+
+    for (const batch_learn::feature * fa = start; fa != end; ++ fa) {
+        uint index_a = fa->index & index_mask;
+        uint field_a = fa->index >> n_index_bits;
+        float value_a = fa->value;
+
+        // Check index/field bounds
+        if (index_a >= n_indices || field_a >= n_fields)
+            continue;
+
+        linear_total += value_a * lin_weights[index_a] / linear_norm;
+
+        for (const batch_learn::feature * fb = start; fb != fa; ++ fb) {
+            uint index_b = fb->index & index_mask;
+            uint field_b = fb->index >> n_index_bits;
+
+            // Check index/field bounds
+            if (index_b >= n_indices || field_b >= n_fields)
+                continue;
+
+            uint64_t row_a = uint64_t(index_a) * n_fields + field_b;
+            uint64_t row_b = uint64_t(index_b) * n_fields + field_a;
+
+            int32_t dot = K::dot_s8(weights + row_a * n_dim_q, weights + row_b * n_dim_q, n_dim_q);
+
+            total += dot * scales[row_a] * scales[row_b] * value_a * fb->value;
+        }
+    }
+
+    return total / norm + linear_total;
+}
+
+
+#ifdef INT8_VNNI_KERNELS
+INT8_VNNI_TARGET __attribute__((flatten))
+float ffm_int8_model::predict_vnni(const batch_learn::feature * start, const batch_learn::feature * end, float norm) const {
+    return predict_with<int8_dot<int8_vnni_kernels>>(start, end, norm);
+}
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "ffm.hpp"
+
+
+// Inference-only ffm with int8 latent vectors and fp32 scale per vector (index and field pair),
+// linear weights are kept in fp32
+class ffm_int8_model : public model {
+    uint32_t n_fields, n_indices, n_index_bits, n_dim, n_dim_q, index_mask;
+
+    int8_t * weights; // Vectors padded to n_dim_q
+    float * scales;
+    float * lin_weights;
+    float bias;
+
+    std::string kernels, loss;
+    float (ffm_int8_model::*predict_impl)(const batch_learn::feature * start, const batch_learn::feature * end, float norm) const;
+public:
+    ffm_int8_model(const ffm_model & m, const std::string & kernels = "auto");
+    virtual ~ffm_int8_model();
+
+    virtual float predict(const batch_learn::feature * start, const batch_learn::feature * end, float norm, bool train) {
+        return (this->*predict_impl)(start, end, norm);
+    }
+
+    virtual float score(const batch_learn::feature * start, const batch_learn::feature * end, float norm, score_context & ctx) const {
+        return (this->*predict_impl)(start, end, norm);
+    }
+
+    virtual void update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa) {
+        throw std::runtime_error("Quantized model can't be trained");
+    }
+
+    virtual std::string kernels_name() const { return "int8 " + kernels; }
+    virtual std::string loss_name() const { return loss; }
+private:
+    template <typename K>
+    float predict_with(const batch_learn::feature * start, const batch_learn::feature * end, float norm) const;
+
+    // Prediction with vnni kernels, compiled for their instructions with everything inlined
+    float predict_vnni(const batch_learn::feature * start, const batch_learn::feature * end, float norm) const;
+};
@@ -2,6 +2,65 @@
 
 #include <batch_learn.hpp>
 
+#include <vector>
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <iostream>
+
+#include <cstdlib>
+
+
+// Stream of model progress messages, standard output by default. Embedding programs may redirect it, null silences them
+inline std::ostream *& model_log_stream() {
+    static std::ostream * stream = &std::cout;
+    return stream;
+}
+
+inline std::ostream & model_log() {
+    static std::ostream null_log(nullptr); // Discards everything written to it
+
+    std::ostream * stream = model_log_stream();
+    return stream != nullptr ? *stream : null_log;
+}
+
+
+// Squared norm of example features, models scale interactions by it
+inline float compute_norm(const batch_learn::feature * start, const batch_learn::feature * end) {
+    float norm = 0;
+
+    for (const batch_learn::feature * f = start; f != end; ++ f)
+        norm += f->value * f->value;
+
+    return norm;
+}
+
+
+// Scratch memory of const scoring, owned by caller: one context per thread or coroutine scoring concurrently
+class score_context {
+    float * buffer;
+    size_t buffer_size;
+public:
+    explicit score_context(size_t size = 0): buffer(nullptr), buffer_size(size) {
+        if (size > 0 && posix_memalign((void **) &buffer, 32, size * sizeof(float)) != 0)
+            throw std::bad_alloc();
+    }
+
+    score_context(score_context && other): buffer(other.buffer), buffer_size(other.buffer_size) {
+        other.buffer = nullptr;
+        other.buffer_size = 0;
+    }
+
+    score_context(const score_context &) = delete;
+    score_context & operator =(const score_context &) = delete;
+
+    ~score_context() { free(buffer); }
+
+    float * data() const { return buffer; }
+    size_t size() const { return buffer_size; }
+};
+
+
 class model {
 public:
     model() {}
@@ -9,4 +68,41 @@ public:
 
     virtual float predict(const batch_learn::feature * start, const batch_learn::feature * end, float norm, bool train) = 0;
     virtual void update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa) = 0;
+
+    // Inference path: const, without dropout and thread-local state, doesn't allocate. Context should have
+    // at least score_scratch_size() floats, it may be reused between calls but not shared between concurrent ones
+    virtual float score(const batch_learn::feature * start, const batch_learn::feature * end, float norm, score_context & ctx) const { throw std::runtime_error("Scoring is not supported by this model"); }
+    virtual size_t score_scratch_size() const { return 0; }
+
+    score_context create_score_context() const { return score_context(score_scratch_size()); }
+
+    // Numa node which should train on example, -1 if any thread may
+    virtual int example_node(const batch_learn::feature * start, const batch_learn::feature * end) { return -1; }
+
+    // Synchronize model replicas: partially after each batch while other threads train, fully after epoch
+    virtual void sync(bool full) {}
+
+    // Parameters exchanged between training processes: row of values (weights and optimizer state)
+    // of each feature index and dense parameters
+    virtual uint32_t row_size() const { return 0; }
+    virtual void read_row(uint32_t index, float * values) const {}
+    virtual void write_row(uint32_t index, const float * values) {}
+    virtual std::vector<std::pair<float *, size_t>> dense_parameters() { return std::vector<std::pair<float *, size_t>>(); }
+
+    // Weights are shared with other processes through mapped file, so they don't need to be exchanged
+    virtual bool shared_weights() const { return false; }
+
+    virtual void save(const std::string & file_name) { throw std::runtime_error("Saving is not supported by this model"); }
+
+    // Fault in mapped weight pages, so first predictions don't wait for them
+    virtual void pretouch() {}
+
+    // Inference-only copy of model with int8 weights, using given kernels (auto, avx2 or vnni)
+    virtual std::unique_ptr<model> quantize(const std::string & kernels) const { throw std::runtime_error("Quantization is not supported by this model"); }
+
+    // Name of kernels used in prediction, if model has several
+    virtual std::string kernels_name() const { return "fp32"; }
+
+    // Loss model is trained with, defining its outputs: probabilities for logistic, raw scores for others
+    virtual std::string loss_name() const { return "logistic"; }
 };
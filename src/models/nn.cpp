@@ -1,22 +1,22 @@
 #include "nn.hpp"
+#include "nn_int8.hpp"
 
 #include "../util/model.hpp"
 #include "../util/nn.hpp"
+#include "../util/optimizer.hpp"
 
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <algorithm>
 
+#include <cstring>
 
-constexpr uint l0_output_size = aligned_float_array_size(96);
-constexpr uint l1_output_size = aligned_float_array_size(64);
-constexpr uint l2_output_size = aligned_float_array_size(48);
-
-constexpr uint l1_layer_size = l0_output_size * (l1_output_size - 1);
-constexpr uint l2_layer_size = l1_output_size * (l2_output_size - 1);
-constexpr uint l3_layer_size = l2_output_size;
 
+// Updates of thread are added to shared update step counter in chunks, so training threads don't contend on it
+// when it's needed only for l2 catch up. Step is then known up to chunk, so last chunk of steps skipped by row
+// isn't caught up, as row may have been regularized by its own updates in them
+constexpr uint64_t step_chunk_size = 64;
 
 
 class state_buffer {
@@ -34,8 +34,11 @@ public:
     float * l2_dropout_mask;
 
     std::default_random_engine gen;
+
+    const std::atomic<uint64_t> * step_counter; // Update step counter of model trained by thread, and its updates not added to counter yet
+    uint64_t pending_steps;
 public:
-    state_buffer() {
+    state_buffer(): step_counter(nullptr), pending_steps(0) {
         l0_output = malloc_aligned<float>(l0_output_size);
         l0_output_grad = malloc_aligned<float>(l0_output_size);
         l0_dropout_mask = malloc_aligned<float>(l0_output_size);
@@ -62,56 +65,141 @@ public:
         free(l2_output_grad);
         free(l2_dropout_mask);
     }
+
+    // Count update of thread in given shared counter, returning its coarse value
+    uint64_t coarse_step(std::atomic<uint64_t> & counter) {
+        if (step_counter != &counter) {
+            step_counter = &counter;
+            pending_steps = 0;
+        }
+
+        if (++ pending_steps == step_chunk_size) {
+            counter.fetch_add(step_chunk_size, std::memory_order_relaxed);
+            pending_steps = 0;
+        }
+
+        return counter.load(std::memory_order_relaxed);
+    }
 };
 
 static thread_local state_buffer local_state_buffer;
 
 
-nn_model::nn_model(uint32_t n_indices, uint32_t n_index_bits, int seed, float eta, float lambda) {
+// Fill weights of n rows of given size with random values, leaving optimizer state after each of them
+template <typename D>
+static void init_rows(float * weights, uint64_t n_rows, uint row_size, uint n_slots, D gen, std::default_random_engine & rnd) {
+    for (uint64_t i = 0; i < n_rows; ++ i)
+        fill_with_rand(weights + i * row_size * n_slots, row_size, gen, rnd);
+}
+
+
+nn_model::nn_model(uint32_t n_indices, uint32_t n_index_bits, int seed, float eta, float lambda, const std::string & optimizer, float l1):
+    optimizer(optimizer), n_slots(1 + optimizer_state_size(optimizer)), update_step(0), l1_row_steps(l1_output_size - 1), l2_row_steps(l2_output_size - 1) {
     this->n_indices = n_indices;
     this->n_index_bits = n_index_bits;
     this->eta = eta;
     this->lambda = lambda;
+    this->l1 = l1;
+
+    row_log_decay = std::log1p(-std::min(eta * lambda, 0.5f));
+
+    if (optimizer == "adagrad")
+        use_optimizer<adagrad_optimizer>();
+    else if (optimizer == "ftrl")
+        use_optimizer<ftrl_optimizer>();
+    else
+        use_optimizer<adam_optimizer>();
 
     index_mask = (1u << n_index_bits) - 1;
 
     std::default_random_engine rnd(seed);
 
-    lin_w = malloc_aligned<float>(n_indices * l0_output_size);
-    lin_wg = malloc_aligned<float>(n_indices * l0_output_size);
+    lin_w = malloc_aligned<float>(uint64_t(n_indices) * l0_output_size * n_slots);
+    l1_w = malloc_aligned<float>(l1_layer_size * n_slots);
+    l2_w = malloc_aligned<float>(l2_layer_size * n_slots);
+    l3_w = malloc_aligned<float>(l3_layer_size * n_slots);
 
-    l1_w = malloc_aligned<float>(l1_layer_size);
-    l1_wg = malloc_aligned<float>(l1_layer_size);
+    init_rows(lin_w, n_indices, l0_output_size, n_slots, std::uniform_real_distribution<float>(-0.1, 0.1), rnd);
+    init_rows(l1_w, l1_output_size - 1, l0_output_size, n_slots, std::normal_distribution<float>(0, 2/sqrt(l0_output_size)), rnd);
+    init_rows(l2_w, l2_output_size - 1, l1_output_size, n_slots, std::normal_distribution<float>(0, 2/sqrt(l1_output_size)), rnd);
+    init_rows(l3_w, 1, l2_output_size, n_slots, std::normal_distribution<float>(0, 2/sqrt(l2_output_size)), rnd);
+
+    (this->*init_state_impl)();
+}
 
-    l2_w = malloc_aligned<float>(l2_layer_size);
-    l2_wg = malloc_aligned<float>(l2_layer_size);
 
-    l3_w = malloc_aligned<float>(l3_layer_size);
-    l3_wg = malloc_aligned<float>(l3_layer_size);
+template <typename O>
+void nn_model::use_optimizer() {
+    update_impl = &nn_model::update_with<O>;
+    init_state_impl = &nn_model::init_state<O>;
+    catch_up_rows_impl = &nn_model::catch_up_rows<O>;
+
+    step_slack = O::uses_step ? 0 : step_chunk_size;
+}
 
-    fill_with_rand(lin_w, n_indices * l0_output_size, std::uniform_real_distribution<float>(-0.1, 0.1), rnd);
-    fill_with_ones(lin_wg, n_indices * l0_output_size);
 
-    fill_with_rand(l1_w, l1_layer_size, std::normal_distribution<float>(0, 2/sqrt(l0_output_size)), rnd);
-    fill_with_ones(l1_wg, l1_layer_size);
+// Initialize optimizer state of all initialized weights
+template <typename O>
+void nn_model::init_state() {
+    O opt(eta, l1, 0);
+
+    auto init = [&](float * w, uint64_t n_rows, uint row_size) {
+        for (uint64_t i = 0; i < n_rows; ++ i)
+            for (uint j = 0; j < row_size; ++ j)
+                opt.init(w + i * row_size * n_slots + j, row_size);
+    };
+
+    init(lin_w, n_indices, l0_output_size);
+    init(l1_w, l1_output_size - 1, l0_output_size);
+    init(l2_w, l2_output_size - 1, l1_output_size);
+    init(l3_w, 1, l2_output_size);
+}
 
-    fill_with_rand(l2_w, l2_layer_size, std::normal_distribution<float>(0, 2/sqrt(l1_output_size)), rnd);
-    fill_with_ones(l2_wg, l2_layer_size);
 
-    fill_with_rand(l3_w, l3_layer_size, std::normal_distribution<float>(0, 2/sqrt(l2_output_size)), rnd);
-    fill_with_ones(l3_wg, l3_layer_size);
+uint64_t nn_model::n_weights(uint32_t n_indices, uint32_t n_state) {
+    return (uint64_t(n_indices) * l0_output_size + l1_layer_size + l2_layer_size + l3_layer_size) * (1 + n_state);
+}
+
+
+double nn_model::n_predict_ops(double n_features) {
+    return n_features * l0_output_size + l1_layer_size + l2_layer_size + l3_layer_size;
 }
 
 
 nn_model::~nn_model() {
     free(lin_w);
-    free(lin_wg);
-
     free(l1_w);
-    free(l1_wg);
-
     free(l2_w);
-    free(l2_wg);
+    free(l3_w);
+}
+
+
+std::unique_ptr<model> nn_model::quantize(const std::string & kernels) const {
+    return std::unique_ptr<model>(new nn_int8_model(*this, kernels));
+}
+
+
+uint32_t nn_model::row_size() const {
+    return l0_output_size * n_slots;
+}
+
+
+void nn_model::read_row(uint32_t index, float * values) const {
+    memcpy(values, lin_w + uint64_t(index) * l0_output_size * n_slots, l0_output_size * n_slots * sizeof(float));
+}
+
+
+void nn_model::write_row(uint32_t index, const float * values) {
+    memcpy(lin_w + uint64_t(index) * l0_output_size * n_slots, values, l0_output_size * n_slots * sizeof(float));
+}
+
+
+std::vector<std::pair<float *, size_t>> nn_model::dense_parameters() {
+    return {
+        std::make_pair(l1_w, size_t(l1_layer_size) * n_slots),
+        std::make_pair(l2_w, size_t(l2_layer_size) * n_slots),
+        std::make_pair(l3_w, size_t(l3_layer_size) * n_slots)
+    };
 }
 
 
@@ -173,7 +261,7 @@ float nn_model::predict(const batch_learn::feature * start, const batch_learn::f
         if (index >= n_indices)
             continue;
 
-        float * wl = lin_w + index * l0_output_size;
+        float * wl = lin_w + uint64_t(index) * l0_output_size * n_slots;
 
         __m256 ymm_val = _mm256_set1_ps(value / linear_norm);
         for(uint d = 0; d < l0_output_size; d += 8) {
@@ -191,21 +279,126 @@ float nn_model::predict(const batch_learn::feature * start, const batch_learn::f
 
     // Layer 1 forward pass
     for (uint j = 1; j < l1_output_size; ++ j)
-        l1_output[j] = relu(forward_pass(l0_output_size, l0_output, l1_w + (j - 1) * l0_output_size)) * l1_dropout_mask[j];
+        l1_output[j] = relu(forward_pass(l0_output_size, l0_output, l1_w + (j - 1) * l0_output_size * n_slots)) * l1_dropout_mask[j];
 
     // Layer 2 forward pass
     for (uint j = 1; j < l2_output_size; ++ j)
-        l2_output[j] = relu(forward_pass(l1_output_size, l1_output, l2_w + (j - 1) * l1_output_size)) * l2_dropout_mask[j];
+        l2_output[j] = relu(forward_pass(l1_output_size, l1_output, l2_w + (j - 1) * l1_output_size * n_slots)) * l2_dropout_mask[j];
 
     // Layer 3 forward pass
     return forward_pass(l2_output_size, l2_output, l3_w);
 }
 
 
-void nn_model::update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa) {
+float nn_model::score(const batch_learn::feature * start, const batch_learn::feature * end, float norm, score_context & ctx) const {
     float linear_norm = end - start;
+
+    float * l0_output = ctx.data();
+    float * l1_output = l0_output + l0_output_size;
+    float * l2_output = l1_output + l1_output_size;
+
+    fill_with_zero(l0_output, l0_output_size);
+
+    for (const batch_learn::feature * fa = start; fa != end; ++ fa) {
+        uint index = fa->index & index_mask;
+
+        // Check index bounds
+        if (index >= n_indices)
+            continue;
+
+        const float * wl = lin_w + uint64_t(index) * l0_output_size * n_slots;
+
+        __m256 ymm_val = _mm256_set1_ps(fa->value / linear_norm);
+        for (uint d = 0; d < l0_output_size; d += 8)
+            _mm256_store_ps(l0_output + d, _mm256_load_ps(l0_output + d) + _mm256_load_ps(wl + d) * ymm_val);
+    }
+
+    l0_output[0] = 1.0; // Layer 0 bias
+    l1_output[0] = 1.0; // Layer 1 bias
+    l2_output[0] = 1.0; // Layer 2 bias
+
+    // Layer 0 relu
+    for (uint j = 1; j < l0_output_size; ++ j)
+        l0_output[j] = relu(l0_output[j]);
+
+    // Layer 1 forward pass
+    for (uint j = 1; j < l1_output_size; ++ j)
+        l1_output[j] = relu(forward_pass(l0_output_size, l0_output, l1_w + (j - 1) * l0_output_size * n_slots));
+
+    // Layer 2 forward pass
+    for (uint j = 1; j < l2_output_size; ++ j)
+        l2_output[j] = relu(forward_pass(l1_output_size, l1_output, l2_w + (j - 1) * l1_output_size * n_slots));
+
+    // Layer 3 forward pass
+    return forward_pass(l2_output_size, l2_output, l3_w);
+}
+
+
+void nn_model::update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa) {
+    (this->*update_impl)(start, end, norm, kappa);
+}
+
+
+// Weights multiplier catching up l2 regularization of row skipped since its last update to given step, which
+// approximates regularization steps of optimizer by plain gradient steps with rate eta
+float nn_model::catch_up_row(std::atomic<uint64_t> & row_step, uint64_t step) {
+    uint64_t prev = row_step.load(std::memory_order_relaxed);
+
+    // Claim steps up to given one, unless row is already updated for later step by other thread
+    while (prev <= step && !row_step.compare_exchange_weak(prev, step + 1, std::memory_order_relaxed)) {}
+
+    uint64_t missed = step > prev + step_slack ? step - prev - step_slack : 0;
+
+    return missed > 0 && lambda > 0 ? std::exp(missed * row_log_decay) : 1;
+}
+
+
+// Catch up l2 regularization of all skipped rows, so weights are current after epoch
+void nn_model::sync(bool full) {
+    if (full)
+        (this->*catch_up_rows_impl)();
+}
+
+
+template <typename O>
+void nn_model::catch_up_rows() {
+    O opt(eta, l1, 0);
+
+    uint64_t step = update_step;
+
+    for (uint j = 1; j < l1_output_size; ++ j) {
+        float decay = catch_up_row(l1_row_steps[j - 1], step);
+        float * w = l1_w + (j - 1) * l0_output_size * n_slots;
+
+        for (uint i = 0; i < l0_output_size; ++ i)
+            opt.decay(w + i, decay, l0_output_size);
+
+        l1_row_steps[j - 1].store(step, std::memory_order_relaxed);
+    }
+
+    for (uint j = 1; j < l2_output_size; ++ j) {
+        float decay = catch_up_row(l2_row_steps[j - 1], step);
+        float * w = l2_w + (j - 1) * l1_output_size * n_slots;
+
+        for (uint i = 0; i < l1_output_size; ++ i)
+            opt.decay(w + i, decay, l1_output_size);
+
+        l2_row_steps[j - 1].store(step, std::memory_order_relaxed);
+    }
+}
+
+
+template <typename O>
+void nn_model::update_with(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa) {
     state_buffer & buf = local_state_buffer;
 
+    // Optimizer needs exact step, l2 catch up only coarse one
+    uint64_t step = O::uses_step ? update_step.fetch_add(1, std::memory_order_relaxed) : lambda > 0 ? buf.coarse_step(update_step) : 0;
+
+    O opt(eta, l1, step);
+
+    float linear_norm = end - start;
+
     float * l0_output = buf.l0_output;
     float * l0_output_grad = buf.l0_output_grad;
     float * l0_dropout_mask = buf.l0_dropout_mask;
@@ -222,26 +415,26 @@ void nn_model::update(const batch_learn::feature * start, const batch_learn::fea
     fill_with_zero(l1_output_grad, l1_output_size);
     fill_with_zero(l2_output_grad, l2_output_size);
 
-    backward_pass(l2_output_size, l2_output, l2_output_grad, l3_w, l3_wg, kappa, eta, lambda);
+    backward_pass(opt, l2_output_size, l2_output, l2_output_grad, l3_w, kappa, lambda);
 
-    // Backprop layer 2
-    for (uint j = 1, ofs = 0; j < l2_output_size; ++ j, ofs += l1_output_size) {
+    // Backprop layer 2, skipping rows of units without gradient
+    for (uint j = 1, ofs = 0; j < l2_output_size; ++ j, ofs += l1_output_size * n_slots) {
         float l2_grad = l2_output_grad[j] * l2_dropout_mask[j];
 
-        if (l2_output[j] <= 0) // Relu activation: grad in negative part is zero
-            l2_grad = 0;
+        if (l2_output[j] <= 0 || l2_grad == 0) // Relu activation: grad in negative part is zero
+            continue;
 
-        backward_pass(l1_output_size, l1_output, l1_output_grad, l2_w + ofs, l2_wg + ofs, l2_grad, eta, lambda);
+        backward_pass(opt, l1_output_size, l1_output, l1_output_grad, l2_w + ofs, l2_grad, lambda, catch_up_row(l2_row_steps[j - 1], step));
     }
 
-    // Backprop layer 1
-    for (uint j = 1, ofs = 0; j < l1_output_size; ++ j, ofs += l0_output_size) {
+    // Backprop layer 1, skipping rows of units without gradient
+    for (uint j = 1, ofs = 0; j < l1_output_size; ++ j, ofs += l0_output_size * n_slots) {
         float l1_grad = l1_output_grad[j] * l1_dropout_mask[j];
 
-        if (l1_output[j] <= 0) // Relu activation: grad in negative part is zero
-            l1_grad = 0;
+        if (l1_output[j] <= 0 || l1_grad == 0) // Relu activation: grad in negative part is zero
+            continue;
 
-        backward_pass(l0_output_size, l0_output, l0_output_grad, l1_w + ofs, l1_wg + ofs, l1_grad, eta, lambda);
+        backward_pass(opt, l0_output_size, l0_output, l0_output_grad, l1_w + ofs, l1_grad, lambda, catch_up_row(l1_row_steps[j - 1], step));
     }
 
     // Backprop layer 0
@@ -256,7 +449,6 @@ void nn_model::update(const batch_learn::feature * start, const batch_learn::fea
     }
 
     // Update linear and interaction weights
-    __m256 ymm_eta = _mm256_set1_ps(eta);
     __m256 ymm_lambda = _mm256_set1_ps(lambda);
 
     for (const batch_learn::feature * fa = start; fa != end; ++ fa) {
@@ -267,8 +459,7 @@ void nn_model::update(const batch_learn::feature * start, const batch_learn::fea
         if (index >= n_indices)
             continue;
 
-        float * wl = lin_w + index * l0_output_size;
-        float * wgl = lin_wg + index * l0_output_size;
+        float * wl = lin_w + uint64_t(index) * l0_output_size * n_slots;
 
         __m256 ymm_val = _mm256_set1_ps(value / linear_norm);
 
@@ -277,18 +468,12 @@ void nn_model::update(const batch_learn::feature * start, const batch_learn::fea
 
             // Load weights
             __m256 ymm_wl = _mm256_load_ps(wl + d);
-            __m256 ymm_wgl = _mm256_load_ps(wgl + d);
 
             // Compute gradient values
             __m256 ymm_g  = ymm_lambda * ymm_wl + ymm_kappa_val;
 
-            // Update weights
-            ymm_wgl = ymm_wgl + ymm_g * ymm_g;
-            ymm_wl  = ymm_wl - ymm_eta * ymm_g * _mm256_rsqrt_ps(ymm_wgl);
-
-            // Store weights
-            _mm256_store_ps(wl + d, ymm_wl);
-            _mm256_store_ps(wgl + d, ymm_wgl);
+            // Update weights with their state
+            opt.update(wl + d, ymm_wl, ymm_g, l0_output_size);
         }
     }
 }
@@ -2,28 +2,91 @@
 
 #include "model.hpp"
 
+#include <atomic>
+#include <vector>
 
+
+// Layer output sizes (including bias) are multiples of AVX vector size
+constexpr uint l0_output_size = 96;
+constexpr uint l1_output_size = 64;
+constexpr uint l2_output_size = 48;
+
+constexpr uint l1_layer_size = l0_output_size * (l1_output_size - 1);
+constexpr uint l2_layer_size = l1_output_size * (l2_output_size - 1);
+constexpr uint l3_layer_size = l2_output_size;
+
+
+
+// Weight rows (embedding of index or inputs of layer output) are followed by optimizer state vectors of the same size
 class nn_model : public model {
-    float * lin_w;
-    float * lin_wg;
+    friend class nn_int8_model;
 
+    float * lin_w;
     float * l1_w;
-    float * l1_wg;
-
     float * l2_w;
-    float * l2_wg;
-
     float * l3_w;
-    float * l3_wg;
+
+    std::string optimizer;
+    uint32_t n_slots; // Weight and optimizer state vectors of row
+
+    char step_padding[64]; // Keep update step counter, changed by all training threads, in separate cache line
+    std::atomic<uint64_t> update_step; // Number of updates, exact for optimizer depending on it, otherwise counted coarsely for l2 catch up of skipped rows
+    char step_padding_end[64];
+
+    // Rows of layers 1 and 2 of inactive relu units get no gradient and are skipped in update, l2 regularization
+    // of skipped updates is caught up on next update of row: steps of rows are update steps they are regularized up to,
+    // advanced atomically so concurrent updates of row claim disjoint missed steps
+    std::vector<std::atomic<uint64_t>> l1_row_steps, l2_row_steps;
+    float row_log_decay; // Log of weights multiplier of l2 regularization step
+    uint64_t step_slack; // Uncertainty of coarse update step, not caught up
 
     float eta;
     float lambda;
+    float l1;
 
     uint32_t n_indices, n_index_bits, index_mask;
+
+    // Kernels of chosen optimizer
+    void (nn_model::*update_impl)(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa);
+    void (nn_model::*init_state_impl)();
+    void (nn_model::*catch_up_rows_impl)();
 public:
-    nn_model(uint32_t n_indices, uint32_t n_index_bits, int seed, float eta, float lambda);
+    // Weights are trained by optimizer adagrad, ftrl (with l1 regularization) or adam
+    nn_model(uint32_t n_indices, uint32_t n_index_bits, int seed, float eta, float lambda, const std::string & optimizer = "adagrad", float l1 = 0);
     virtual ~nn_model();
 
+    // Number of float weights (including optimizer state of n_state values per weight) allocated by model of given size
+    static uint64_t n_weights(uint32_t n_indices, uint32_t n_state = 1);
+
+    // Number of multiply-adds in prediction for example with given (mean) feature count
+    static double n_predict_ops(double n_features);
+
     virtual float predict(const batch_learn::feature * start, const batch_learn::feature * end, float norm, bool train);
     virtual void update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa);
+
+    virtual float score(const batch_learn::feature * start, const batch_learn::feature * end, float norm, score_context & ctx) const;
+    virtual size_t score_scratch_size() const { return l0_output_size + l1_output_size + l2_output_size; }
+
+    virtual void sync(bool full);
+
+    virtual uint32_t row_size() const;
+    virtual void read_row(uint32_t index, float * values) const;
+    virtual void write_row(uint32_t index, const float * values);
+    virtual std::vector<std::pair<float *, size_t>> dense_parameters();
+
+    virtual std::unique_ptr<model> quantize(const std::string & kernels) const;
+private:
+    template <typename O>
+    void use_optimizer();
+
+    template <typename O>
+    void init_state();
+
+    float catch_up_row(std::atomic<uint64_t> & row_step, uint64_t step);
+
+    template <typename O>
+    void catch_up_rows();
+
+    template <typename O>
+    void update_with(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa);
 };
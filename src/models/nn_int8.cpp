@@ -0,0 +1,123 @@
+#include "nn_int8.hpp"
+
+#include "../util/model.hpp"
+#include "../util/nn.hpp"
+#include "../util/int8.hpp"
+
+#include <cstring>
+
+
+nn_int8_model::nn_int8_model(const nn_model & m, const std::string & kernels):
+    n_indices(m.n_indices), index_mask(m.index_mask), predict_impl(nullptr) {
+    this->kernels = choose_int8_kernels(kernels);
+
+#ifdef INT8_VNNI_KERNELS
+    if (this->kernels == "vnni")
+        predict_impl = &nn_int8_model::predict_vnni;
+#endif
+
+#ifdef INT8_AVX2_KERNELS
+    if (this->kernels == "avx2")
+        predict_impl = &nn_int8_model::predict_with<int8_dot<int8_avx2_kernels>>;
+#endif
+
+    lin_w = malloc_aligned<int8_t>(uint64_t(n_indices) * l0_output_size);
+    lin_scales = malloc_aligned<float>(n_indices);
+
+    l1_w = malloc_aligned<int8_t>(l1_layer_size);
+    l1_scales = malloc_aligned<float>(l1_output_size);
+
+    l2_w = malloc_aligned<int8_t>(l2_layer_size);
+    l2_scales = malloc_aligned<float>(l2_output_size);
+
+    l3_w = malloc_aligned<float>(l3_layer_size);
+
+    #pragma omp parallel for schedule(static)
+    for (uint64_t i = 0; i < n_indices; ++ i)
+        lin_scales[i] = quantize_s8(m.lin_w + i * l0_output_size * m.n_slots, l0_output_size, l0_output_size, lin_w + i * l0_output_size);
+
+    for (uint j = 0; j < l1_output_size - 1; ++ j)
+        l1_scales[j] = quantize_s8(m.l1_w + j * l0_output_size * m.n_slots, l0_output_size, l0_output_size, l1_w + j * l0_output_size);
+
+    for (uint j = 0; j < l2_output_size - 1; ++ j)
+        l2_scales[j] = quantize_s8(m.l2_w + j * l1_output_size * m.n_slots, l1_output_size, l1_output_size, l2_w + j * l1_output_size);
+
+    memcpy(l3_w, m.l3_w, l3_layer_size * sizeof(float));
+}
+
+
+nn_int8_model::~nn_int8_model() {
+    free(lin_w);
+    free(lin_scales);
+
+    free(l1_w);
+    free(l1_scales);
+
+    free(l2_w);
+    free(l2_scales);
+
+    free(l3_w);
+}
+
+
+template <typename K>
+float nn_int8_model::predict_with(const batch_learn::feature * start, const batch_learn::feature * end) const {
+    float linear_norm = end - start;
+
+    alignas(32) float l0_output[l0_output_size] = {};
+    alignas(32) float l1_output[l1_output_size];
+    alignas(32) float l2_output[l2_output_size];
+
+    alignas(32) uint8_t l0_q[l0_output_size];
+    alignas(32) uint8_t l1_q[l1_output_size];
+
+    // Sum embeddings, dequantizing them
+    for (const batch_learn::feature * fa = start; fa != end; ++ fa) {
+        uint index = fa->index & index_mask;
+
+        // Check index bounds
+        if (index >= n_indices)
+            continue;
+
+        const int8_t * wl = lin_w + uint64_t(index) * l0_output_size;
+
+        __m256 ymm_val = _mm256_set1_ps(lin_scales[index] * fa->value / linear_norm);
+
+        for (uint d = 0; d < l0_output_size; d += 8) {
+            __m256 ymm_w = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (wl + d))));
+
+            _mm256_store_ps(l0_output + d, _mm256_fmadd_ps(ymm_w, ymm_val, _mm256_load_ps(l0_output + d)));
+        }
+    }
+
+    l0_output[0] = 1.0; // Layer 0 bias
+    l1_output[0] = 1.0; // Layer 1 bias
+    l2_output[0] = 1.0; // Layer 2 bias
+
+    // Layer 0 relu
+    for (uint j = 1; j < l0_output_size; ++ j)
+        l0_output[j] = relu(l0_output[j]);
+
+    // Layer 1 forward pass on quantized inputs
+    float l0_scale = quantize_u7(l0_output, l0_output_size, l0_q);
+
+    for (uint j = 1; j < l1_output_size; ++ j)
+        l1_output[j] = relu(K::dot_u8s8(l0_q, l1_w + (j - 1) * l0_output_size, l0_output_size) * l0_scale * l1_scales[j - 1]);
+
+    // Layer 2 forward pass on quantized inputs
+    float l1_scale = quantize_u7(l1_output, l1_output_size, l1_q);
+
+    for (uint j = 1; j < l2_output_size; ++ j)
+        l2_output[j] = relu(K::dot_u8s8(l1_q, l2_w + (j - 1) * l1_output_size, l1_output_size) * l1_scale * l2_scales[j - 1]);
+
+    // Layer 3 forward pass
+    return forward_pass(l2_output_size, l2_output, l3_w);
+}
+
+
+#ifdef INT8_VNNI_KERNELS
+INT8_VNNI_TARGET __attribute__((flatten))
+float nn_int8_model::predict_vnni(const batch_learn::feature * start, const batch_learn::feature * end) const {
+    return predict_with<int8_dot<int8_vnni_kernels>>(start, end);
+}
+#endif
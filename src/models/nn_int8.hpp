@@ -0,0 +1,47 @@
+#pragma once
+
+#include "nn.hpp"
+
+
+// Inference-only nn with int8 weights: embedding rows and dense layer rows have fp32 scales,
+// dense layer inputs are quantized per example. Output layer is kept in fp32
+class nn_int8_model : public model {
+    uint32_t n_indices, index_mask;
+
+    int8_t * lin_w;
+    float * lin_scales;
+
+    int8_t * l1_w;
+    float * l1_scales;
+
+    int8_t * l2_w;
+    float * l2_scales;
+
+    float * l3_w;
+
+    std::string kernels;
+    float (nn_int8_model::*predict_impl)(const batch_learn::feature * start, const batch_learn::feature * end) const;
+public:
+    nn_int8_model(const nn_model & m, const std::string & kernels = "auto");
+    virtual ~nn_int8_model();
+
+    virtual float predict(const batch_learn::feature * start, const batch_learn::feature * end, float norm, bool train) {
+        return (this->*predict_impl)(start, end);
+    }
+
+    virtual float score(const batch_learn::feature * start, const batch_learn::feature * end, float norm, score_context & ctx) const {
+        return (this->*predict_impl)(start, end);
+    }
+
+    virtual void update(const batch_learn::feature * start, const batch_learn::feature * end, float norm, float kappa) {
+        throw std::runtime_error("Quantized model can't be trained");
+    }
+
+    virtual std::string kernels_name() const { return "int8 " + kernels; }
+private:
+    template <typename K>
+    float predict_with(const batch_learn::feature * start, const batch_learn::feature * end) const;
+
+    // Prediction with vnni kernels, compiled for their instructions with everything inlined
+    float predict_vnni(const batch_learn::feature * start, const batch_learn::feature * end) const;
+};
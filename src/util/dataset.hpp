@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.hpp"
+#include "reader.hpp"
 
 #include <batch_learn.hpp>
 
@@ -9,13 +10,15 @@ class batch_learn_dataset {
 public:
     batch_learn::file_index index;
     std::string data_file_name;
+    std::unique_ptr<batch_reader> reader;
 
-    batch_learn_dataset(const std::string & file_name) {
+    batch_learn_dataset(const std::string & file_name, const std::string & reader_type = "buffered", uint io_depth = 16, bool verify = true) {
         std::cout << "Loading " << file_name << ".index... ";
         std::cout.flush();
 
         index = batch_learn::read_index(file_name + ".index");
         data_file_name = file_name + ".data";
+        reader = create_batch_reader(reader_type, data_file_name, index, verify, io_depth);
 
         std::cout << index.n_examples << " examples" << std::endl;
     }
@@ -28,4 +31,9 @@ public:
 
         return batches;
     }
+
+    // Start reading given example batches with dataset reader
+    void start_reading(const std::vector<std::pair<uint64_t, uint64_t>> & batches) const {
+        reader->start(batches);
+    }
 };
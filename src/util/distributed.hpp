@@ -0,0 +1,294 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+// Parameter averaging between training processes over TCP: process of rank 0 listens on given address,
+// others connect to it. On each averaging round every process sends its sparse rows and dense values,
+// rank 0 averages them and sends result back, so all processes end up with same parameters.
+class parameter_averager {
+    uint rank, world;
+    std::vector<int> sockets; // Rank 0: socket of each other rank (by rank - 1), others: socket to rank 0
+public:
+    uint64_t bytes_sent, bytes_received, n_rounds;
+public:
+    parameter_averager(uint rank, uint world, const std::string & address): rank(rank), world(world), bytes_sent(0), bytes_received(0), n_rounds(0) {
+        using namespace std;
+
+        if (world == 0 || rank >= world)
+            throw runtime_error("Process rank should be less than world size");
+
+        auto colon = address.rfind(':');
+
+        if (colon == string::npos)
+            throw runtime_error("Coordinator address should be host:port, got " + address);
+
+        string host = address.substr(0, colon), port = address.substr(colon + 1);
+
+        addrinfo hints, * res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = rank == 0 ? AI_PASSIVE : 0;
+
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0)
+            throw runtime_error("Can't resolve coordinator address " + address);
+
+        try {
+            if (rank == 0)
+                accept_workers(res);
+            else
+                connect_coordinator(res, address);
+        } catch (...) {
+            freeaddrinfo(res);
+            throw;
+        }
+
+        freeaddrinfo(res);
+    }
+
+    ~parameter_averager() {
+        for (int s : sockets)
+            close(s);
+    }
+
+    // Average parameters over processes. Rows are given by sorted ids with row_size values each, row touched by
+    // several processes gets mean of their values; on return rows are union of all processes rows with their means.
+    // Dense values are averaged over all processes.
+    void average(std::vector<uint32_t> & rows, std::vector<float> & row_values, uint32_t row_size, std::vector<float> & dense) {
+        n_rounds ++;
+
+        if (world == 1)
+            return;
+
+        if (rank > 0) {
+            send_parameters(sockets[0], rows, row_values, dense);
+            receive_parameters(sockets[0], rows, row_values, row_size, dense);
+            return;
+        }
+
+        // Sum rows and dense values of all processes
+        std::unordered_map<uint32_t, uint64_t> row_slots; // Position of row in sums
+        std::vector<uint32_t> sum_rows;
+        std::vector<float> sums, counts;
+        std::vector<float> dense_sums(dense);
+
+        auto add_rows = [&](const std::vector<uint32_t> & r, const std::vector<float> & v) {
+            for (uint64_t i = 0; i < r.size(); ++ i) {
+                auto it = row_slots.insert(std::make_pair(r[i], sum_rows.size()));
+
+                if (it.second) {
+                    sum_rows.push_back(r[i]);
+                    sums.insert(sums.end(), v.begin() + i * row_size, v.begin() + (i + 1) * row_size);
+                    counts.push_back(1);
+                } else {
+                    float * s = sums.data() + it.first->second * row_size;
+
+                    for (uint32_t j = 0; j < row_size; ++ j)
+                        s[j] += v[i * row_size + j];
+
+                    counts[it.first->second] ++;
+                }
+            }
+        };
+
+        add_rows(rows, row_values);
+
+        std::vector<uint32_t> worker_rows;
+        std::vector<float> worker_values, worker_dense;
+
+        for (int s : sockets) {
+            receive_parameters(s, worker_rows, worker_values, row_size, worker_dense);
+
+            if (worker_dense.size() != dense.size())
+                throw std::runtime_error("Mismatching dense parameters of processes");
+
+            add_rows(worker_rows, worker_values);
+
+            for (size_t j = 0; j < dense.size(); ++ j)
+                dense_sums[j] += worker_dense[j];
+        }
+
+        // Sort union of rows and compute means
+        std::vector<uint64_t> order(sum_rows.size());
+        for (uint64_t i = 0; i < order.size(); ++ i)
+            order[i] = i;
+
+        std::sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) { return sum_rows[a] < sum_rows[b]; });
+
+        rows.resize(order.size());
+        row_values.resize(order.size() * row_size);
+
+        for (uint64_t i = 0; i < order.size(); ++ i) {
+            rows[i] = sum_rows[order[i]];
+
+            for (uint32_t j = 0; j < row_size; ++ j)
+                row_values[i * row_size + j] = sums[order[i] * row_size + j] / counts[order[i]];
+        }
+
+        for (size_t j = 0; j < dense.size(); ++ j)
+            dense[j] = dense_sums[j] / world;
+
+        for (int s : sockets)
+            send_parameters(s, rows, row_values, dense);
+    }
+
+    // Wait until all processes reach barrier
+    void barrier() {
+        char token = 0;
+
+        if (rank > 0) {
+            send_all(sockets[0], &token, 1);
+            receive_all(sockets[0], &token, 1);
+            return;
+        }
+
+        for (int s : sockets)
+            receive_all(s, &token, 1);
+
+        for (int s : sockets)
+            send_all(s, &token, 1);
+    }
+private:
+    void accept_workers(addrinfo * addr) {
+        int listener = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        int one = 1;
+
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (listener < 0 || bind(listener, addr->ai_addr, addr->ai_addrlen) != 0 || listen(listener, world) != 0) {
+            if (listener >= 0)
+                close(listener);
+
+            throw std::runtime_error("Can't listen on coordinator address");
+        }
+
+        sockets.assign(world - 1, -1);
+
+        for (uint i = 1; i < world; ++ i) {
+            int s = accept(listener, nullptr, nullptr);
+
+            if (s < 0) {
+                close(listener);
+                throw std::runtime_error("Can't accept worker connection");
+            }
+
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            uint32_t worker_rank;
+            receive_all(s, &worker_rank, sizeof(worker_rank));
+
+            if (worker_rank == 0 || worker_rank >= world || sockets[worker_rank - 1] >= 0) {
+                close(s);
+                close(listener);
+                throw std::runtime_error("Unexpected worker rank " + std::to_string(worker_rank));
+            }
+
+            sockets[worker_rank - 1] = s;
+        }
+
+        close(listener);
+    }
+
+    // Connect to coordinator, waiting for it to start
+    void connect_coordinator(addrinfo * addr, const std::string & address) {
+        for (uint attempt = 0; ; ++ attempt) {
+            int s = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+            if (s >= 0 && connect(s, addr->ai_addr, addr->ai_addrlen) == 0) {
+                int one = 1;
+                setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                sockets.push_back(s);
+
+                uint32_t r = rank;
+                send_all(s, &r, sizeof(r));
+
+                return;
+            }
+
+            if (s >= 0)
+                close(s);
+
+            if (attempt >= 600)
+                throw std::runtime_error("Can't connect to coordinator " + address);
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    void send_parameters(int s, const std::vector<uint32_t> & rows, const std::vector<float> & row_values, const std::vector<float> & dense) {
+        uint64_t header[2] = { rows.size(), dense.size() };
+
+        send_all(s, header, sizeof(header));
+        send_all(s, rows.data(), rows.size() * sizeof(uint32_t));
+        send_all(s, row_values.data(), row_values.size() * sizeof(float));
+        send_all(s, dense.data(), dense.size() * sizeof(float));
+    }
+
+    void receive_parameters(int s, std::vector<uint32_t> & rows, std::vector<float> & row_values, uint32_t row_size, std::vector<float> & dense) {
+        uint64_t header[2];
+
+        receive_all(s, header, sizeof(header));
+
+        rows.resize(header[0]);
+        row_values.resize(header[0] * row_size);
+        dense.resize(header[1]);
+
+        receive_all(s, rows.data(), rows.size() * sizeof(uint32_t));
+        receive_all(s, row_values.data(), row_values.size() * sizeof(float));
+        receive_all(s, dense.data(), dense.size() * sizeof(float));
+    }
+
+    void send_all(int s, const void * data, size_t size) {
+        const char * p = (const char *) data;
+
+        bytes_sent += size;
+
+        while (size > 0) {
+            ssize_t res = send(s, p, size, MSG_NOSIGNAL);
+
+            if (res < 0 && errno == EINTR)
+                continue;
+
+            if (res <= 0)
+                throw std::runtime_error("Error sending parameters to other process");
+
+            p += res;
+            size -= res;
+        }
+    }
+
+    void receive_all(int s, void * data, size_t size) {
+        char * p = (char *) data;
+
+        bytes_received += size;
+
+        while (size > 0) {
+            ssize_t res = recv(s, p, size, 0);
+
+            if (res < 0 && errno == EINTR)
+                continue;
+
+            if (res <= 0)
+                throw std::runtime_error("Error receiving parameters from other process");
+
+            p += res;
+            size -= res;
+        }
+    }
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+// 64-bit finalizer from MurmurHash3
+inline uint64_t hash_u64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+
+// Hash of byte string, processes 8 bytes at a time
+inline uint64_t hash_bytes(const char * data, size_t size, uint64_t seed = 0) {
+    uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15ull);
+
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t k;
+        __builtin_memcpy(&k, data, 8);
+        h = hash_u64(h ^ k) * 0x9e3779b97f4a7c15ull;
+    }
+
+    uint64_t k = 0;
+    __builtin_memcpy(&k, data, size);
+
+    return hash_u64(h ^ k);
+}
+
+
+// Map hash to uniform value in [0, 1)
+inline double hash_to_unit(uint64_t h) {
+    return (h >> 11) * (1.0 / (1ull << 53));
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+
+// HyperLogLog distinct count estimator, expects well-mixed 64-bit hashes
+class hyperloglog {
+    uint32_t precision;
+    std::vector<uint8_t> registers;
+public:
+    hyperloglog(uint32_t precision = 12): precision(precision), registers(1u << precision, 0) {}
+
+    void add(uint64_t hash) {
+        uint32_t idx = hash >> (64 - precision);
+        uint64_t rest = (hash << precision) | (1ull << (precision - 1)); // Sentinel bit bounds the rank
+        uint8_t rank = __builtin_clzll(rest) + 1;
+
+        if (rank > registers[idx])
+            registers[idx] = rank;
+    }
+
+    void merge(const hyperloglog & other) {
+        for (size_t i = 0; i < registers.size(); ++ i)
+            if (other.registers[i] > registers[i])
+                registers[i] = other.registers[i];
+    }
+
+    double estimate() const {
+        double m = registers.size();
+        double alpha = 0.7213 / (1 + 1.079 / m);
+        double sum = 0;
+        uint32_t zeros = 0;
+
+        for (uint8_t r : registers) {
+            sum += std::ldexp(1.0, -r);
+            zeros += (r == 0);
+        }
+
+        double e = alpha * m * m / sum;
+
+        // Small range correction - linear counting
+        if (e <= 2.5 * m && zeros > 0)
+            e = m * std::log(m / zeros);
+
+        return e;
+    }
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include <immintrin.h>
+
+
+// Int8 dot product kernels for quantized inference. Both take vectors of length multiple of 16.
+//
+// Signed dot uses |a| * sign(b, a) trick, as maddubs multiplies unsigned by signed bytes, values should be
+// in [-127, 127]. Unsigned by signed dot expects unsigned values in [0, 127], so pair sums of maddubs
+// (at most 2 * 127 * 127) don't saturate int16 and results of both kernel sets are the same.
+//
+// Avx2 kernel set is compiled if compiler targets avx2 (see -march). Vnni set is compiled with it regardless of
+// -march, for its instructions by target attribute: code inlining it should be compiled with INT8_VNNI_TARGET
+// too (models do it for flattened prediction entry points). Kernel set is chosen at runtime by cpu support,
+// avx2 set may also be requested explicitly for comparison.
+
+#ifdef __AVX2__
+#define INT8_AVX2_KERNELS
+#define INT8_VNNI_KERNELS
+#endif
+
+#define INT8_VNNI_TARGET __attribute__((target("avx512vnni,avx512vl,avx512bw")))
+
+
+#ifdef INT8_AVX2_KERNELS
+struct int8_avx2_kernels {
+    static inline __m256i dot_u8s8_step(__m256i acc, __m256i u, __m256i s) {
+        return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(u, s), _mm256_set1_epi16(1)));
+    }
+
+    static inline __m128i dot_u8s8_step(__m128i acc, __m128i u, __m128i s) {
+        return _mm_add_epi32(acc, _mm_madd_epi16(_mm_maddubs_epi16(u, s), _mm_set1_epi16(1)));
+    }
+};
+#endif
+
+
+#ifdef INT8_VNNI_KERNELS
+struct int8_vnni_kernels {
+    INT8_VNNI_TARGET static inline __m256i dot_u8s8_step(__m256i acc, __m256i u, __m256i s) {
+        return _mm256_dpbusd_epi32(acc, u, s);
+    }
+
+    INT8_VNNI_TARGET static inline __m128i dot_u8s8_step(__m128i acc, __m128i u, __m128i s) {
+        return _mm_dpbusd_epi32(acc, u, s);
+    }
+};
+#endif
+
+
+#ifdef INT8_AVX2_KERNELS
+template <typename K>
+struct int8_dot : K {
+    static inline int32_t hsum(__m256i v) {
+        return hsum(_mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+    }
+
+    static inline int32_t hsum(__m128i v) {
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+
+        return _mm_cvtsi128_si32(v);
+    }
+
+    static inline int32_t dot_u8s8(const uint8_t * a, const int8_t * b, uint n) {
+        __m256i acc = _mm256_setzero_si256();
+        __m128i acc_tail = _mm_setzero_si128();
+
+        uint i = 0;
+
+        for (; i + 32 <= n; i += 32)
+            acc = K::dot_u8s8_step(acc, _mm256_loadu_si256((const __m256i *) (a + i)), _mm256_loadu_si256((const __m256i *) (b + i)));
+
+        if (i < n)
+            acc_tail = K::dot_u8s8_step(acc_tail, _mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i)));
+
+        return hsum(acc) + hsum(acc_tail);
+    }
+
+    static inline int32_t dot_s8(const int8_t * a, const int8_t * b, uint n) {
+        __m256i acc = _mm256_setzero_si256();
+        __m128i acc_tail = _mm_setzero_si128();
+
+        uint i = 0;
+
+        for (; i + 32 <= n; i += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+
+            acc = K::dot_u8s8_step(acc, _mm256_abs_epi8(va), _mm256_sign_epi8(vb, va));
+        }
+
+        if (i < n) {
+            __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+
+            acc_tail = K::dot_u8s8_step(acc_tail, _mm_abs_epi8(va), _mm_sign_epi8(vb, va));
+        }
+
+        return hsum(acc) + hsum(acc_tail);
+    }
+};
+#endif
+
+
+// Kernel set to use: requested one (vnni or avx2) or best one supported by cpu for auto, checking it's compiled in
+inline std::string choose_int8_kernels(const std::string & requested) {
+    __builtin_cpu_init();
+
+    bool vnni = false, avx2 = false;
+
+#ifdef INT8_VNNI_KERNELS
+    vnni = __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw");
+#endif
+
+#ifdef INT8_AVX2_KERNELS
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    if ((requested == "auto" || requested == "vnni") && vnni)
+        return "vnni";
+
+    if ((requested == "auto" || requested == "avx2") && avx2)
+        return "avx2";
+
+    if (requested != "auto" && requested != "vnni" && requested != "avx2")
+        throw std::runtime_error("Unknown int8 kernels " + requested + ", supported kernels: auto, avx2, vnni");
+
+    throw std::runtime_error("Int8 kernels " + requested + " aren't supported by cpu or build");
+}
+
+
+// Quantize values symmetrically to [-127, 127] (padding the rest up to n_padded with zeros), returning scale
+inline float quantize_s8(const float * values, uint n, uint n_padded, int8_t * q) {
+    float max = 0;
+
+    for (uint i = 0; i < n; ++ i)
+        max = std::max(max, std::abs(values[i]));
+
+    float scale = max > 0 ? max / 127 : 1;
+
+    for (uint i = 0; i < n; ++ i)
+        q[i] = int8_t(std::lrint(values[i] / scale));
+
+    for (uint i = n; i < n_padded; ++ i)
+        q[i] = 0;
+
+    return scale;
+}
+
+
+#ifdef INT8_AVX2_KERNELS
+// Quantize non-negative values to [0, 127], returning scale. Count should be multiple of 16, values aligned
+inline float quantize_u7(const float * values, uint n, uint8_t * q) {
+    __m256 ymm_max = _mm256_setzero_ps();
+
+    for (uint i = 0; i < n; i += 8)
+        ymm_max = _mm256_max_ps(ymm_max, _mm256_load_ps(values + i));
+
+    __m128 xmm_max = _mm_max_ps(_mm256_castps256_ps128(ymm_max), _mm256_extractf128_ps(ymm_max, 1));
+    xmm_max = _mm_max_ps(xmm_max, _mm_movehl_ps(xmm_max, xmm_max));
+    xmm_max = _mm_max_ss(xmm_max, _mm_shuffle_ps(xmm_max, xmm_max, 1));
+
+    float max = _mm_cvtss_f32(xmm_max);
+    float scale = max > 0 ? max / 127 : 1;
+
+    __m256 ymm_inv_scale = _mm256_set1_ps(1 / scale);
+    __m256 ymm_zero = _mm256_setzero_ps();
+
+    for (uint i = 0; i < n; i += 16) {
+        __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_max_ps(_mm256_load_ps(values + i), ymm_zero), ymm_inv_scale));
+        __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_max_ps(_mm256_load_ps(values + i + 8), ymm_zero), ymm_inv_scale));
+
+        __m256i ab = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0)); // Restore order after in-lane pack
+
+        _mm_storeu_si128((__m128i *) (q + i), _mm_packus_epi16(_mm256_castsi256_si128(ab), _mm256_extracti128_si256(ab, 1)));
+    }
+
+    return scale;
+}
+#endif
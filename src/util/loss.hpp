@@ -0,0 +1,199 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <cstdint>
+
+#include <immintrin.h>
+
+
+// Fast exp of 8 floats: 2^n * exp(r) with |r| <= ln(2)/2 and polynomial for exp(r), relative error below 1e-6.
+// Arguments are clamped to [-87, 88], so results stay finite and normal
+inline __m256 exp_ps(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_set1_ps(88.0f));
+
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+
+    // Reduce argument with ln(2) split into exact high and low parts
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+    __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(scale));
+}
+
+
+// Fast log(1 + x) of 8 floats in [0, 1]: 2 atanh(s) series with s = x / (2 + x) <= 1/3, relative error below 1e-6
+// without cancellation for small x
+inline __m256 log1p_ps(__m256 x) {
+    __m256 s = _mm256_div_ps(x, _mm256_add_ps(x, _mm256_set1_ps(2.0f)));
+    __m256 s2 = _mm256_mul_ps(s, s);
+
+    __m256 p = _mm256_set1_ps(2.0f / 13);
+    p = _mm256_fmadd_ps(p, s2, _mm256_set1_ps(2.0f / 11));
+    p = _mm256_fmadd_ps(p, s2, _mm256_set1_ps(2.0f / 9));
+    p = _mm256_fmadd_ps(p, s2, _mm256_set1_ps(2.0f / 7));
+    p = _mm256_fmadd_ps(p, s2, _mm256_set1_ps(2.0f / 5));
+    p = _mm256_fmadd_ps(p, s2, _mm256_set1_ps(2.0f / 3));
+    p = _mm256_fmadd_ps(p, s2, _mm256_set1_ps(2.0f));
+
+    return _mm256_mul_ps(p, s);
+}
+
+
+inline __m256 abs_ps(__m256 x) {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+}
+
+
+// Losses of score t for label y (-1 or 1): value, derivative by t and model output of score.
+// New loss only needs these three functions to use batch kernels of simd_loss below
+
+// Log loss of sigmoid probability, in stable forms: loss = max(-yt, 0) + log1p(exp(-|yt|)),
+// sigmoid(-yt) is e / (1 + e) or 1 / (1 + e) with e = exp(-|yt|) depending on sign of yt
+struct logistic_loss {
+    static inline __m256 value(__m256 y, __m256 t) {
+        __m256 z = _mm256_mul_ps(y, t);
+
+        return _mm256_add_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_setzero_ps(), z), _mm256_setzero_ps()), log1p_ps(exp_ps(_mm256_sub_ps(_mm256_setzero_ps(), abs_ps(z)))));
+    }
+
+    static inline __m256 gradient(__m256 y, __m256 t) {
+        __m256 z = _mm256_mul_ps(y, t);
+        __m256 e = exp_ps(_mm256_sub_ps(_mm256_setzero_ps(), abs_ps(z)));
+
+        __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(e, _mm256_set1_ps(1.0f)));
+        __m256 sigmoid_nz = _mm256_blendv_ps(inv, _mm256_mul_ps(e, inv), _mm256_cmp_ps(z, _mm256_setzero_ps(), _CMP_GE_OQ));
+
+        return _mm256_sub_ps(_mm256_setzero_ps(), _mm256_mul_ps(y, sigmoid_nz));
+    }
+
+    // Probability of positive label
+    static inline __m256 output(__m256 t) {
+        __m256 e = exp_ps(_mm256_sub_ps(_mm256_setzero_ps(), abs_ps(t)));
+
+        __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(e, _mm256_set1_ps(1.0f)));
+
+        return _mm256_blendv_ps(_mm256_mul_ps(e, inv), inv, _mm256_cmp_ps(t, _mm256_setzero_ps(), _CMP_GE_OQ));
+    }
+};
+
+
+struct squared_loss {
+    static inline __m256 value(__m256 y, __m256 t) {
+        __m256 d = _mm256_sub_ps(t, y);
+
+        return _mm256_mul_ps(_mm256_set1_ps(0.5f), _mm256_mul_ps(d, d));
+    }
+
+    static inline __m256 gradient(__m256 y, __m256 t) {
+        return _mm256_sub_ps(t, y);
+    }
+
+    static inline __m256 output(__m256 t) {
+        return t;
+    }
+};
+
+
+struct hinge_loss {
+    static inline __m256 value(__m256 y, __m256 t) {
+        return _mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(y, t)), _mm256_setzero_ps());
+    }
+
+    static inline __m256 gradient(__m256 y, __m256 t) {
+        __m256 active = _mm256_cmp_ps(_mm256_mul_ps(y, t), _mm256_set1_ps(1.0f), _CMP_LT_OQ);
+
+        return _mm256_and_ps(active, _mm256_sub_ps(_mm256_setzero_ps(), y));
+    }
+
+    static inline __m256 output(__m256 t) {
+        return t;
+    }
+};
+
+
+// Loss chosen at runtime, computing values and outputs for arrays of examples
+class loss_function {
+public:
+    virtual ~loss_function() {}
+
+    // Derivative of loss by score of single example, as it's needed right after its prediction
+    virtual float gradient(float y, float t) const = 0;
+
+    // Sum of losses of n examples
+    virtual double total(const float * y, const float * t, uint64_t n) const = 0;
+
+    // Model outputs of n scores: probabilities for logistic loss, scores themselves for others
+    virtual void outputs(const float * t, float * out, uint64_t n) const = 0;
+};
+
+
+template <typename L>
+class simd_loss : public loss_function {
+    // Mask of first n (at most 8) lanes
+    static inline __m256i tail_mask(uint64_t n) {
+        return _mm256_cmpgt_epi32(_mm256_set1_epi32(int(n)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    }
+public:
+    virtual float gradient(float y, float t) const {
+        return _mm256_cvtss_f32(L::gradient(_mm256_set1_ps(y), _mm256_set1_ps(t)));
+    }
+
+    virtual double total(const float * y, const float * t, uint64_t n) const {
+        __m256d ymm_total = _mm256_setzero_pd(); // Sum in double, as batches are long
+
+        for (uint64_t i = 0; i < n; i += 8) {
+            __m256 v;
+
+            if (i + 8 <= n) {
+                v = L::value(_mm256_loadu_ps(y + i), _mm256_loadu_ps(t + i));
+            } else {
+                __m256i mask = tail_mask(n - i);
+                v = _mm256_and_ps(_mm256_castsi256_ps(mask), L::value(_mm256_maskload_ps(y + i, mask), _mm256_maskload_ps(t + i, mask)));
+            }
+
+            ymm_total = _mm256_add_pd(ymm_total, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1))));
+        }
+
+        alignas(32) double lanes[4];
+        _mm256_store_pd(lanes, ymm_total);
+
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    virtual void outputs(const float * t, float * out, uint64_t n) const {
+        for (uint64_t i = 0; i < n; i += 8) {
+            if (i + 8 <= n) {
+                _mm256_storeu_ps(out + i, L::output(_mm256_loadu_ps(t + i)));
+            } else {
+                __m256i mask = tail_mask(n - i);
+                _mm256_maskstore_ps(out + i, mask, L::output(_mm256_maskload_ps(t + i, mask)));
+            }
+        }
+    }
+};
+
+
+inline std::unique_ptr<loss_function> create_loss(const std::string & name) {
+    if (name == "logistic")
+        return std::unique_ptr<loss_function>(new simd_loss<logistic_loss>());
+
+    if (name == "squared")
+        return std::unique_ptr<loss_function>(new simd_loss<squared_loss>());
+
+    if (name == "hinge")
+        return std::unique_ptr<loss_function>(new simd_loss<hinge_loss>());
+
+    throw std::runtime_error("Unknown loss " + name + ", supported losses: logistic, squared, hinge");
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// Read-only memory mapping of whole file
+class mapped_file {
+    void * ptr;
+    size_t file_size;
+public:
+    mapped_file(const std::string & file_name, int advice = MADV_NORMAL): ptr(nullptr), file_size(0) {
+        using namespace std;
+
+        int fd = open(file_name.c_str(), O_RDONLY);
+
+        if (fd < 0)
+            throw runtime_error(string("Can't open file ") + file_name);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw runtime_error(string("Can't stat file ") + file_name);
+        }
+
+        file_size = st.st_size;
+
+        if (file_size > 0) {
+            ptr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+
+            if (ptr == MAP_FAILED) {
+                close(fd);
+                throw runtime_error(string("Can't map file ") + file_name);
+            }
+
+            madvise(ptr, file_size, advice);
+        }
+
+        close(fd);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file & operator = (const mapped_file &) = delete;
+
+    ~mapped_file() {
+        if (ptr != nullptr)
+            munmap(ptr, file_size);
+    }
+
+    template <typename T>
+    const T * data() const {
+        return (const T *) ptr;
+    }
+
+    size_t size() const {
+        return file_size;
+    }
+};
@@ -71,11 +71,6 @@ inline void fill_with_ones(T * weights, size_t n) {
 }
 
 
-inline uint test_mask_bit(uint64_t * mask, uint i) {
-    return (mask[i >> 6] >> (i & 63)) & 1;
-}
-
-
 template <typename T>
 inline T min(T a, T b) {
     return a < b ? a : b;
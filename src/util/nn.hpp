@@ -1,21 +1,25 @@
 #pragma once
 
 
-inline void backward_pass(uint input_size, float * input, float * input_grad, float * w, float * wg, float grad, float eta, float lambda) {
-    __m256 ymm_eta = _mm256_set1_ps(eta);
+// Weights row w is followed by optimizer state vectors of input_size values. Weights (with optimizer state
+// derived from them) are multiplied by decay before update, catching up l2 regularization of updates which skipped the row
+template <typename O>
+inline void backward_pass(const O & opt, uint input_size, float * input, float * input_grad, float * w, float grad, float lambda, float decay = 1) {
     __m256 ymm_lambda = _mm256_set1_ps(lambda);
     __m256 ymm_grad = _mm256_set1_ps(grad);
+    __m256 ymm_decay = _mm256_set1_ps(decay);
 
     for (uint i = 0; i < input_size; i += 8) {
+        if (decay != 1)
+            opt.decay(w + i, ymm_decay, input_size);
+
         __m256 ymm_w = _mm256_load_ps(w + i);
 
         __m256 ymm_g = ymm_lambda * ymm_w + ymm_grad * _mm256_load_ps(input + i);
-        __m256 ymm_wg = _mm256_load_ps(wg + i) + ymm_g * ymm_g;
 
         _mm256_store_ps(input_grad + i, ymm_grad * ymm_w + _mm256_load_ps(input_grad + i));
 
-        _mm256_store_ps(w + i, ymm_w - ymm_eta * ymm_g * _mm256_rsqrt_ps(ymm_wg));
-        _mm256_store_ps(wg + i, ymm_wg);
+        opt.update(w + i, ymm_w, ymm_g, input_size);
     }
 }
 
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <string>
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
+
+#include <immintrin.h>
+
+
+// Weight update rules, passed to model kernels as template parameter so updates stay fused with gradient computation.
+//
+// Optimizer state of weight is kept in n_state slots following it at multiples of stride floats: in ffm rows
+// state vectors go right after weight vectors, in linear weights and bias state values go right after weight.
+// Kernels compute gradient (including l2 term) of loaded weights and pass it to update, which stores new
+// weights and state. Optimizer object is made for each example, so it may depend on update step (counted only
+// if uses_step is set, as shared counter is contended by all training threads), init sets initial state of
+// initialized weight, decay multiplies weights by given factor (catching up skipped l2 regularization) keeping
+// state consistent with them.
+
+struct adagrad_optimizer {
+    static constexpr uint n_state = 1; // Sum of squared gradients
+    static constexpr bool uses_step = false;
+
+    float eta;
+    __m256 ymm_eta;
+
+    adagrad_optimizer(float eta, float l1, uint64_t step): eta(eta), ymm_eta(_mm256_set1_ps(eta)) {}
+
+    void init(float * w, uint stride) const {
+        w[stride] = 1;
+    }
+
+    inline void decay(float * w, __m256 ymm_decay, uint stride) const {
+        _mm256_store_ps(w, _mm256_mul_ps(_mm256_load_ps(w), ymm_decay));
+    }
+
+    inline void decay(float * w, float d, uint stride) const {
+        w[0] *= d;
+    }
+
+    inline void update(float * w, __m256 ymm_w, __m256 ymm_g, uint stride) const {
+        __m256 ymm_wg = _mm256_add_ps(_mm256_load_ps(w + stride), _mm256_mul_ps(ymm_g, ymm_g));
+
+        _mm256_store_ps(w, _mm256_sub_ps(ymm_w, _mm256_mul_ps(ymm_eta, _mm256_mul_ps(_mm256_rsqrt_ps(ymm_wg), ymm_g))));
+        _mm256_store_ps(w + stride, ymm_wg);
+    }
+
+    inline void update(float * w, float g, uint stride) const {
+        float wg = w[stride] + g*g;
+
+        w[0] -= eta * g / std::sqrt(wg);
+        w[stride] = wg;
+    }
+};
+
+
+// FTRL-proximal with alpha = eta, beta = 1 and l1 regularization, weights are kept explicitly next to z and n,
+// so predictions read them as with other optimizers
+struct ftrl_optimizer {
+    static constexpr uint n_state = 2; // z and sum of squared gradients n
+    static constexpr bool uses_step = false;
+
+    static constexpr float beta = 1;
+
+    float alpha, l1;
+    __m256 ymm_inv_alpha, ymm_alpha, ymm_l1;
+
+    ftrl_optimizer(float eta, float l1, uint64_t step): alpha(eta), l1(l1), ymm_inv_alpha(_mm256_set1_ps(1 / eta)), ymm_alpha(_mm256_set1_ps(eta)), ymm_l1(_mm256_set1_ps(l1)) {}
+
+    // Start from initial weight: z giving it back with n = 0
+    void init(float * w, uint stride) const {
+        w[stride] = w[0] != 0 ? -(w[0] * beta / alpha + std::copysign(l1, w[0])) : 0;
+        w[2 * stride] = 0;
+    }
+
+    // Weight is recomputed from z on update, so z is scaled with it: z - sign(z) l1 of active weights is
+    // multiplied by decay, inactive (zero) weights are left as is
+    inline void decay(float * w, __m256 ymm_decay, uint stride) const {
+        __m256 ymm_z = _mm256_load_ps(w + stride);
+
+        __m256 ymm_sign_l1 = _mm256_or_ps(ymm_l1, _mm256_and_ps(ymm_z, _mm256_set1_ps(-0.0f)));
+        __m256 ymm_active = _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), ymm_z), ymm_l1, _CMP_GT_OQ);
+
+        __m256 ymm_new_z = _mm256_fmadd_ps(_mm256_sub_ps(ymm_z, ymm_sign_l1), ymm_decay, ymm_sign_l1);
+
+        _mm256_store_ps(w, _mm256_mul_ps(_mm256_load_ps(w), ymm_decay));
+        _mm256_store_ps(w + stride, _mm256_blendv_ps(ymm_z, ymm_new_z, ymm_active));
+    }
+
+    inline void decay(float * w, float d, uint stride) const {
+        float z = w[stride];
+
+        w[0] *= d;
+        w[stride] = std::abs(z) > l1 ? (z - std::copysign(l1, z)) * d + std::copysign(l1, z) : z;
+    }
+
+    inline void update(float * w, __m256 ymm_w, __m256 ymm_g, uint stride) const {
+        __m256 ymm_n = _mm256_load_ps(w + 2 * stride);
+        __m256 ymm_new_n = _mm256_add_ps(ymm_n, _mm256_mul_ps(ymm_g, ymm_g));
+
+        __m256 ymm_sqrt_n = _mm256_sqrt_ps(ymm_n);
+        __m256 ymm_sqrt_new_n = _mm256_sqrt_ps(ymm_new_n);
+
+        __m256 ymm_sigma = _mm256_mul_ps(_mm256_sub_ps(ymm_sqrt_new_n, ymm_sqrt_n), ymm_inv_alpha);
+        __m256 ymm_z = _mm256_add_ps(_mm256_load_ps(w + stride), _mm256_fnmadd_ps(ymm_sigma, ymm_w, ymm_g));
+
+        // w = -(z - sign(z) l1) * alpha / (beta + sqrt(n)) if |z| > l1, otherwise 0
+        __m256 ymm_sign = _mm256_and_ps(ymm_z, _mm256_set1_ps(-0.0f));
+        __m256 ymm_shrunk = _mm256_sub_ps(ymm_z, _mm256_or_ps(ymm_l1, ymm_sign));
+        __m256 ymm_active = _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), ymm_z), ymm_l1, _CMP_GT_OQ);
+
+        __m256 ymm_new_w = _mm256_div_ps(_mm256_mul_ps(ymm_shrunk, ymm_alpha), _mm256_add_ps(_mm256_set1_ps(beta), ymm_sqrt_new_n));
+
+        _mm256_store_ps(w, _mm256_and_ps(ymm_active, _mm256_sub_ps(_mm256_setzero_ps(), ymm_new_w)));
+        _mm256_store_ps(w + stride, ymm_z);
+        _mm256_store_ps(w + 2 * stride, ymm_new_n);
+    }
+
+    inline void update(float * w, float g, uint stride) const {
+        float n = w[2 * stride], new_n = n + g*g;
+        float z = w[stride] + g - (std::sqrt(new_n) - std::sqrt(n)) / alpha * w[0];
+
+        w[0] = std::abs(z) > l1 ? -(z - std::copysign(l1, z)) * alpha / (beta + std::sqrt(new_n)) : 0;
+        w[stride] = z;
+        w[2 * stride] = new_n;
+    }
+};
+
+
+// Lazy (sparse) Adam: moments are updated only for weights of example, bias correction uses global update step.
+// Moments of weights getting zero gradients for long (like inputs of dead relu units) decay to denormals, which
+// are very slow to compute with, so they are flushed to zero below min_moment
+struct adam_optimizer {
+    static constexpr uint n_state = 2; // First and second moments
+    static constexpr bool uses_step = true;
+
+    static constexpr float beta1 = 0.9f, beta2 = 0.999f, epsilon = 1e-8f, min_moment = 1e-30f;
+
+    float rate; // Learning rate with bias correction of step
+    __m256 ymm_rate;
+
+    adam_optimizer(float eta, float l1, uint64_t step): rate(eta * std::sqrt(1 - std::pow(double(beta2), double(step + 1))) / (1 - std::pow(double(beta1), double(step + 1)))), ymm_rate(_mm256_set1_ps(rate)) {}
+
+    void init(float * w, uint stride) const {
+        w[stride] = 0;
+        w[2 * stride] = 0;
+    }
+
+    inline void decay(float * w, __m256 ymm_decay, uint stride) const {
+        _mm256_store_ps(w, _mm256_mul_ps(_mm256_load_ps(w), ymm_decay));
+    }
+
+    inline void decay(float * w, float d, uint stride) const {
+        w[0] *= d;
+    }
+
+    inline void update(float * w, __m256 ymm_w, __m256 ymm_g, uint stride) const {
+        __m256 ymm_m = _mm256_fmadd_ps(_mm256_set1_ps(beta1), _mm256_load_ps(w + stride), _mm256_mul_ps(_mm256_set1_ps(1 - beta1), ymm_g));
+        __m256 ymm_v = _mm256_fmadd_ps(_mm256_set1_ps(beta2), _mm256_load_ps(w + 2 * stride), _mm256_mul_ps(_mm256_set1_ps(1 - beta2), _mm256_mul_ps(ymm_g, ymm_g)));
+
+        ymm_m = _mm256_and_ps(ymm_m, _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), ymm_m), _mm256_set1_ps(min_moment), _CMP_GE_OQ));
+        ymm_v = _mm256_and_ps(ymm_v, _mm256_cmp_ps(ymm_v, _mm256_set1_ps(min_moment), _CMP_GE_OQ));
+
+        __m256 ymm_step = _mm256_div_ps(_mm256_mul_ps(ymm_rate, ymm_m), _mm256_add_ps(_mm256_sqrt_ps(ymm_v), _mm256_set1_ps(epsilon)));
+
+        _mm256_store_ps(w, _mm256_sub_ps(ymm_w, ymm_step));
+        _mm256_store_ps(w + stride, ymm_m);
+        _mm256_store_ps(w + 2 * stride, ymm_v);
+    }
+
+    inline void update(float * w, float g, uint stride) const {
+        float m = beta1 * w[stride] + (1 - beta1) * g;
+        float v = beta2 * w[2 * stride] + (1 - beta2) * g*g;
+
+        m = std::abs(m) >= min_moment ? m : 0;
+        v = v >= min_moment ? v : 0;
+
+        w[0] -= rate * m / (std::sqrt(v) + epsilon);
+        w[stride] = m;
+        w[2 * stride] = v;
+    }
+};
+
+
+// Number of state slots of named optimizer, checking it's supported
+inline uint optimizer_state_size(const std::string & name) {
+    if (name == "adagrad")
+        return adagrad_optimizer::n_state;
+
+    if (name == "ftrl")
+        return ftrl_optimizer::n_state;
+
+    if (name == "adam")
+        return adam_optimizer::n_state;
+
+    throw std::runtime_error("Unknown optimizer " + name + ", supported optimizers: adagrad, ftrl, adam");
+}
+
+
+// Check options of named optimizer, l1 regularization is applied only by ftrl
+inline void check_optimizer_options(const std::string & name, float l1) {
+    if (l1 != 0 && name != "ftrl")
+        throw std::runtime_error("L1 regularization is supported only by ftrl optimizer");
+}
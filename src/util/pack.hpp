@@ -0,0 +1,293 @@
+#pragma once
+
+#include <batch_learn.hpp>
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+// Value statistics of field, used to choose its encoding
+struct field_value_stats {
+    uint64_t n_values = 0;
+    bool all_one = true; // All values are 1.0
+    bool all_byte = true; // All values are integers in [0, 255]
+    bool all_half = true; // All values are exactly representable in fp16
+    bool all_non_negative = true;
+    float max_abs = 0;
+
+    void add(float v) {
+        using namespace batch_learn;
+
+        n_values ++;
+        all_one &= (v == 1.0f);
+        all_byte &= (v >= 0 && v <= 255 && v == std::floor(v));
+        all_half &= (half_to_float(float_to_half(v)) == v);
+        all_non_negative &= (v >= 0);
+        max_abs = std::max(max_abs, std::fabs(v));
+    }
+
+    void merge(const field_value_stats & other) {
+        n_values += other.n_values;
+        all_one &= other.all_one;
+        all_byte &= other.all_byte;
+        all_half &= other.all_half;
+        all_non_negative &= other.all_non_negative;
+        max_abs = std::max(max_abs, other.max_abs);
+    }
+
+    // Choose most compact encoding, lossless one unless lossy allowed
+    void choose_encoding(bool lossy, uint8_t & encoding, float & scale) const {
+        using namespace batch_learn;
+
+        scale = 1.0f;
+
+        if (n_values == 0 || all_one)
+            encoding = value_one;
+        else if (all_byte)
+            encoding = value_u8;
+        else if (all_half)
+            encoding = value_fp16;
+        else if (lossy && all_non_negative && std::isfinite(max_abs)) {
+            encoding = value_u8;
+            scale = max_abs / 255;
+        } else if (lossy && max_abs <= 65504.0f)
+            encoding = value_fp16;
+        else
+            encoding = value_float;
+    }
+};
+
+
+// Sequential reader of data file, verifying checksums block by block
+class checked_data_reader {
+    FILE * file;
+    FILE * checksums_file; // Index file positioned at checksums section, null if data isn't checksummed
+    std::vector<char> block;
+    size_t block_size;
+    size_t block_pos;
+    uint64_t block_no;
+public:
+    checked_data_reader(const std::string & file_name, const std::string & index_file_name, long checksums_offset, uint32_t checksum_block_size):
+        file(nullptr), checksums_file(nullptr), block_size(checksum_block_size > 0 ? checksum_block_size : 1024 * 1024), block_pos(0), block_no(0) {
+
+        using namespace std;
+
+        file = fopen(file_name.c_str(), "rb");
+
+        if (file == nullptr)
+            throw runtime_error("Can't open data file " + file_name);
+
+        if (checksum_block_size > 0) {
+            checksums_file = fopen(index_file_name.c_str(), "rb");
+
+            if (checksums_file == nullptr || fseek(checksums_file, checksums_offset, SEEK_SET) != 0) {
+                close();
+                throw runtime_error("Can't open index file " + index_file_name);
+            }
+        }
+    }
+
+    checked_data_reader(const checked_data_reader &) = delete;
+    checked_data_reader & operator = (const checked_data_reader &) = delete;
+
+    ~checked_data_reader() {
+        close();
+    }
+
+    void read(void * data, size_t size) {
+        char * out = (char *) data;
+
+        while (size > 0) {
+            if (block_pos == block.size())
+                next_block();
+
+            size_t chunk = std::min(size, block.size() - block_pos);
+
+            memcpy(out, block.data() + block_pos, chunk);
+            block_pos += chunk;
+            out += chunk;
+            size -= chunk;
+        }
+    }
+private:
+    void next_block() {
+        using namespace std;
+
+        block.resize(block_size);
+        block.resize(fread(block.data(), 1, block_size, file));
+
+        if (block.empty())
+            throw runtime_error("Data file is truncated");
+
+        if (checksums_file != nullptr) { // Last block is shorter, truncated one doesn't match its checksum
+            uint32_t checksum;
+
+            if (fread(&checksum, sizeof(uint32_t), 1, checksums_file) != 1)
+                throw runtime_error("Error reading checksums");
+
+            if (batch_learn::crc32c(0, block.data(), block.size()) != checksum)
+                throw runtime_error("Checksum mismatch in data block " + to_string(block_no) + ", data file is corrupted");
+        }
+
+        block_pos = 0;
+        block_no ++;
+    }
+
+    void close() {
+        if (file != nullptr)
+            fclose(file);
+
+        if (checksums_file != nullptr)
+            fclose(checksums_file);
+
+        file = checksums_file = nullptr;
+    }
+};
+
+
+// Replace dataset files with packed ones: index is replaced last, only after data, and originals are restored
+// if any rename fails, so dataset never consists of files of different generations
+inline void replace_dataset(const std::string & file_name, const std::string & packed_file_name) {
+    using namespace std;
+
+    string backup_file_name = file_name + ".unpacked";
+
+    auto move = [](const string & from, const string & to) { return rename(from.c_str(), to.c_str()) == 0; };
+    auto fail = [&]() { throw runtime_error("Can't replace dataset " + file_name + " with packed one"); };
+
+    if (!move(file_name + ".index", backup_file_name + ".index"))
+        fail();
+
+    if (!move(file_name + ".data", backup_file_name + ".data")) {
+        move(backup_file_name + ".index", file_name + ".index");
+        fail();
+    }
+
+    if (!move(packed_file_name + ".data", file_name + ".data")) {
+        move(backup_file_name + ".data", file_name + ".data");
+        move(backup_file_name + ".index", file_name + ".index");
+        fail();
+    }
+
+    if (!move(packed_file_name + ".index", file_name + ".index")) {
+        move(file_name + ".data", packed_file_name + ".data");
+        move(backup_file_name + ".data", file_name + ".data");
+        move(backup_file_name + ".index", file_name + ".index");
+        fail();
+    }
+
+    remove((backup_file_name + ".data").c_str());
+    remove((backup_file_name + ".index").c_str());
+}
+
+
+// Rewrite dataset with values packed by encodings chosen from field statistics (collected while dataset was written),
+// returns false if all fields need full floats and dataset is left as is. Index sections and data are streamed,
+// so memory usage doesn't depend on dataset size, but data is read and written once more
+inline bool pack_dataset(const std::string & file_name, std::vector<field_value_stats> stats, bool lossy, bool direct_io) {
+    using namespace std;
+    using namespace batch_learn;
+
+    string index_file_name = file_name + ".index";
+
+    // Index sections are read sequentially by separate streams positioned at their starts
+    FILE * labels_file = fopen(index_file_name.c_str(), "rb");
+    FILE * offsets_file = fopen(index_file_name.c_str(), "rb");
+    FILE * groups_file = fopen(index_file_name.c_str(), "rb");
+
+    auto close_index = [&]() {
+        for (FILE * f : { labels_file, offsets_file, groups_file })
+            if (f != nullptr)
+                fclose(f);
+    };
+
+    string packed_file_name = file_name + ".packed";
+
+    try {
+        if (labels_file == nullptr || offsets_file == nullptr || groups_file == nullptr)
+            throw runtime_error("Can't open index file " + index_file_name);
+
+        file_index index;
+        uint64_t n_checksums;
+        uint32_t n_encoded_fields;
+
+        read_index_header(labels_file, index, n_checksums, n_encoded_fields);
+
+        if (n_encoded_fields > 0)
+            throw runtime_error("Dataset " + file_name + " is already packed");
+
+        stats.resize(index.n_fields);
+
+        vector<uint8_t> encodings(index.n_fields);
+        vector<float> scales(index.n_fields);
+
+        for (uint32_t field = 0; field < index.n_fields; ++ field)
+            stats[field].choose_encoding(lossy, encodings[field], scales[field]);
+
+        if (all_of(encodings.begin(), encodings.end(), [](uint8_t e) { return e == value_float; })) {
+            close_index();
+            return false;
+        }
+
+        long labels_offset = ftell(labels_file);
+        long offsets_offset = labels_offset + index.n_examples * sizeof(float);
+        long groups_offset = offsets_offset + (index.n_examples + 1) * sizeof(uint64_t);
+        long checksums_offset = groups_offset + index.n_examples * sizeof(uint64_t);
+
+        if (fseek(offsets_file, offsets_offset, SEEK_SET) != 0 || fseek(groups_file, groups_offset, SEEK_SET) != 0)
+            throw runtime_error("Error reading index");
+
+        checked_data_reader data_reader(file_name + ".data", index_file_name, checksums_offset, index.checksum_block_size);
+
+        // Write packed dataset sequentially and replace original one
+        try {
+            stream_data_writer data_writer(packed_file_name + ".data", direct_io, index.n_index_bits, encodings, scales);
+            stream_index_writer index_writer(packed_file_name + ".index");
+
+            vector<feature> features;
+            uint64_t offset, next_offset, group;
+            float label;
+
+            if (fread(&offset, sizeof(uint64_t), 1, offsets_file) != 1)
+                throw runtime_error("Error reading offsets");
+
+            for (uint64_t ei = 0; ei < index.n_examples; ++ ei) {
+                if (fread(&label, sizeof(float), 1, labels_file) != 1)
+                    throw runtime_error("Error reading labels");
+
+                if (fread(&next_offset, sizeof(uint64_t), 1, offsets_file) != 1 || next_offset < offset)
+                    throw runtime_error("Error reading offsets");
+
+                if (fread(&group, sizeof(uint64_t), 1, groups_file) != 1)
+                    throw runtime_error("Error reading groups");
+
+                features.resize(next_offset - offset);
+                data_reader.read(features.data(), features.size() * sizeof(feature));
+
+                data_writer.write(features);
+                index_writer.write(label, group, data_writer);
+
+                offset = next_offset;
+            }
+
+            data_writer.close();
+            index_writer.finish(data_writer, index.n_fields, index.n_indices, index.n_index_bits);
+        } catch (...) {
+            remove((packed_file_name + ".data").c_str());
+            remove((packed_file_name + ".index").c_str());
+            throw;
+        }
+    } catch (...) {
+        close_index();
+        throw;
+    }
+
+    close_index();
+
+    replace_dataset(file_name, packed_file_name);
+
+    return true;
+}
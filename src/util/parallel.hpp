@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+
+
+// Error of code run by OpenMP threads (or other threads). Exceptions can't leave parallel regions, so work
+// in the region is run through run, which captures exception of it, and error is rethrown after the region.
+// First captured error is kept, occurred may be checked in the region to stop early.
+class parallel_error {
+    std::mutex mutex;
+    std::atomic<bool> failed;
+    std::string message;
+public:
+    parallel_error(): failed(false) {}
+
+    // Call function, capturing its exception, returns whether it succeeded
+    template <typename F>
+    bool run(F f) {
+        try {
+            f();
+            return true;
+        } catch (std::exception & e) {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!failed.exchange(true))
+                message = e.what();
+
+            return false;
+        }
+    }
+
+    bool occurred() const {
+        return failed.load(std::memory_order_relaxed);
+    }
+
+    // Message of captured error, should be read after threads are joined
+    const std::string & what() const {
+        return message;
+    }
+
+    void rethrow() const {
+        if (occurred())
+            throw std::runtime_error(message);
+    }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+
+// Blocking queue with limited capacity, producers wait when it's full
+template <typename T>
+class bounded_queue {
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+public:
+    bounded_queue(size_t capacity): capacity(capacity), closed(false) {}
+
+    void push(T && item) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+
+        if (closed)
+            return;
+
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    // Wait for next item, return false if queue is closed and drained
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+
+        if (items.empty())
+            return false;
+
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+
+        return true;
+    }
+
+    // No more items will be pushed, waiting consumers are released when queue is drained
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+
+// Lock-free queue of one producer and one consumer thread over ring buffer. Items are pushed in groups,
+// consumer looks at available items in place and pops them when done, so empty queue means all are processed
+template <typename T>
+class spsc_queue {
+    std::vector<T> ring;
+    size_t mask;
+
+    std::atomic<size_t> head; // Next position to write, changed by producer
+    char padding[64]; // Keep positions in separate cache lines
+    std::atomic<size_t> tail; // Next position to read, changed by consumer
+public:
+    spsc_queue(size_t capacity): head(0), tail(0) {
+        size_t size = 1;
+
+        while (size < capacity)
+            size <<= 1;
+
+        ring.resize(size);
+        mask = size - 1;
+    }
+
+    size_t capacity() const {
+        return ring.size();
+    }
+
+    // Push all items or nothing if there is no space
+    bool try_push(const T * items, size_t n) {
+        size_t h = head.load(std::memory_order_relaxed);
+
+        if (h + n - tail.load(std::memory_order_acquire) > ring.size())
+            return false;
+
+        for (size_t i = 0; i < n; ++ i)
+            ring[(h + i) & mask] = items[i];
+
+        head.store(h + n, std::memory_order_release);
+
+        return true;
+    }
+
+    // Number of items available to consumer
+    size_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    // I-th available item
+    const T & operator [] (size_t i) const {
+        return ring[(tail.load(std::memory_order_relaxed) + i) & mask];
+    }
+
+    void pop(size_t n) {
+        tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+};
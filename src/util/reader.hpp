@@ -0,0 +1,510 @@
+#pragma once
+
+#include "mmap.hpp"
+#include "uring.hpp"
+
+#include <batch_learn.hpp>
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+typedef std::vector<std::pair<uint64_t, uint64_t>> byte_ranges;
+
+
+// Reader of example batches from data file, batches are identified by their number in started batch list.
+// Readers read raw data byte ranges, common part verifies checksums and decodes packed values.
+class batch_reader {
+protected:
+    const batch_learn::file_index & index;
+    bool verify; // Verify data checksums
+
+    std::vector<std::pair<uint64_t, uint64_t>> batches;
+    byte_ranges ranges; // Data byte ranges of batches, extended to checksum blocks when verifying
+public:
+    batch_reader(const batch_learn::file_index & index, bool verify): index(index), verify(verify && index.checksum_block_size > 0) {}
+
+    virtual ~batch_reader() {}
+
+    // Prepare to read given example batches, usually in given order, so reader may read ahead
+    virtual void start(const std::vector<std::pair<uint64_t, uint64_t>> & batches) {
+        this->batches = batches;
+
+        ranges.clear();
+        for (auto & b : batches) {
+            auto range = std::make_pair(index.data_offset(b.first), index.data_offset(b.second));
+
+            ranges.push_back(verify ? batch_learn::checksum_range(index, range.first, range.second) : range);
+        }
+    }
+
+    // Read features of i-th batch, may be called concurrently
+    void read(size_t i, std::vector<batch_learn::feature> & features) {
+        using batch_learn::feature;
+
+        uint64_t from = ranges[i].first, to = ranges[i].second;
+        uint64_t skip = index.data_offset(batches[i].first) - from; // Checksum block part before batch data
+        uint64_t n_features = index.offsets[batches[i].second] - index.offsets[batches[i].first];
+
+        if (!index.packed()) { // Read features in place
+            features.resize((to - from) / sizeof(feature));
+            read_range(i, (char *) features.data());
+
+            if (verify)
+                batch_learn::verify_checksums(index, from, to, (const char *) features.data());
+
+            if (skip > 0)
+                features.erase(features.begin(), features.begin() + skip / sizeof(feature));
+
+            features.resize(n_features);
+        } else {
+            thread_local std::vector<char> buffer;
+
+            buffer.resize(to - from);
+            read_range(i, buffer.data());
+
+            if (verify)
+                batch_learn::verify_checksums(index, from, to, buffer.data());
+
+            features.resize(n_features);
+            batch_learn::decode_features(index, batches[i].first, batches[i].second, buffer.data() + skip, features.data());
+        }
+    }
+
+    // Hint that i-th batch will be read soon, so reader may start reading it in background
+    virtual void prefetch(size_t i) {}
+protected:
+    // Read data of i-th range into buffer
+    virtual void read_range(size_t i, char * buffer) = 0;
+
+    void check_range(size_t i, uint64_t file_size) {
+        if (ranges[i].second < ranges[i].first || ranges[i].second > file_size)
+            throw std::runtime_error("Data file is truncated");
+    }
+};
+
+
+// Reader using regular reads through page cache
+class buffered_batch_reader : public batch_reader {
+    int fd;
+    uint64_t file_size;
+public:
+    buffered_batch_reader(const std::string & file_name, const batch_learn::file_index & index, bool verify): batch_reader(index, verify) {
+        fd = open(file_name.c_str(), O_RDONLY);
+
+        if (fd < 0)
+            throw std::runtime_error(std::string("Can't open data file ") + file_name);
+
+        file_size = lseek(fd, 0, SEEK_END);
+    }
+
+    virtual ~buffered_batch_reader() {
+        close(fd);
+    }
+
+    virtual void prefetch(size_t i) {
+        posix_fadvise(fd, ranges[i].first, ranges[i].second - ranges[i].first, POSIX_FADV_WILLNEED);
+    }
+protected:
+    virtual void read_range(size_t i, char * buffer) {
+        check_range(i, file_size);
+
+        uint64_t offset = ranges[i].first, size = ranges[i].second - ranges[i].first;
+
+        while (size > 0) {
+            ssize_t res = pread(fd, buffer, size, offset);
+
+            if (res < 0 && errno == EINTR)
+                continue;
+
+            if (res <= 0)
+                throw std::runtime_error("Error reading data file");
+
+            buffer += res;
+            offset += res;
+            size -= res;
+        }
+    }
+};
+
+
+// Reader copying batches from memory mapped data file
+class mmap_batch_reader : public batch_reader {
+    mapped_file data;
+public:
+    mmap_batch_reader(const std::string & file_name, const batch_learn::file_index & index, bool verify): batch_reader(index, verify), data(file_name) {}
+
+    virtual void prefetch(size_t i) {
+        const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+        if (ranges[i].second > data.size() || ranges[i].second <= ranges[i].first)
+            return;
+
+        uintptr_t begin = uintptr_t(data.data<char>() + ranges[i].first) / page_size * page_size;
+        uintptr_t end = uintptr_t(data.data<char>() + ranges[i].second);
+
+        madvise((void *) begin, end - begin, MADV_WILLNEED);
+    }
+protected:
+    virtual void read_range(size_t i, char * buffer) {
+        check_range(i, data.size());
+
+        memcpy(buffer, data.data<char>() + ranges[i].first, ranges[i].second - ranges[i].first);
+    }
+};
+
+
+// Reader keeping several batch reads in flight with io_uring into registered buffers, optionally with O_DIRECT
+class uring_batch_reader : public batch_reader {
+    struct slot {
+        char * buffer;
+        int64_t batch; // Batch read into slot, -1 if slot is free
+        uint64_t file_offset; // File offset of buffer start
+        uint64_t needed; // Bytes needed from buffer start
+        uint64_t requested; // Bytes requested (aligned for direct IO)
+        uint64_t done;
+        bool complete;
+        int error;
+    };
+
+    int fd;
+    bool direct;
+    uint64_t file_size;
+
+    uring ring;
+    std::vector<slot> slots;
+    uint64_t slot_capacity;
+
+    std::vector<int> batch_slots; // Slot of each batch, -1 if it's not submitted, -2 if it was read synchronously
+    size_t next_submit;
+    bool hinted; // Reads are submitted by prefetch hints instead of going ahead in batch order
+
+    std::mutex mutex;
+    std::condition_variable reaped; // Notified when reaping thread has processed completions
+    bool reaping; // Some thread waits for completions without holding mutex
+public:
+    uring_batch_reader(const std::string & file_name, const batch_learn::file_index & index, bool verify, uint depth, bool direct): batch_reader(index, verify), direct(direct), ring(depth), slots(depth), slot_capacity(0), next_submit(0), hinted(false), reaping(false) {
+        fd = open(file_name.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+
+        if (fd < 0 && direct && errno == EINVAL) { // File system doesn't support direct IO
+            fd = open(file_name.c_str(), O_RDONLY);
+            this->direct = false;
+        }
+
+        if (fd < 0)
+            throw std::runtime_error(std::string("Can't open data file ") + file_name);
+
+        file_size = lseek(fd, 0, SEEK_END);
+
+        for (auto & s : slots) {
+            s.buffer = nullptr;
+            s.batch = -1;
+        }
+    }
+
+    virtual ~uring_batch_reader() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        try {
+            drain(lock);
+        } catch (std::exception & e) {
+            // Nothing to do with failed reads here
+        }
+
+        for (auto & s : slots)
+            free(s.buffer);
+
+        close(fd);
+    }
+
+    virtual void start(const std::vector<std::pair<uint64_t, uint64_t>> & batches) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        drain(lock);
+
+        batch_reader::start(batches);
+
+        batch_slots.assign(ranges.size(), -1);
+        next_submit = 0;
+        hinted = false;
+
+        // Grow slot buffers to fit largest batch
+        uint64_t max_size = 0;
+        for (auto & r : ranges)
+            max_size = std::max(max_size, r.second - r.first);
+
+        max_size = (max_size + 2 * batch_learn::direct_io_align - 1) / batch_learn::direct_io_align * batch_learn::direct_io_align;
+
+        if (max_size > slot_capacity) {
+            std::vector<iovec> iovecs;
+
+            for (auto & s : slots) {
+                free(s.buffer);
+
+                if (posix_memalign((void **) &s.buffer, batch_learn::direct_io_align, max_size) != 0)
+                    throw std::bad_alloc();
+
+                iovecs.push_back(iovec { s.buffer, max_size });
+            }
+
+            ring.register_buffers(iovecs.data(), iovecs.size());
+            slot_capacity = max_size;
+        }
+    }
+
+
+    virtual void prefetch(size_t i) {
+        if (ranges[i].second < ranges[i].first || ranges[i].second > file_size)
+            return; // Reported on read
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        hinted = true;
+
+        if (batch_slots[i] != -1)
+            return;
+
+        for (size_t si = 0; si < slots.size(); ++ si) {
+            if (slots[si].batch < 0) {
+                submit(si, i);
+                ring.submit();
+                break;
+            }
+        }
+    }
+protected:
+    virtual void read_range(size_t i, char * buffer) {
+        check_range(i, file_size);
+
+        uint64_t from = ranges[i].first, to = ranges[i].second;
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        submit_ahead();
+
+        int si = batch_slots[i];
+
+        if (si < 0) { // All slots are busy with other batches, read synchronously
+            batch_slots[i] = -2;
+            lock.unlock();
+            pread_all(buffer, to - from, from);
+            return;
+        }
+
+        // One thread waits for completions at a time, without lock, others wait for it to reap
+        while (!slots[si].complete) {
+            if (reaping) {
+                reaped.wait(lock);
+                continue;
+            }
+
+            reaping = true;
+            ring.submit();
+
+            lock.unlock();
+
+            try {
+                ring.wait();
+            } catch (...) {
+                lock.lock();
+                reaping = false;
+                reaped.notify_all();
+                throw;
+            }
+
+            lock.lock();
+
+            reaping = false;
+            reap();
+            reaped.notify_all();
+        }
+
+        slot & s = slots[si];
+
+        if (s.error != 0) {
+            int error = s.error;
+
+            s.batch = -1;
+            throw std::runtime_error(std::string("Error reading data file: ") + strerror(error));
+        }
+
+        lock.unlock();
+
+        memcpy(buffer, s.buffer + (from - s.file_offset), to - from);
+
+        lock.lock();
+
+        s.batch = -1;
+        submit_ahead();
+    }
+private:
+    // Fill free slots with next batches in order, unless reads are driven by prefetch hints
+    void submit_ahead() {
+        for (size_t si = 0; si < slots.size() && next_submit < ranges.size() && !hinted; ++ si) {
+            if (slots[si].batch >= 0)
+                continue;
+
+            while (next_submit < ranges.size() && batch_slots[next_submit] != -1)
+                next_submit ++;
+
+            if (next_submit == ranges.size())
+                break;
+
+            submit(si, next_submit ++);
+        }
+
+        ring.submit();
+    }
+
+    void submit(size_t si, size_t i) {
+        uint64_t from = ranges[i].first;
+        uint64_t to = ranges[i].second;
+
+        slot & s = slots[si];
+
+        s.batch = i;
+        s.file_offset = direct ? from / batch_learn::direct_io_align * batch_learn::direct_io_align : from;
+        s.needed = to - s.file_offset;
+        s.requested = direct ? (s.needed + batch_learn::direct_io_align - 1) / batch_learn::direct_io_align * batch_learn::direct_io_align : s.needed;
+        s.done = 0;
+        s.complete = (s.needed == 0);
+        s.error = 0;
+
+        batch_slots[i] = si;
+
+        if (!s.complete)
+            ring.prepare_read(fd, s.buffer, s.requested, s.file_offset, si, si);
+    }
+
+    void reap() {
+        uint64_t si;
+        int res;
+
+        while (ring.pop_completion(si, res)) {
+            slot & s = slots[si];
+
+            if (res < 0) {
+                s.error = -res;
+                s.complete = true;
+            } else if (res == 0 && s.done + res < s.needed) {
+                s.error = EIO; // Unexpected end of file
+                s.complete = true;
+            } else {
+                s.done += res;
+
+                if (s.done >= s.needed) {
+                    s.complete = true;
+                } else { // Short read, request the rest
+                    ring.prepare_read(fd, s.buffer + s.done, s.requested - s.done, s.file_offset + s.done, si, si);
+                    ring.submit();
+                }
+            }
+        }
+    }
+
+    // Wait for all submitted reads, buffers can't be released before that
+    void drain(std::unique_lock<std::mutex> & lock) {
+        reaped.wait(lock, [this] { return !reaping; });
+
+        while (true) {
+            bool pending = false;
+
+            for (auto & s : slots)
+                if (s.batch >= 0 && !s.complete)
+                    pending = true;
+
+            if (!pending)
+                break;
+
+            ring.submit(1);
+            reap();
+        }
+
+        for (auto & s : slots)
+            s.batch = -1;
+    }
+
+    void pread_all(char * buffer, uint64_t size, uint64_t offset) {
+        if (!direct) {
+            pread_exact(buffer, size, offset);
+            return;
+        }
+
+        // Direct reads should be aligned, read through aligned bounce buffer to keep bypassing page cache
+        const uint64_t align = batch_learn::direct_io_align;
+        const uint64_t bounce_size = 1024 * 1024;
+
+        char * bounce;
+
+        if (posix_memalign((void **) &bounce, align, bounce_size) != 0)
+            throw std::bad_alloc();
+
+        std::unique_ptr<char, void (*)(void *)> bounce_holder(bounce, free);
+
+        for (uint64_t pos = offset / align * align, end = offset + size; pos < end;) {
+            uint64_t len = std::min(bounce_size, (end - pos + align - 1) / align * align);
+            uint64_t got = pread_some(bounce, len, pos);
+
+            if (got < len && pos + got < end) { // Short read not at end of file, continue from aligned position
+                got = got / align * align;
+
+                if (got == 0)
+                    throw std::runtime_error("Error reading data file");
+            }
+
+            uint64_t copy_from = std::max(pos, offset), copy_to = std::min(pos + got, end);
+
+            memcpy(buffer + (copy_from - offset), bounce + (copy_from - pos), copy_to - copy_from);
+            pos += got;
+        }
+    }
+
+    void pread_exact(char * buffer, uint64_t size, uint64_t offset) {
+        while (size > 0) {
+            uint64_t res = pread_some(buffer, size, offset);
+
+            buffer += res;
+            offset += res;
+            size -= res;
+        }
+    }
+
+    // Read at least one byte, failing at end of file
+    uint64_t pread_some(char * buffer, uint64_t size, uint64_t offset) {
+        while (true) {
+            ssize_t res = pread(fd, buffer, size, offset);
+
+            if (res < 0 && errno == EINTR)
+                continue;
+
+            if (res <= 0)
+                throw std::runtime_error("Error reading data file");
+
+            return res;
+        }
+    }
+};
+
+
+// Create reader of given type for data file described by index, optionally verifying data checksums
+inline std::unique_ptr<batch_reader> create_batch_reader(const std::string & type, const std::string & file_name, const batch_learn::file_index & index, bool verify, uint io_depth) {
+    if (type == "buffered")
+        return std::unique_ptr<batch_reader>(new buffered_batch_reader(file_name, index, verify));
+    else if (type == "mmap")
+        return std::unique_ptr<batch_reader>(new mmap_batch_reader(file_name, index, verify));
+    else if (type == "uring")
+        return std::unique_ptr<batch_reader>(new uring_batch_reader(file_name, index, verify, io_depth, false));
+    else if (type == "uring-direct")
+        return std::unique_ptr<batch_reader>(new uring_batch_reader(file_name, index, verify, io_depth, true));
+    else
+        throw std::runtime_error("Unknown reader " + type + ", supported readers: buffered, mmap, uring, uring-direct");
+}
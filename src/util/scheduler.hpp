@@ -0,0 +1,174 @@
+#pragma once
+
+#include "parallel.hpp"
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+#include <algorithm>
+
+#include <omp.h>
+
+
+// Work-stealing scheduler of loop items over OpenMP threads (which keep their pinning).
+//
+// Items of each phase are split into contiguous per-thread ranges. Thread takes items from the front
+// of its own range and, when it's empty, steals back half of the largest remaining range of other thread,
+// so there is no shared counter and work is split on demand at the tail. Thread which finds no items
+// of a phase moves on to next one without barrier, so tail of a phase overlaps start of the next one.
+class work_stealing_scheduler {
+    // Range is changed under its mutex, bounds are atomic as stealing threads look for victim without locking
+    struct item_range {
+        std::mutex mutex;
+        std::atomic<uint64_t> begin{0}, end{0};
+        uint64_t hinted = 0; // Items up to this one were passed to prefetch
+        char padding[64]; // Keep ranges of threads in separate cache lines
+    };
+
+    uint n_threads;
+    uint prefetch_distance;
+public:
+    // Thread count as in OpenMP parallel regions, prefetch is called for given number of next own items
+    work_stealing_scheduler(uint n_threads = 0, uint prefetch_distance = 1):
+        n_threads(n_threads > 0 ? n_threads : omp_get_max_threads()), prefetch_distance(prefetch_distance) {}
+
+    // Process phases of given sizes: body(phase, item) for each item, prefetch(phase, item) before it's likely
+    // processed, phase_done(phase) by thread completing its last item. Exception stops scheduling and is rethrown.
+    template <typename B, typename P, typename D>
+    void run(const std::vector<uint64_t> & phase_sizes, B body, P prefetch, D phase_done) {
+        uint n_phases = phase_sizes.size();
+
+        std::vector<item_range> ranges(n_phases * n_threads);
+        std::vector<std::atomic<uint64_t>> completed(n_phases);
+
+        for (uint p = 0; p < n_phases; ++ p) {
+            completed[p] = 0;
+
+            for (uint t = 0; t < n_threads; ++ t) {
+                auto & r = ranges[p * n_threads + t];
+
+                r.hinted = phase_sizes[p] * t / n_threads;
+                r.begin.store(r.hinted, std::memory_order_relaxed);
+                r.end.store(phase_sizes[p] * (t + 1) / n_threads, std::memory_order_relaxed);
+            }
+        }
+
+        // Empty phases are done right away
+        for (uint p = 0; p < n_phases; ++ p)
+            if (phase_sizes[p] == 0)
+                phase_done(p);
+
+        parallel_error error;
+
+        #pragma omp parallel num_threads(n_threads)
+        {
+            uint t = omp_get_thread_num();
+
+            for (uint p = 0; p < n_phases && !error.occurred(); ++ p) {
+                item_range * phase_ranges = ranges.data() + p * n_threads;
+                uint64_t item;
+
+                while (!error.occurred() && (take(phase_ranges[t], item) || steal(phase_ranges, t, item))) {
+                    error.run([&] {
+                        hint(phase_ranges[t], p, prefetch);
+
+                        body(p, item);
+
+                        if (++ completed[p] == phase_sizes[p])
+                            phase_done(p);
+                    });
+                }
+            }
+        }
+
+        error.rethrow();
+    }
+private:
+    static bool take(item_range & r, uint64_t & item) {
+        std::lock_guard<std::mutex> lock(r.mutex);
+
+        uint64_t begin = r.begin.load(std::memory_order_relaxed);
+
+        if (begin >= r.end.load(std::memory_order_relaxed))
+            return false;
+
+        item = begin;
+        r.begin.store(begin + 1, std::memory_order_relaxed);
+
+        return true;
+    }
+
+    // Take upper half of largest range of other threads, first item of it is returned and the rest becomes own range
+    bool steal(item_range * ranges, uint t, uint64_t & item) {
+        while (true) {
+            uint victim = t;
+            uint64_t victim_size = 0;
+
+            for (uint v = 0; v < n_threads; ++ v) {
+                uint64_t begin = ranges[v].begin.load(std::memory_order_relaxed), end = ranges[v].end.load(std::memory_order_relaxed); // Approximate, checked under lock below
+
+                if (v != t && end > begin && end - begin > victim_size) {
+                    victim = v;
+                    victim_size = end - begin;
+                }
+            }
+
+            if (victim == t)
+                return false;
+
+            uint64_t from, to;
+
+            {
+                std::lock_guard<std::mutex> lock(ranges[victim].mutex);
+
+                auto & r = ranges[victim];
+
+                uint64_t begin = r.begin.load(std::memory_order_relaxed), end = r.end.load(std::memory_order_relaxed);
+
+                if (begin >= end)
+                    continue; // Taken meanwhile, look for other victim
+
+                from = begin + (end - begin) / 2;
+                to = end;
+
+                if (from == begin) { // Single item left
+                    r.begin.store(to, std::memory_order_relaxed);
+                    from = to - 1;
+                } else {
+                    r.end.store(from, std::memory_order_relaxed);
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(ranges[t].mutex);
+
+            item = from;
+            ranges[t].hinted = from + 1;
+            ranges[t].begin.store(from + 1, std::memory_order_relaxed);
+            ranges[t].end.store(to, std::memory_order_relaxed);
+
+            return true;
+        }
+    }
+
+    // Pass next own items to prefetch, each once
+    template <typename P>
+    void hint(item_range & r, uint phase, P prefetch) {
+        uint64_t from, to;
+
+        {
+            std::lock_guard<std::mutex> lock(r.mutex);
+
+            uint64_t begin = r.begin.load(std::memory_order_relaxed), end = r.end.load(std::memory_order_relaxed);
+
+            from = std::max(r.hinted, begin);
+            to = std::min(end, begin + prefetch_distance);
+
+            r.hinted = std::max(from, to);
+        }
+
+        for (uint64_t item = from; item < to; ++ item)
+            prefetch(phase, item);
+    }
+};
@@ -0,0 +1,606 @@
+#pragma once
+
+#include "hash.hpp"
+
+#include <batch_learn.hpp>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <cstdio>
+
+#include <omp.h>
+
+#include <boost/format.hpp>
+
+// Size of input chunk read at once and split between parser threads
+constexpr size_t text_chunk_size = 16 * 1024 * 1024;
+
+
+inline uint32_t rehash(uint32_t x) {
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = (x >> 16) ^ x;
+    return x;
+}
+
+
+// Examples parsed from contiguous range of lines
+class parsed_block {
+public:
+    uint32_t n_index_bits;
+    uint32_t n_fields; // Max field + 1 seen in block
+    uint32_t n_indices; // Max index + 1 seen in block
+
+    std::vector<float> labels;
+    std::vector<uint64_t> groups;
+    std::vector<uint64_t> line_hashes;
+    std::vector<uint64_t> offsets; // Feature offsets of examples (size N + 1)
+    std::vector<batch_learn::feature> features;
+
+    std::vector<std::string> field_names; // Names of block-local fields if format has named fields
+public:
+    parsed_block(uint32_t n_index_bits = 0): n_index_bits(n_index_bits) {
+        clear();
+    }
+
+    void clear() {
+        n_fields = 0;
+        n_indices = 0;
+
+        labels.clear();
+        groups.clear();
+        line_hashes.clear();
+        offsets.clear();
+        offsets.push_back(0);
+        features.clear();
+        field_names.clear();
+    }
+
+    uint64_t size() const {
+        return labels.size();
+    }
+
+    void add_feature(uint32_t field, uint32_t index, float value) {
+        if (field >= n_fields)
+            n_fields = field + 1;
+
+        if (index >= n_indices)
+            n_indices = index + 1;
+
+        batch_learn::feature f;
+        f.index = (field << n_index_bits) | index;
+        f.value = value;
+
+        features.push_back(f);
+    }
+
+    void add_example(float label, uint64_t group, uint64_t line_hash) {
+        labels.push_back(label);
+        groups.push_back(group);
+        line_hashes.push_back(line_hash);
+        offsets.push_back(features.size());
+    }
+
+    // Drop features of partially parsed example
+    void rollback_example() {
+        features.resize(offsets.back());
+    }
+
+    // Block-local id of named field, resolved to global one when blocks are merged in input order
+    uint32_t local_field(const char * name, size_t name_size) {
+        for (uint32_t i = 0; i < field_names.size(); ++ i)
+            if (field_names[i].size() == name_size && memcmp(field_names[i].data(), name, name_size) == 0)
+                return i;
+
+        field_names.emplace_back(name, name_size);
+
+        return field_names.size() - 1;
+    }
+};
+
+
+// Parser of one text format, parse may be called concurrently from several threads
+class text_parser {
+public:
+    uint32_t n_index_bits;
+    bool hash_lines; // Compute hash of each raw line, used for line-based splits
+public:
+    text_parser(uint32_t n_index_bits): n_index_bits(n_index_bits), hash_lines(false) {}
+    virtual ~text_parser() {}
+
+    // Process first line of input if format has header, return false if line should be parsed as example
+    virtual bool parse_header(char * line) { return false; }
+
+    // Parse null-terminated line (without line break) and append example to block
+    virtual void parse(char * line, size_t line_size, uint64_t line_no, parsed_block & block) = 0;
+};
+
+
+// Parser of format with named fields, names are mapped to field numbers in order of first appearance
+class named_fields_text_parser : public text_parser {
+public:
+    std::vector<std::string> field_names;
+public:
+    named_fields_text_parser(uint32_t n_index_bits, const std::vector<std::string> & predefined_names): text_parser(n_index_bits), field_names(predefined_names) {}
+
+    // Replace block-local field ids by global ones, should be called sequentially in input order
+    void resolve_fields(parsed_block & block) {
+        if (block.field_names.empty())
+            return;
+
+        std::vector<uint32_t> global_ids;
+
+        for (auto & name : block.field_names) {
+            auto it = std::find(field_names.begin(), field_names.end(), name);
+
+            if (it == field_names.end())
+                it = field_names.insert(field_names.end(), name);
+
+            global_ids.push_back(it - field_names.begin());
+        }
+
+        uint32_t index_mask = (1ul << n_index_bits) - 1;
+
+        block.n_fields = 0;
+
+        for (auto & f : block.features) {
+            uint32_t field = global_ids[f.index >> n_index_bits];
+
+            f.index = (field << n_index_bits) | (f.index & index_mask);
+
+            if (field >= block.n_fields)
+                block.n_fields = field + 1;
+        }
+    }
+};
+
+
+class ffm_text_parser : public text_parser {
+    uint32_t rehash_indexes;
+public:
+    ffm_text_parser(uint32_t n_index_bits, uint32_t rehash_indexes): text_parser(n_index_bits), rehash_indexes(rehash_indexes) {}
+
+    virtual void parse(char * line, size_t line_size, uint64_t line_no, parsed_block & block) {
+        using boost::format;
+
+        uint64_t line_hash = hash_lines ? hash_bytes(line, line_size) : 0;
+
+        char * p = line + strspn(line, " \t");
+        float y = (atoi(p) > 0) ? 1.0f : -1.0f;
+
+        p += strcspn(p, " \t");
+
+        while (true) {
+            char * feature_char = p + strspn(p, " \t");
+
+            if (*feature_char == 0)
+                break;
+
+            p = feature_char + strcspn(feature_char, " \t");
+
+            if (*p != 0)
+                *p++ = 0;
+
+            char * index_delim = strchr(feature_char, ':');
+
+            if (index_delim == nullptr)
+                throw std::runtime_error(str(format("Invalid feature spec '%s' at line %d") % feature_char % line_no));
+
+            char * value_delim = strchr(index_delim + 1, ':');
+
+            if (value_delim == nullptr)
+                throw std::runtime_error(str(format("Invalid feature spec '%s' at line %d") % feature_char % line_no));
+
+            if (feature_char[0] == ':')
+                throw std::runtime_error(str(format("Empty field in '%s' at line %d") % feature_char % line_no));
+
+            if (index_delim[1] == ':')
+                throw std::runtime_error(str(format("Empty index in '%s' at line %d") % feature_char % line_no));
+
+            if (value_delim[1] == 0)
+                throw std::runtime_error(str(format("Empty value in '%s' at line %d") % feature_char % line_no));
+
+            uint field = atoi(feature_char);
+            uint index = atoi(index_delim + 1);
+            float value = atof(value_delim + 1);
+
+            if (rehash_indexes > 0)
+                index = rehash(index) % rehash_indexes;
+
+            block.add_feature(field, index, value);
+        }
+
+        block.add_example(y, 0, line_hash); // No group support in ffm format
+    }
+};
+
+
+// libsvm format: label idx:val ..., all features go to field 0, optional qid is used as group
+class libsvm_text_parser : public text_parser {
+    uint32_t rehash_indexes;
+public:
+    libsvm_text_parser(uint32_t n_index_bits, uint32_t rehash_indexes): text_parser(n_index_bits), rehash_indexes(rehash_indexes) {}
+
+    virtual void parse(char * line, size_t line_size, uint64_t line_no, parsed_block & block) {
+        using boost::format;
+
+        uint64_t line_hash = hash_lines ? hash_bytes(line, line_size) : 0;
+        uint64_t group = 0;
+
+        char * p = line + strspn(line, " \t");
+        float y = (atof(p) > 0) ? 1.0f : -1.0f;
+
+        p += strcspn(p, " \t");
+
+        while (true) {
+            char * feature_char = p + strspn(p, " \t");
+
+            if (*feature_char == 0 || *feature_char == '#') // Rest of line is comment
+                break;
+
+            p = feature_char + strcspn(feature_char, " \t");
+
+            if (*p != 0)
+                *p++ = 0;
+
+            char * value_delim = strchr(feature_char, ':');
+
+            if (value_delim == nullptr || value_delim == feature_char || value_delim[1] == 0)
+                throw std::runtime_error(str(format("Invalid feature spec '%s' at line %d") % feature_char % line_no));
+
+            if (strncmp(feature_char, "qid:", 4) == 0) {
+                group = strtoull(value_delim + 1, nullptr, 10);
+                continue;
+            }
+
+            uint index = atoi(feature_char);
+            float value = atof(value_delim + 1);
+
+            if (rehash_indexes > 0)
+                index = rehash(index) % rehash_indexes;
+
+            block.add_feature(0, index, value);
+        }
+
+        block.add_example(y, group, line_hash);
+    }
+};
+
+
+// Vowpal Wabbit format: label [importance] [tag]|ns feature[:value] ... |ns ..., namespaces become fields, feature names are hashed
+class vw_text_parser : public named_fields_text_parser {
+    uint32_t index_space;
+public:
+    vw_text_parser(uint32_t n_index_bits, uint32_t rehash_indexes, const std::vector<std::string> & namespaces): named_fields_text_parser(n_index_bits, namespaces) {
+        index_space = rehash_indexes > 0 ? rehash_indexes : (1u << n_index_bits);
+    }
+
+    virtual void parse(char * line, size_t line_size, uint64_t line_no, parsed_block & block) {
+        using boost::format;
+
+        uint64_t line_hash = hash_lines ? hash_bytes(line, line_size) : 0;
+
+        char * p = strchr(line, '|');
+
+        if (p == nullptr)
+            throw std::runtime_error(str(format("No namespaces at line %d") % line_no));
+
+        float y = (atof(line + strspn(line, " \t")) > 0) ? 1.0f : -1.0f;
+
+        while (p != nullptr) {
+            // Namespace name with optional scale, empty name is default namespace
+            char * ns = ++ p;
+            p += strcspn(p, " \t|");
+
+            char * ns_end = p;
+            float ns_scale = 1.0f;
+
+            char * scale_delim = (char *) memchr(ns, ':', ns_end - ns);
+            if (scale_delim != nullptr) {
+                ns_scale = atof(scale_delim + 1);
+                ns_end = scale_delim;
+            }
+
+            uint32_t field = block.local_field(ns, ns_end - ns);
+            uint64_t ns_hash = hash_bytes(ns, ns_end - ns);
+
+            // Features until next namespace
+            while (true) {
+                char * feature_char = p + strspn(p, " \t");
+
+                if (*feature_char == 0 || *feature_char == '|') {
+                    p = *feature_char == '|' ? feature_char : nullptr;
+                    break;
+                }
+
+                p = feature_char + strcspn(feature_char, " \t|");
+
+                char * feature_end = p;
+                float value = 1.0f;
+
+                char * value_delim = (char *) memchr(feature_char, ':', feature_end - feature_char);
+                if (value_delim != nullptr) {
+                    char saved = *feature_end;
+
+                    *feature_end = 0;
+                    value = atof(value_delim + 1);
+                    *feature_end = saved;
+
+                    feature_end = value_delim;
+                }
+
+                if (feature_end == feature_char)
+                    throw std::runtime_error(str(format("Empty feature name at line %d") % line_no));
+
+                block.add_feature(field, hash_bytes(feature_char, feature_end - feature_char, ns_hash) % index_space, value * ns_scale);
+            }
+        }
+
+        block.add_example(y, 0, line_hash);
+    }
+};
+
+
+// Delimited text where each column is a field, categorical values are hashed and numeric bucketized
+class csv_text_parser : public text_parser {
+public:
+    enum column_type { categorical_column, numeric_column, label_column, group_column, skip_column };
+private:
+    char delimiter;
+    bool has_header;
+    uint32_t index_space;
+
+    std::vector<column_type> column_types; // Types of first columns, rest are categorical
+    std::vector<uint32_t> column_fields; // Field of each typed column
+    uint32_t n_typed_fields;
+public:
+    csv_text_parser(uint32_t n_index_bits, uint32_t rehash_indexes, char delimiter, bool has_header, const std::vector<column_type> & types):
+        text_parser(n_index_bits), delimiter(delimiter), has_header(has_header), column_types(types) {
+
+        index_space = rehash_indexes > 0 ? rehash_indexes : (1u << n_index_bits);
+
+        n_typed_fields = 0;
+        for (auto type : column_types)
+            column_fields.push_back((type == categorical_column || type == numeric_column) ? n_typed_fields ++ : 0);
+    }
+
+    virtual bool parse_header(char * line) {
+        return has_header;
+    }
+
+    virtual void parse(char * line, size_t line_size, uint64_t line_no, parsed_block & block) {
+        using boost::format;
+
+        uint64_t line_hash = hash_lines ? hash_bytes(line, line_size) : 0;
+
+        float y = -1.0f;
+        uint64_t group = 0;
+
+        char * end = line + line_size;
+        char * p = line;
+
+        for (uint32_t col = 0; p <= end; ++ col) {
+            char * value = p;
+            char * value_end = (char *) memchr(p, delimiter, end - p);
+
+            if (value_end == nullptr)
+                value_end = end;
+
+            *value_end = 0;
+            p = value_end + 1;
+
+            column_type type = col < column_types.size() ? column_types[col] : categorical_column;
+            uint32_t field = col < column_types.size() ? column_fields[col] : n_typed_fields + (col - column_types.size());
+
+            if (value == value_end) // Missing value
+                continue;
+
+            switch (type) {
+            case label_column:
+                y = (atoi(value) > 0) ? 1.0f : -1.0f;
+                break;
+            case group_column: {
+                char * group_end;
+                group = strtoull(value, &group_end, 10);
+
+                if (group_end != value_end) // Non-numeric group, use its hash
+                    group = hash_bytes(value, value_end - value);
+
+                break;
+            }
+            case numeric_column: {
+                char * number_end;
+                float number = strtof(value, &number_end);
+
+                if (number_end != value_end)
+                    throw std::runtime_error(str(format("Invalid numeric value '%s' in column %d at line %d") % value % col % line_no));
+
+                block.add_feature(field, numeric_bucket(number), 1.0f);
+                break;
+            }
+            case categorical_column:
+                block.add_feature(field, hash_bytes(value, value_end - value, field) % index_space, 1.0f);
+                break;
+            case skip_column:
+                break;
+            }
+        }
+
+        block.add_example(y, group, line_hash);
+    }
+
+    // Bucket small values by themselves and larger logarithmically
+    static uint32_t numeric_bucket(float x) {
+        if (!(x >= -1)) // Also catches NaN
+            return 0;
+
+        if (x <= 2)
+            return uint32_t(floor(x)) + 2; // -1, 0, 1, 2 go to buckets 1 to 4
+
+        float l = log(x);
+        return uint32_t(l * l) + 5;
+    }
+
+    // Parse column list like "1-13,15"
+    static std::vector<uint32_t> parse_columns(const std::string & spec) {
+        std::vector<uint32_t> columns;
+
+        for (size_t pos = 0; pos < spec.size();) {
+            size_t next = spec.find(',', pos);
+
+            if (next == std::string::npos)
+                next = spec.size();
+
+            std::string range = spec.substr(pos, next - pos);
+            size_t dash = range.find('-');
+
+            if (range.empty())
+                throw std::runtime_error(std::string("Invalid column list '") + spec + "'");
+
+            uint32_t from = std::stoul(range.substr(0, dash));
+            uint32_t to = dash == std::string::npos ? from : std::stoul(range.substr(dash + 1));
+
+            for (uint32_t c = from; c <= to; ++ c)
+                columns.push_back(c);
+
+            pos = next + 1;
+        }
+
+        return columns;
+    }
+};
+
+
+// Read input in large chunks, split each chunk into lines and parse them in parallel,
+// parsed blocks are passed to consumer sequentially in input order, consumer may take block contents by swapping
+template <typename C>
+void parse_text_parallel(FILE * file, text_parser & parser, C consume, int n_threads = 0) {
+    using namespace std;
+
+    if (n_threads <= 0)
+        n_threads = omp_get_max_threads();
+
+    vector<char> chunk(text_chunk_size + 1);
+    vector<char *> lines;
+    vector<parsed_block> blocks(n_threads, parsed_block(parser.n_index_bits));
+    vector<string> errors(n_threads);
+
+    size_t chunk_filled = 0;
+    uint64_t line_no = 0;
+    bool first_line = true;
+    bool eof = false;
+
+    while (!eof) {
+        size_t read = fread(chunk.data() + chunk_filled, 1, chunk.size() - 1 - chunk_filled, file);
+
+        chunk_filled += read;
+        eof = (chunk_filled < chunk.size() - 1);
+
+        if (ferror(file))
+            throw runtime_error("Error reading input");
+
+        // Find complete lines in chunk, memchr is vectorized
+        char * chunk_end = chunk.data() + chunk_filled;
+        char * p = chunk.data();
+
+        lines.clear();
+        while (p < chunk_end) {
+            char * nl = (char *) memchr(p, '\n', chunk_end - p);
+
+            if (nl == nullptr) {
+                if (!eof)
+                    break;
+
+                nl = chunk_end; // Last line without line break
+            }
+
+            lines.push_back(p);
+            p = nl + 1;
+        }
+
+        size_t tail_start = p - chunk.data();
+        lines.push_back(p); // Sentinel, start of incomplete line
+
+        if (lines.size() == 1 && !eof) { // Line doesn't fit into chunk, grow it
+            chunk.resize(chunk.size() * 2);
+            continue;
+        }
+
+        // Terminate lines, strip line breaks
+        for (size_t li = 0; li + 1 < lines.size(); ++ li) {
+            char * line_end = lines[li + 1] - 1;
+
+            if (line_end >= chunk_end)
+                line_end = chunk_end;
+
+            *line_end = 0;
+
+            if (line_end > lines[li] && line_end[-1] == '\r')
+                line_end[-1] = 0;
+        }
+
+        size_t first = 0;
+
+        if (first_line && lines.size() > 1) {
+            if (parser.parse_header(lines[0]))
+                first = 1;
+
+            first_line = false;
+        }
+
+        uint64_t n_lines = lines.size() - 1;
+
+        #pragma omp parallel num_threads(n_threads)
+        {
+            int t = omp_get_thread_num();
+            parsed_block & block = blocks[t];
+
+            block.clear();
+
+            uint64_t from = first + (n_lines - first) * t / n_threads;
+            uint64_t to = first + (n_lines - first) * (t + 1) / n_threads;
+
+            try {
+                for (uint64_t li = from; li < to; ++ li) {
+                    char * line = lines[li];
+
+                    if (*line == 0) // Skip empty lines
+                        continue;
+
+                    try {
+                        parser.parse(line, strlen(line), line_no + li + 1, block);
+                    } catch (...) {
+                        block.rollback_example();
+                        throw;
+                    }
+                }
+            } catch (exception & e) {
+                errors[t] = e.what();
+            }
+        }
+
+        for (int t = 0; t < n_threads; ++ t)
+            if (!errors[t].empty())
+                throw runtime_error(errors[t]);
+
+        auto named_parser = dynamic_cast<named_fields_text_parser *>(&parser);
+
+        for (int t = 0; t < n_threads; ++ t) {
+            if (named_parser != nullptr)
+                named_parser->resolve_fields(blocks[t]);
+
+            consume(blocks[t]);
+        }
+
+        line_no += n_lines;
+
+        // Move incomplete line to chunk start
+        chunk_filled -= std::min(tail_start, chunk_filled);
+        memmove(chunk.data(), chunk.data() + tail_start, chunk_filled);
+    }
+}
@@ -0,0 +1,390 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <set>
+#include <tuple>
+#include <stdexcept>
+#include <cmath>
+
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include <linux/mempolicy.h>
+
+
+// Read first line of small sysfs or procfs file, empty string if it doesn't exist
+inline std::string read_sys_file(const std::string & file_name) {
+    std::ifstream in(file_name);
+    std::string line;
+
+    std::getline(in, line);
+
+    return line;
+}
+
+
+// Parse kernel cpu list like 0-3,8,10-11
+inline std::vector<int> parse_cpu_list(const std::string & list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string part;
+
+    while (std::getline(ss, part, ',')) {
+        if (part.empty())
+            continue;
+
+        auto dash = part.find('-');
+
+        int from = std::stoi(part.substr(0, dash));
+        int to = dash == std::string::npos ? from : std::stoi(part.substr(dash + 1));
+
+        for (int cpu = from; cpu <= to; ++ cpu)
+            cpus.push_back(cpu);
+    }
+
+    return cpus;
+}
+
+
+struct cpu_info {
+    int cpu;
+    int package;
+    int core;
+    int node;
+};
+
+
+// Processors available to the process with their placement, read from sysfs
+class cpu_topology {
+public:
+    std::vector<cpu_info> cpus; // Cpus from affinity mask
+    int n_nodes, n_packages, n_cores;
+
+    double quota; // Cgroup cpu quota in cpus, 0 if unlimited
+public:
+    cpu_topology(): n_nodes(1), n_packages(1), n_cores(0), quota(0) {
+        using namespace std;
+
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+
+        if (sched_getaffinity(0, sizeof(mask), &mask) != 0)
+            throw runtime_error("Can't get process affinity mask");
+
+        // Node of each cpu
+        vector<int> cpu_nodes;
+
+        for (int node : parse_cpu_list(read_sys_file("/sys/devices/system/node/possible"))) {
+            string list = read_sys_file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+
+            for (int cpu : parse_cpu_list(list)) {
+                if (cpu >= int(cpu_nodes.size()))
+                    cpu_nodes.resize(cpu + 1, 0);
+
+                cpu_nodes[cpu] = node;
+            }
+        }
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++ cpu) {
+            if (!CPU_ISSET(cpu, &mask))
+                continue;
+
+            string topology_dir = "/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/";
+            string package = read_sys_file(topology_dir + "physical_package_id");
+            string core = read_sys_file(topology_dir + "core_id");
+
+            cpu_info info;
+            info.cpu = cpu;
+            info.package = package.empty() ? 0 : stoi(package);
+            info.core = core.empty() ? cpu : stoi(core);
+            info.node = cpu < int(cpu_nodes.size()) ? cpu_nodes[cpu] : 0;
+
+            cpus.push_back(info);
+        }
+
+        vector<int> nodes, packages;
+        vector<pair<int, int>> cores;
+
+        for (auto & c : cpus) {
+            nodes.push_back(c.node);
+            packages.push_back(c.package);
+            cores.push_back(make_pair(c.package, c.core));
+        }
+
+        n_nodes = count_distinct(nodes);
+        n_packages = count_distinct(packages);
+        n_cores = count_distinct(cores);
+
+        quota = read_cpu_quota();
+    }
+
+    // Number of threads to use by default: available cpus, limited by quota
+    uint auto_threads() const {
+        uint n = cpus.size();
+
+        if (quota > 0)
+            n = std::min<uint>(n, std::max<uint>(1, uint(std::ceil(quota))));
+
+        return std::max<uint>(n, 1);
+    }
+
+    // Cpu sets of threads for given pinning strategy:
+    //   compact - fill all hyperthreads of core, then cores of package, then next package
+    //   scatter - spread over packages first, then over cores, hyperthreads last
+    //   numa - spread over nodes, thread may run on any cpu of its node
+    std::vector<std::vector<int>> placement(const std::string & strategy, uint n_threads) const {
+        using namespace std;
+
+        vector<cpu_info> order = cpus;
+        vector<vector<int>> sets;
+
+        if (strategy == "compact") {
+            sort(order.begin(), order.end(), [](const cpu_info & a, const cpu_info & b) {
+                return make_tuple(a.node, a.package, a.core, a.cpu) < make_tuple(b.node, b.package, b.core, b.cpu);
+            });
+        } else if (strategy == "scatter") {
+            // Rank of cpu among hyperthreads of its core and rank of core in its package
+            vector<int> thread_rank(order.size(), 0), core_rank(order.size(), 0);
+
+            for (size_t i = 0; i < order.size(); ++ i) {
+                set<int> lower_cores;
+
+                for (size_t j = 0; j < order.size(); ++ j) {
+                    if (order[j].package != order[i].package)
+                        continue;
+
+                    if (order[j].core == order[i].core && order[j].cpu < order[i].cpu)
+                        thread_rank[i] ++;
+
+                    if (order[j].core < order[i].core)
+                        lower_cores.insert(order[j].core);
+                }
+
+                core_rank[i] = lower_cores.size();
+            }
+
+            vector<size_t> idx(order.size());
+            for (size_t i = 0; i < idx.size(); ++ i)
+                idx[i] = i;
+
+            sort(idx.begin(), idx.end(), [&](size_t a, size_t b) {
+                return make_tuple(thread_rank[a], core_rank[a], order[a].package, order[a].cpu) < make_tuple(thread_rank[b], core_rank[b], order[b].package, order[b].cpu);
+            });
+
+            vector<cpu_info> sorted;
+            for (auto i : idx)
+                sorted.push_back(order[i]);
+
+            order = sorted;
+        } else if (strategy == "numa") {
+            vector<int> nodes = node_list();
+
+            for (uint t = 0; t < n_threads; ++ t)
+                sets.push_back(node_cpus(nodes[t % nodes.size()]));
+
+            return sets;
+        } else {
+            throw runtime_error("Unknown pinning strategy " + strategy + ", supported strategies: none, compact, scatter, numa");
+        }
+
+        for (uint t = 0; t < n_threads; ++ t)
+            sets.push_back(vector<int> { order[t % order.size()].cpu });
+
+        return sets;
+    }
+
+    // Distinct nodes of available cpus in ascending order
+    std::vector<int> node_list() const {
+        std::vector<int> nodes;
+
+        for (auto & c : cpus)
+            nodes.push_back(c.node);
+
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+        return nodes;
+    }
+
+    // Available cpus of node, all available cpus if there is no such node
+    std::vector<int> node_cpus(int node) const {
+        std::vector<int> result;
+
+        for (auto & c : cpus)
+            if (c.node == node)
+                result.push_back(c.cpu);
+
+        if (result.empty())
+            for (auto & c : cpus)
+                result.push_back(c.cpu);
+
+        return result;
+    }
+
+    std::string describe() const {
+        std::string desc = std::to_string(n_nodes) + " numa nodes, " + std::to_string(n_packages) + " packages, " + std::to_string(n_cores) + " cores, " + std::to_string(cpus.size()) + " cpus available";
+
+        if (quota > 0) {
+            std::ostringstream ss;
+            ss.precision(2);
+            ss << std::fixed << quota;
+            desc += ", cpu quota " + ss.str();
+        }
+
+        return desc;
+    }
+private:
+    template <typename T>
+    static int count_distinct(std::vector<T> values) {
+        std::sort(values.begin(), values.end());
+        return std::unique(values.begin(), values.end()) - values.begin();
+    }
+
+    // Cgroup v2 cpu.max or v1 cfs quota of process cgroup
+    static double read_cpu_quota() {
+        using namespace std;
+
+        string cgroup_path;
+        ifstream cgroup("/proc/self/cgroup");
+
+        for (string line; getline(cgroup, line);) {
+            if (line.compare(0, 3, "0::") == 0) { // Unified hierarchy
+                cgroup_path = line.substr(3);
+
+                string max = read_sys_file("/sys/fs/cgroup" + cgroup_path + "/cpu.max");
+
+                if (max.empty())
+                    max = read_sys_file("/sys/fs/cgroup/cpu.max");
+
+                istringstream ss(max);
+                string limit;
+                double period = 0;
+
+                if (ss >> limit >> period && limit != "max" && period > 0)
+                    return stod(limit) / period;
+            }
+        }
+
+        string quota = read_sys_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        string period = read_sys_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+
+        if (!quota.empty() && !period.empty() && stod(quota) > 0 && stod(period) > 0)
+            return stod(quota) / stod(period);
+
+        return 0;
+    }
+};
+
+
+// Pin calling thread to given cpus
+inline void pin_thread(const std::vector<int> & cpus) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+
+    for (int cpu : cpus)
+        CPU_SET(cpu, &mask);
+
+    if (sched_setaffinity(0, sizeof(mask), &mask) != 0)
+        throw std::runtime_error("Can't set thread affinity");
+}
+
+
+// Numa node of block device holding given file, -1 if unknown
+inline int file_numa_node(const std::string & file_name) {
+    using namespace std;
+
+    struct stat st;
+    if (stat(file_name.c_str(), &st) != 0)
+        return -1;
+
+    char resolved[PATH_MAX];
+    string dev_path = "/sys/dev/block/" + to_string(major(st.st_dev)) + ":" + to_string(minor(st.st_dev));
+
+    if (realpath(dev_path.c_str(), resolved) == nullptr)
+        return -1;
+
+    // Walk up from partition to the device which knows its node
+    for (string path = resolved; path.size() > string("/sys/devices").size(); path = path.substr(0, path.rfind('/'))) {
+        string node = read_sys_file(path + "/device/numa_node");
+
+        if (node.empty())
+            node = read_sys_file(path + "/numa_node");
+
+        if (!node.empty())
+            return stoi(node);
+    }
+
+    return -1;
+}
+
+
+// Parse thread count option, auto means all available cpus within quota
+inline uint parse_thread_count(const std::string & spec, const cpu_topology & topology) {
+    if (spec == "auto")
+        return topology.auto_threads();
+
+    int n = std::stoi(spec);
+
+    if (n <= 0)
+        throw std::runtime_error("Thread count should be positive or auto");
+
+    return n;
+}
+
+
+// Numa node of cpu the calling thread runs on, 0 if unknown
+inline int current_numa_node() {
+    unsigned cpu = 0, node = 0;
+
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+        return 0;
+
+    return node;
+}
+
+
+// Total memory of numa node in bytes, 0 if unknown
+inline uint64_t node_memory(int node) {
+    std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/meminfo");
+
+    for (std::string line; std::getline(in, line);) {
+        auto pos = line.find("MemTotal:");
+
+        if (pos != std::string::npos)
+            return std::stoull(line.substr(pos + 9)) * 1024;
+    }
+
+    return 0;
+}
+
+
+// Set memory policy of page-aligned part of the range: bind to given nodes (preferring first one if only one is
+// given) or interleave over them. Pages should not be touched yet. Returns false if kernel refused policy
+inline bool bind_memory(void * ptr, size_t size, const std::vector<int> & nodes, bool interleave = false) {
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    uintptr_t begin = (uintptr_t(ptr) + page_size - 1) / page_size * page_size;
+    uintptr_t end = (uintptr_t(ptr) + size) / page_size * page_size;
+
+    if (end <= begin || nodes.empty())
+        return true;
+
+    unsigned long mask[16] = {};
+
+    for (int node : nodes)
+        if (node >= 0 && node < int(sizeof(mask) * 8))
+            mask[node / 64] |= 1ul << (node % 64);
+
+    int mode = interleave ? MPOL_INTERLEAVE : nodes.size() == 1 ? MPOL_PREFERRED : MPOL_BIND;
+
+    return syscall(SYS_mbind, begin, end - begin, mode, mask, sizeof(mask) * 8, 0) == 0;
+}
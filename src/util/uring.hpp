@@ -0,0 +1,181 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+// Minimal io_uring wrapper over raw system calls, not thread-safe
+class uring {
+    int ring_fd;
+
+    void * sq_ptr;
+    void * cq_ptr;
+    size_t sq_size, cq_size;
+
+    io_uring_sqe * sqes;
+    size_t sqes_size;
+
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    io_uring_cqe * cqes;
+
+    unsigned n_entries;
+    unsigned n_queued; // Prepared but not yet submitted entries
+public:
+    uring(unsigned entries): n_queued(0) {
+        using namespace std;
+
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+
+        if (ring_fd < 0)
+            throw runtime_error(string("Can't setup io_uring: ") + strerror(errno));
+
+        n_entries = params.sq_entries;
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size = cq_size = max(sq_size, cq_size);
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+
+        if (sq_ptr == MAP_FAILED)
+            throw runtime_error("Can't map io_uring submission queue");
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+
+            if (cq_ptr == MAP_FAILED)
+                throw runtime_error("Can't map io_uring completion queue");
+        }
+
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+        if (sqes == MAP_FAILED)
+            throw runtime_error("Can't map io_uring submission entries");
+
+        char * sq = (char *) sq_ptr;
+        sq_head = (unsigned *) (sq + params.sq_off.head);
+        sq_tail = (unsigned *) (sq + params.sq_off.tail);
+        sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+        sq_array = (unsigned *) (sq + params.sq_off.array);
+
+        char * cq = (char *) cq_ptr;
+        cq_head = (unsigned *) (cq + params.cq_off.head);
+        cq_tail = (unsigned *) (cq + params.cq_off.tail);
+        cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+    }
+
+    uring(const uring &) = delete;
+    uring & operator = (const uring &) = delete;
+
+    ~uring() {
+        munmap(sqes, sqes_size);
+
+        if (cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+
+        munmap(sq_ptr, sq_size);
+        close(ring_fd);
+    }
+
+    unsigned size() const {
+        return n_entries;
+    }
+
+    // Register buffers for fixed reads, buffer index is passed to prepare_read
+    void register_buffers(const iovec * buffers, unsigned n_buffers) {
+        syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffers, n_buffers) < 0)
+            throw std::runtime_error(std::string("Can't register io_uring buffers: ") + strerror(errno));
+    }
+
+    // Queue read request, buffer_index < 0 means buffer isn't registered
+    void prepare_read(int fd, void * buffer, unsigned size, uint64_t offset, int buffer_index, uint64_t user_data) {
+        unsigned tail = *sq_tail;
+
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= n_entries)
+            throw std::runtime_error("io_uring submission queue is full");
+
+        unsigned idx = tail & *sq_mask;
+        io_uring_sqe * sqe = sqes + idx;
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = buffer_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) buffer;
+        sqe->len = size;
+        sqe->off = offset;
+        sqe->buf_index = buffer_index >= 0 ? buffer_index : 0;
+        sqe->user_data = user_data;
+
+        sq_array[idx] = idx;
+
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        n_queued ++;
+    }
+
+    // Submit queued requests and wait for at least min_complete completions
+    void submit(unsigned min_complete = 0) {
+        while (true) {
+            int res = syscall(__NR_io_uring_enter, ring_fd, n_queued, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+            if (res >= 0) {
+                n_queued -= res;
+                return;
+            }
+
+            if (errno != EINTR)
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+        }
+    }
+
+    // Wait for at least min_complete completions without submitting, so it may run while other thread queues
+    // and submits requests (under its own lock), but only one thread should pop completions
+    void wait(unsigned min_complete = 1) {
+        while (syscall(__NR_io_uring_enter, ring_fd, 0, min_complete, IORING_ENTER_GETEVENTS, nullptr, 0) < 0)
+            if (errno != EINTR)
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+    }
+
+    // Pop next completion if available
+    bool pop_completion(uint64_t & user_data, int & result) {
+        unsigned head = *cq_head;
+
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+
+        io_uring_cqe * cqe = cqes + (head & *cq_mask);
+
+        user_data = cqe->user_data;
+        result = cqe->res;
+
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+        return true;
+    }
+};